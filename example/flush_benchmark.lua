@@ -0,0 +1,76 @@
+local moon = require("moon")
+local json = require("json")
+local socket = require("moon.socket")
+
+local conf = ...
+
+conf.host = "127.0.0.1"
+conf.port = 33891
+
+-- A gate pushing several small messages to every client on each tick, with and without
+-- socket.set_deferred_flush. net_writes counts the socket write operations of the worker.
+local CLIENTS = 100
+local PER_TICK = 10
+local TICKS = 500
+
+local payload = string.rep("x", 32)
+
+local function net_writes()
+    local n = 0
+    for _, w in ipairs(json.decode(moon.server_stats())) do
+        n = n + (w.net_writes or 0)
+    end
+    return n
+end
+
+local received = 0
+
+socket.on("message", function()
+    received = received + 1
+end)
+
+local function run(deferred)
+    local listenfd = socket.listen(conf.host, conf.port, moon.PTYPE_SOCKET_MOON)
+    socket.set_deferred_flush(listenfd, deferred)
+
+    local clients, gates = {}, {}
+    for i = 1, CLIENTS do
+        clients[i] = socket.connect(conf.host, conf.port, moon.PTYPE_SOCKET_MOON)
+        gates[i] = socket.accept(listenfd)
+    end
+    socket.close(listenfd)
+
+    received = 0
+    local total = CLIENTS * PER_TICK * TICKS
+    local writes = net_writes()
+    local start_time = moon.clock()
+    for _ = 1, TICKS do
+        for _, fd in ipairs(gates) do
+            for _ = 1, PER_TICK do
+                socket.write(fd, payload)
+            end
+        end
+        moon.sleep(1)
+    end
+    while received < total do
+        moon.sleep(1)
+    end
+    local cost = moon.clock() - start_time
+    writes = net_writes() - writes
+
+    print(string.format("deferred %-5s %8d messages %8d writes: %10.02f writes/s %6.02f messages/write",
+        tostring(deferred), total, writes, writes / cost, total / writes))
+
+    for i = 1, CLIENTS do
+        socket.close(clients[i])
+        socket.close(gates[i])
+    end
+end
+
+moon.async(function()
+    print(string.format("\ndeferred flush benchmark run at %s %d, %d clients, %d messages per tick.",
+        conf.host, conf.port, CLIENTS, PER_TICK))
+    run(false)
+    run(true)
+    moon.exit(0)
+end)
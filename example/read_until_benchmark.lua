@@ -0,0 +1,68 @@
+local moon = require("moon")
+local socket = require("moon.socket")
+
+local conf = ...
+
+conf.host = "127.0.0.1"
+conf.port = 33890
+
+-- socket.read(fd, delim) throughput on typical line protocols. The writer sends large blocks,
+-- so most lines are found in the read cache and the rest after partial reads.
+local function resp_block(n)
+    local t = {}
+    for i = 1, n do
+        local v = string.rep("v", 16 + i % 48)
+        t[#t + 1] = string.format("$%d\r\n%s\r\n", #v, v)
+    end
+    return table.concat(t)
+end
+
+local function http_block(n)
+    local header = table.concat({
+        "GET /index.html HTTP/1.1",
+        "Host: 127.0.0.1:33890",
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)",
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+        "Accept-Encoding: gzip, deflate",
+        "Connection: keep-alive",
+        "",
+        "",
+    }, "\r\n")
+    return string.rep(header, n)
+end
+
+local cases = {
+    { name = "resp lines", delim = "\r\n", block = resp_block(1000), lines = 2000, count = 500 },
+    { name = "http headers", delim = "\r\n\r\n", block = http_block(100), lines = 100, count = 2000 },
+    { name = "http lines", delim = "\r\n", block = http_block(100), lines = 700, count = 500 },
+}
+
+moon.async(function()
+    local listenfd = socket.listen(conf.host, conf.port, moon.PTYPE_SOCKET_TCP)
+    local writer = socket.connect(conf.host, conf.port, moon.PTYPE_SOCKET_TCP)
+    local reader = socket.accept(listenfd)
+    socket.close(listenfd)
+
+    print(string.format("\nread_until benchmark run at %s %d.", conf.host, conf.port))
+
+    for _, case in ipairs(cases) do
+        moon.async(function()
+            for _ = 1, case.count do
+                socket.write(writer, case.block)
+            end
+        end)
+
+        local start_time = moon.clock()
+        local total = case.lines * case.count
+        for _ = 1, total do
+            assert(socket.read(reader, case.delim))
+        end
+        local cost = moon.clock() - start_time
+        print(string.format("%-14s %8d reads: %10.02f reads/s %8.02f MB/s",
+            case.name, total, total / cost, #case.block * case.count / cost / 1024 / 1024))
+    end
+
+    socket.close(writer)
+    socket.close(reader)
+    moon.exit(0)
+end)
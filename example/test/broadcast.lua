@@ -0,0 +1,105 @@
+local moon = require("moon")
+local socket = require("moon.socket")
+local websocket = require("moon.http.websocket")
+local test_assert = require("test_assert")
+
+local conf = ...
+
+local HOST = conf.ip or "127.0.0.1"
+local PORT = math.tointeger(conf.port) or 30004
+local CLIENT_NUM = 10
+
+local function listen(protocol)
+    local fd = 0
+    while fd == 0 do
+        fd = socket.listen(HOST, PORT, protocol)
+        if fd == 0 then
+            PORT = PORT + 1
+        end
+    end
+    return fd, PORT
+end
+
+local function read_moon_message(fd)
+    local data = socket.read(fd, 2)
+    if not data then
+        return false
+    end
+    local len = string.unpack(">H", data)
+    return socket.read(fd, len)
+end
+
+------------------------PTYPE_SOCKET_MOON---------------------------
+
+local function test_moon(next_step)
+    local listenfd, port = listen(moon.PTYPE_SOCKET_MOON)
+    local accepted = {}
+
+    socket.on("accept", function(fd)
+        accepted[#accepted + 1] = fd
+        if #accepted == CLIENT_NUM then
+            test_assert.equal(socket.broadcast(accepted, "hello moon"), CLIENT_NUM)
+            test_assert.equal(socket.broadcast(accepted, "hello again"), CLIENT_NUM)
+        end
+    end)
+
+    socket.start(listenfd)
+
+    local done = 0
+    for _ = 1, CLIENT_NUM do
+        moon.async(function()
+            local fd = socket.connect(HOST, port, moon.PTYPE_SOCKET_TCP)
+            test_assert.equal(read_moon_message(fd), "hello moon")
+            test_assert.equal(read_moon_message(fd), "hello again")
+            socket.close(fd)
+            done = done + 1
+            if done == CLIENT_NUM then
+                socket.close(listenfd)
+                next_step()
+            end
+        end)
+    end
+end
+
+------------------------PTYPE_SOCKET_WS---------------------------
+
+local function test_websocket()
+    local listenfd, port = listen(moon.PTYPE_SOCKET_WS)
+    local accepted = {}
+    local received = 0
+
+    websocket.on_accept(function(fd)
+        accepted[#accepted + 1] = fd
+    end)
+
+    websocket.wson("message", function(fd, msg)
+        local data = moon.decode(msg, "Z")
+        received = received + 1
+        if data ~= "hello websocket" then
+            test_assert.equal(data, string.rep("x", 1000))
+        end
+        if received == CLIENT_NUM * 2 then
+            socket.close(listenfd)
+            test_assert.success()
+        end
+    end)
+
+    socket.start(listenfd)
+
+    moon.async(function()
+        -- broadcast after every client switched to websocket, frames sent earlier
+        -- would arrive while the client is still reading the http response
+        for _ = 1, CLIENT_NUM do
+            websocket.connect(string.format("ws://%s:%d/", HOST, port))
+        end
+        while #accepted < CLIENT_NUM do
+            moon.sleep(10)
+        end
+        test_assert.equal(websocket.broadcast_text(accepted, "hello websocket"), CLIENT_NUM)
+        test_assert.equal(websocket.broadcast(accepted, string.rep("x", 1000)), CLIENT_NUM)
+        -- fds not found are ignored
+        test_assert.equal(socket.broadcast({ 0x7FFFFFFF }, "nobody"), 0)
+    end)
+end
+
+test_moon(test_websocket)
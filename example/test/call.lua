@@ -27,6 +27,27 @@ if conf and conf.receiver then
         return total
     end
 
+    command.SLEEP = function(a)
+        moon.sleep(10)
+        return a
+    end
+
+    -- the caller is waiting in moon.call_direct, calling it back must fail
+    command.BACK = function(caller)
+        local ok, err = pcall(moon.call_direct, "lua", caller, "SUB", 1, 1)
+        return not ok and err
+    end
+
+    command.LOOP = function()
+        while true do end
+    end
+
+    -- interrupt whatever worker wid runs a little later
+    command.SIGNAL = function(wid)
+        moon.sleep(100)
+        moon.signal(wid, 0)
+    end
+
     command.EXIT = function()
         moon.quit()
         return true
@@ -82,6 +103,57 @@ else
 
             res = moon.call("lua", receiverid, "SUB", 100, 99)
             test_assert.equal(res, 1)
+
+            ------------------------moon.call_direct---------------------------
+            local threads = math.tointeger(moon.env("THREAD_NUM")) or 1
+            local worker = moon.id >> 24
+            local directid = moon.new_service({
+                name = "test_call_direct",
+                file = "call.lua",
+                receiver = true,
+                threadid = worker
+            })
+
+            -- answered before the handler yields: no timer can run in between
+            local ticked = false
+            moon.timeout(0, function() ticked = true end)
+            test_assert.equal(moon.call_direct("lua", directid, "MUL", 6, 7), 42)
+            test_assert.equal(ticked, false)
+
+            -- the handler yields first, the response comes as a message
+            test_assert.equal(moon.call_direct("lua", directid, "SLEEP", "late"), "late")
+            test_assert.equal(ticked, true)
+
+            res, err = moon.call_direct("lua", directid, "ADD", 1, 2)
+            test_assert.equal(res, false)
+            test_assert.assert(type(err) == "string" and #err > 0, "failed direct call should return error string")
+
+            err = moon.call_direct("lua", directid, "BACK", moon.id)
+            test_assert.assert(err and err:find("is not ready or is handling a message") ~= nil, "call back into the busy caller should fail")
+
+            ok, err = pcall(moon.call_direct, "lua", moon.id, "SUB", 1, 1)
+            test_assert.assert(not ok and err:find("is not another lua service") ~= nil, "moon.call_direct should reject self")
+
+            if threads > 1 then
+                local remoteid = moon.new_service({
+                    name = "test_call_remote",
+                    file = "call.lua",
+                    receiver = true,
+                    threadid = worker % threads + 1
+                })
+                ok, err = pcall(moon.call_direct, "lua", remoteid, "SUB", 1, 1)
+                test_assert.assert(not ok and err:find("is not another lua service") ~= nil, "moon.call_direct should reject other workers")
+
+                -- the signal reaches the target of the direct call, not the waiting caller
+                moon.send("lua", remoteid, "SIGNAL", worker)
+                res, err = moon.call_direct("lua", directid, "LOOP")
+                test_assert.equal(res, false)
+                test_assert.assert(err:find("interrupted by worker signal") ~= nil, "looping direct call target should be interrupted")
+                test_assert.equal(moon.call_direct("lua", directid, "MUL", 2, 3), 6)
+                moon.send("lua", remoteid, "EXIT")
+            end
+            moon.send("lua", directid, "EXIT")
+
             --Let receiver exit:
             moon.send("lua", receiverid,  "EXIT")
             moon.send("lua", receiverid,  "EXIT") -- trigger error
@@ -115,6 +115,46 @@ moon.async(function ()
     assert(rmd:func() == -100) --- output: before    1000    hello   -100
     print("Hot Fix Result",reload.update("old", "new"))
     assert(rmd:func() == 300) --- outpur: after     1       hello   300
+
+    ------------------------codecache---------------------------
+    local codecache = require("codecache")
+    local path = "codecache_test.lua"
+    local function write(content)
+        local f = assert(io.open(path, "wb"))
+        f:write(content)
+        f:close()
+    end
+
+    write("return 1")
+    test_assert.equal(loadfile(path)(), 1)
+    -- same size, a few ms later: seen through the mtime
+    moon.sleep(20)
+    write("return 2")
+    test_assert.equal(loadfile(path)(), 2)
+    -- the stamp may not change within one clock tick, invalidate drops the entry anyway
+    write("return 3")
+    codecache.invalidate(path)
+    test_assert.equal(loadfile(path)(), 3)
+
+    local bundle = "codecache_test.bundle"
+    test_assert.equal(codecache.dump(bundle, { path }), 1)
+    local data = io.readfile(bundle)
+    local magic, n, pos = string.unpack("c8I4", data)
+    test_assert.equal(magic, "MOONLCB\1")
+    test_assert.equal(n, 1)
+    pos = (pos - 1 + 15) // 16 * 16 + 1
+    local keylen, codelen, _, size, key
+    keylen, codelen, _, size, key, pos = string.unpack("I4I4i8i8z", data, pos)
+    test_assert.equal(key, path)
+    test_assert.equal(keylen, #path)
+    test_assert.equal(size, #"return 3")
+    pos = (pos - 1 + 15) // 16 * 16 + 1
+    test_assert.equal(load(data:sub(pos, pos + codelen - 1), "=bundle", "b")(), 3)
+
+    ok = pcall(codecache.dump, bundle, { path, 1 })
+    test_assert.assert(not ok, "codecache.dump should reject non-string file names")
+    os.remove(bundle)
+    os.remove(path)
     test_assert.success()
 end)
 
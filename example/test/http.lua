@@ -43,6 +43,11 @@ http_server.on("/json", function(request, response)
     response:write(json.encode({ ok = true, echoed = data.name }))
 end)
 
+http_server.on("/file", function(request, response)
+    response:write_header("Content-Type", "application/json")
+    response:write_file("twitter.json")
+end)
+
 http_server.listen("127.0.0.1",8001)
 
 moon.async(function()
@@ -67,6 +72,14 @@ moon.async(function()
     test_assert.equal(response.status_code, 404)
     test_assert.assert(type(response.body) == "string" and response.body:find("Cannot GET /not%-found") ~= nil, "404 body should mention missing path")
 
+    -- sendfile after the header, twice on the same keep-alive connection
+    local file = io.readfile("twitter.json")
+    for _ = 1, 2 do
+        response = httpc.get("http://127.0.0.1:8001/file")
+        test_assert.equal(response.status_code, 200)
+        test_assert.equal(response.body, file)
+    end
+
     local query = httpc.create_query_string({ a = "1", b = "hello world" })
     test_assert.assert(type(query) == "string" and #query > 0, "create_query_string should return non-empty string")
 
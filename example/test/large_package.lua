@@ -14,9 +14,14 @@ socket.on("accept",function(fd, m)
 	test_assert.assert(socket.set_enable_chunked(fd,"rw"),"set_enable_chunked failed!")
 end)
 
+local received = 0
+
 socket.on("message",function(_, msg)
 	test_assert.equal(moon.decode(msg, "Z"),data)
-	test_assert.success()
+	received = received + 1
+	if received == 2 then
+		test_assert.success()
+	end
 end)
 
 socket.on("close",function(_, msg)
@@ -33,6 +38,17 @@ moon.async(function (...)
 	test_assert.assert(fd>0,"connect server failed")
 	socket.set_enable_chunked(fd,"rw")
 	socket.write(fd, data)
+
+	-- 4 bytes length prefix, no chunks
+	local wide_listenfd = socket.listen("127.0.0.1", 30006, moon.PTYPE_SOCKET_MOON)
+	test_assert.assert(socket.set_length_prefix(wide_listenfd, 4), "set_length_prefix failed")
+	socket.start(wide_listenfd)
+
+	local wide_fd = socket.connect("127.0.0.1", 30006, moon.PTYPE_SOCKET_MOON)
+	test_assert.assert(wide_fd>0,"connect server failed")
+	test_assert.assert(socket.set_length_prefix(wide_fd, 4), "set_length_prefix failed")
+	test_assert.assert(not socket.set_length_prefix(wide_fd, 3), "invalid length prefix accepted")
+	socket.write(wide_fd, data)
 end)
 
 
@@ -1,3 +1,10 @@
+if _G["__init__"] then
+    return {
+        -- network.lua checks connection timeouts
+        timeout_granularity = 100,
+    }
+end
+
 local moon = require("moon")
 
 
@@ -20,6 +27,36 @@ local test_case =
         ip = "127.0.0.1",
         port =  "30001"
     },
+    {
+        name = "broadcast",
+        file = "broadcast.lua",
+        ip = "127.0.0.1",
+        port =  "30004"
+    },
+    {
+        name = "slow_consumer",
+        file = "slow_consumer.lua",
+        ip = "127.0.0.1",
+        port =  "30005"
+    },
+    {
+        name = "transfer",
+        file = "transfer.lua",
+        ip = "127.0.0.1",
+        port =  "30007"
+    },
+    {
+        name = "tls",
+        file = "tls.lua",
+        ip = "127.0.0.1",
+        port =  "30009"
+    },
+    {
+        name = "ws_deflate",
+        file = "ws_deflate.lua",
+        ip = "127.0.0.1",
+        port =  "30011"
+    },
     {
         name = "send",
         file = "send.lua"
@@ -33,21 +33,54 @@ test_assert.assert(not ok and type(invalid_err) == "string", "make_endpoint shou
 ok = pcall(socket.connect, HOST, PORT, "invalid-protocol")
 test_assert.assert(not ok, "socket.connect should reject unsupported protocol")
 
-ok = pcall(core.write, listenfd, "x", 64)
+ok = pcall(core.write, listenfd, "x", 128)
 test_assert.assert(not ok, "asio.write should reject invalid mask")
 
 socket.start(listenfd)
 
+local batch_count = 0
+local accept_count = 0
+
 socket.on("accept",function(fd, msg)
     --print("accept ", fd, moon.decode(msg, "Z"))
+    accept_count = accept_count + 1
+    if accept_count % 2 == 0 then
+        test_assert.assert(socket.set_read_cache(fd, 4096, true), "set_read_cache failed")
+    else
+        test_assert.assert(socket.set_deferred_flush(fd), "set_deferred_flush failed")
+    end
 end)
 
+-- fds of the read timeout case, by the first message of their client
+local timeout_fds = {}
+local timeout_close = {}
+
+local function watch_timeout(fd, data)
+    if data == "idle" or data == "keepalive" then
+        timeout_fds[fd] = data
+        socket.settimeout(fd, 1)
+    end
+end
+
 socket.on("message",function(fd, msg)
+    watch_timeout(fd, moon.decode(msg, "Z"))
     socket.write_message(fd, msg)
 end)
 
+socket.on("batch",function(fd, msg)
+    batch_count = batch_count + 1
+    for data in socket.frames(msg) do
+        watch_timeout(fd, data)
+        socket.write(fd, data)
+    end
+end)
+
 socket.on("close",function(fd, msg)
     --print("close ", fd, moon.decode(msg, "Z"))
+    local name = timeout_fds[fd]
+    if name then
+        timeout_close[name] = moon.decode(msg, "Z")
+    end
 end)
 
 ------------------------CLIENT----------------------------
@@ -80,6 +113,75 @@ local function session_read( fd )
     return data
 end
 
+local pending = 4
+local function done()
+    pending = pending - 1
+    if pending == 0 then
+        test_assert.assert(batch_count > 0, "no batch received")
+        socket.close(listenfd)
+        test_assert.success()
+    end
+end
+
+-- settimeout(fd, 1) on the server side, checked by the timer wheel every
+-- timeout_granularity ms (100 in main_test.lua)
+moon.async(function()
+    local idle = socket.connect(HOST, PORT, moon.PTYPE_SOCKET_TCP)
+    local keepalive = socket.connect(HOST, PORT, moon.PTYPE_SOCKET_TCP)
+
+    moon.async(function()
+        -- every message refreshes the receive time, the connection outlives its timeout
+        for _ = 1, 10 do
+            send(keepalive, "keepalive")
+            test_assert.equal(session_read(keepalive), "keepalive")
+            moon.sleep(300)
+        end
+        test_assert.assert(not timeout_close.keepalive, "active connection timed out")
+        socket.close(keepalive)
+        done()
+    end)
+
+    local start = moon.clock()
+    send(idle, "idle")
+    test_assert.equal(session_read(idle), "idle")
+    -- nothing more is sent, the server closes the connection
+    test_assert.equal(socket.read(idle, 1), false)
+    local elapsed = moon.clock() - start
+    test_assert.assert(elapsed >= 0.9 and elapsed < 1.8, "idle connection closed after " .. elapsed)
+    moon.sleep(10)
+    test_assert.assert(timeout_close.idle and timeout_close.idle:find("timeout", 1, true),
+        "idle connection closed for another reason")
+    socket.close(idle)
+    done()
+end)
+
+-- a delimiter split over two packets: "\r" ends the first read, "\n" starts the next one
+moon.async(function()
+    local split_port = PORT
+    local splitfd = 0
+    while splitfd == 0 do
+        split_port = split_port + 1
+        splitfd = socket.listen(HOST, split_port, moon.PTYPE_SOCKET_TCP)
+    end
+
+    moon.async(function()
+        local fd = socket.connect(HOST, split_port, moon.PTYPE_SOCKET_TCP)
+        socket.write(fd, "hello world\r")
+        moon.sleep(50)
+        socket.write(fd, "\nsecond line\r")
+        moon.sleep(50)
+        socket.write(fd, "\n")
+        socket.close(fd)
+    end)
+
+    local fd = socket.accept(splitfd)
+    test_assert.equal(socket.read(fd, "\r\n"), "hello world")
+    test_assert.equal(socket.read(fd, "\r\n"), "second line")
+    socket.close(fd)
+    socket.close(splitfd)
+    done()
+end)
+
 moon.async(function()
     for i=1,100 do
         local fd,err = socket.connect(HOST,PORT,moon.PTYPE_SOCKET_TCP)
@@ -88,14 +190,23 @@ moon.async(function()
             return
         end
         moon.async(function ()
-            local send_data = tostring(fd)
+            -- the first client reads a large message straight into its own buffer
+            local send_data = i == 1 and string.rep("a", 60000) or tostring(fd)
             send(fd, send_data)
             local rdata = session_read(fd)
             test_assert.equal(rdata, send_data)
+            -- several frames in one segment
+            local frames = {}
+            for n = 1, 3 do
+                frames[n] = string.pack(">s2", send_data .. n)
+            end
+            socket.write(fd, table.concat(frames))
+            for n = 1, 3 do
+                test_assert.equal(session_read(fd), send_data .. n)
+            end
             socket.close(fd)
             if i == 100 then
-                socket.close(listenfd)
-                test_assert.success()
+                done()
             end
         end)
     end
@@ -3,6 +3,9 @@ local test_assert = require("test_assert")
 
 local conf = ...
 
+-- more than the 1024 local messages a worker handles per pass
+local ORDER_BURST = 2000
+
 if conf and conf.receiver then
     local command = {}
 
@@ -10,6 +13,17 @@ if conf and conf.receiver then
         moon.send('lua', sender,'WORLD', ...)
     end
 
+    local last_seq = 0
+    command.SEQ = function(sender, n)
+        test_assert.equal(n, last_seq + 1)
+        last_seq = n
+        if n <= ORDER_BURST then
+            moon.send('lua', sender, 'ECHO', n)
+        elseif n == ORDER_BURST * 2 then
+            moon.send('lua', sender, 'ORDER_DONE')
+        end
+    end
+
     moon.dispatch('lua',function(sender,session, cmd, ...)
         -- body
         local f = command[cmd]
@@ -23,6 +37,14 @@ if conf and conf.receiver then
 else
     local send_content = "123456789"
     local world_count = 0
+    local finished = 0
+
+    local function finish()
+        finished = finished + 1
+        if finished == 2 then
+            test_assert.success()
+        end
+    end
 
     local command = {}
 
@@ -30,10 +52,34 @@ else
         test_assert.equal(s, send_content)
         world_count = world_count + 1
         if world_count == 2 then
-            test_assert.success()
+            finish()
+        end
+    end
+
+    ------------------------same worker ordering---------------------------
+    -- Sent from a handler, the burst goes through the worker's local queue in one pass.
+    -- The echoes it triggers exceed the local limit and spill into the locked queue, and
+    -- each echo sends the next message of the second half.
+    local order_receiver
+    local last_echo = 0
+
+    command.ORDER_START = function()
+        for i = 1, ORDER_BURST do
+            moon.send("lua", order_receiver, "SEQ", i)
         end
     end
 
+    command.ECHO = function(n)
+        test_assert.equal(n, last_echo + 1)
+        last_echo = n
+        moon.send("lua", order_receiver, "SEQ", ORDER_BURST + n)
+    end
+
+    command.ORDER_DONE = function()
+        test_assert.equal(last_echo, ORDER_BURST)
+        finish()
+    end
+
     moon.dispatch("lua",function(sender, session, cmd, ...)
         local f = command[cmd]
         if f then
@@ -68,6 +114,16 @@ else
 
         moon.send("lua", receiver, "HELLO", "123456789")
 
+        order_receiver = moon.new_service(
+            {
+                name = "test_send_order",
+                file = "send.lua",
+                receiver = true,
+                threadid = moon.id >> 24
+            }
+        )
+        moon.send("lua", moon.id, "ORDER_START")
+
         local session, receiverid = moon.raw_send("lua", receiver, moon.pack("HELLO", send_content), 12345)
         test_assert.equal(session, 12345)
         test_assert.equal(receiverid, receiver)
@@ -75,6 +131,7 @@ else
 
     moon.shutdown(function()
         moon.kill(receiver)
+        moon.kill(order_receiver)
     end)
 end
 
@@ -0,0 +1,86 @@
+local moon = require("moon")
+local json = require("json")
+local socket = require("moon.socket")
+local test_assert = require("test_assert")
+
+local conf = ...
+
+local HOST = conf.ip or "127.0.0.1"
+local PORT = math.tointeger(conf.port) or 30005
+local LIMIT = 256 * 1024
+
+local listenfd = 0
+while listenfd == 0 do
+    listenfd = socket.listen(HOST, PORT, moon.PTYPE_SOCKET_MOON)
+    if listenfd == 0 then
+        PORT = PORT + 1
+    end
+end
+
+local data = string.rep("x", 60000)
+
+local function connect()
+    -- never read from this connection
+    local fd = socket.connect(HOST, PORT, moon.PTYPE_SOCKET_TCP)
+    test_assert.assert(fd > 0, "connect server failed")
+end
+
+-- Nothing is written to the socket until the accept callback returns, so the queue keeps growing.
+local function drop_oldest(fd)
+    test_assert.assert(socket.set_send_queue_limit(fd, LIMIT, LIMIT * 4, true))
+    for _ = 1, 100 do
+        test_assert.assert(socket.write_droppable(fd, data), "droppable write failed")
+    end
+
+    local stats = json.decode(socket.stats(fd))
+    test_assert.assert(stats.dropped > 0, "nothing dropped")
+    test_assert.assert(stats.queue_bytes <= LIMIT, "send queue exceeded the warn limit")
+    test_assert.equal(stats.queue, 100 - stats.dropped)
+    socket.close(fd)
+    moon.async(connect)
+end
+
+local function kick(fd)
+    test_assert.assert(socket.set_slow_consumer(fd, LIMIT), "set_slow_consumer failed")
+    local sent = 0
+    while socket.write(fd, data) do
+        sent = sent + #data
+        test_assert.assert(sent <= LIMIT, "send queue exceeded the slow consumer limit")
+    end
+
+    local stats = json.decode(socket.stats(fd))
+    test_assert.equal(stats.queue_bytes, sent)
+    test_assert.equal(stats.bytes_out, 0)
+end
+
+local accepted = 0
+socket.on("accept", function(fd)
+    accepted = accepted + 1
+    if accepted == 1 then
+        drop_oldest(fd)
+    else
+        kick(fd)
+    end
+end)
+
+socket.on("close", function(_, msg)
+    if accepted == 1 then
+        return
+    end
+    local m = json.decode(moon.decode(msg, "Z"))
+    test_assert.assert(m.message:find("slow consumer"), m.message)
+    socket.close(listenfd)
+    moon.async(function()
+        moon.sleep(10)
+        local kicked = 0
+        for _, w in ipairs(json.decode(moon.server_stats())) do
+            kicked = kicked + (w.kicked or 0)
+        end
+        test_assert.assert(kicked > 0, "kicked counter not updated")
+        test_assert.success()
+    end)
+end)
+
+socket.start(listenfd)
+
+moon.async(connect)
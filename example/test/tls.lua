@@ -0,0 +1,138 @@
+local moon = require("moon")
+local json = require("json")
+local socket = require("moon.socket")
+local websocket = require("moon.http.websocket")
+local test_assert = require("test_assert")
+
+local conf = ...
+
+local HOST = conf.ip or "127.0.0.1"
+local PORT = math.tointeger(conf.port) or 30009
+
+-- self-signed certificate for localhost and 127.0.0.1
+local server_tls = { certificate = "tls_cert.pem", private_key = "tls_key.pem" }
+local client_tls = { server_name = "localhost", verify = true, ca = "tls_cert.pem" }
+
+local function listen(protocol)
+    local fd = 0
+    while fd == 0 do
+        fd = socket.listen(HOST, PORT, protocol)
+        if fd == 0 then
+            PORT = PORT + 1
+        end
+    end
+    local ok, err = socket.set_tls(fd, server_tls)
+    return fd, PORT, ok, err
+end
+
+local function read_moon_message(fd)
+    local data = socket.read(fd, 2)
+    if not data then
+        return false
+    end
+    return socket.read(fd, string.unpack(">H", data))
+end
+
+------------------------PTYPE_SOCKET_MOON---------------------------
+
+local function test_moon(listenfd, port)
+    socket.on("accept", function(fd)
+        local stats = json.decode(socket.stats(fd))
+        test_assert.assert(stats.tls, "accepted connection is not TLS")
+    end)
+
+    socket.on("message", function(fd, msg)
+        socket.write(fd, moon.decode(msg, "Z"))
+    end)
+
+    socket.start(listenfd)
+
+    local fd = socket.connect(HOST, port, moon.PTYPE_SOCKET_TCP, 5000, client_tls)
+    test_assert.assert(fd, "tls connect failed")
+    -- several frames in one write, and one larger than a TLS record
+    local big = string.rep("m", 60000)
+    socket.write(fd, string.pack(">s2>s2>s2", "hello", "tls", big))
+    test_assert.equal(read_moon_message(fd), "hello")
+    test_assert.equal(read_moon_message(fd), "tls")
+    test_assert.equal(read_moon_message(fd), big)
+    socket.close(fd)
+
+    -- the certificate is not trusted by the system CA paths
+    local _, err = socket.connect(HOST, port, moon.PTYPE_SOCKET_TCP, 5000, { server_name = "localhost", verify = true })
+    test_assert.assert(err, "untrusted certificate accepted")
+
+    -- plain tcp to a TLS listener is closed by the server
+    fd = socket.connect(HOST, port, moon.PTYPE_SOCKET_TCP)
+    socket.write(fd, string.pack(">s2", "plain"))
+    test_assert.equal(socket.read(fd, 1), false)
+    socket.close(fd)
+    socket.close(listenfd)
+end
+
+------------------------PTYPE_SOCKET_TCP---------------------------
+
+local function test_stream()
+    local listenfd, port = listen(moon.PTYPE_SOCKET_TCP)
+    local payload = string.rep("0123456789", 100000)
+
+    moon.async(function()
+        local fd = socket.accept(listenfd)
+        test_assert.assert(fd, "tls accept failed")
+        local line = socket.read(fd, "\n")
+        test_assert.equal(line, "ping")
+        socket.write(fd, payload)
+        socket.write(fd, "\n")
+        -- copied through the TLS stream without kTLS, in order with the writes around it
+        test_assert.assert(socket.sendfile(fd, "twitter.json", 100, 200000), "sendfile failed")
+        socket.write(fd, "\n")
+    end)
+
+    local fd = socket.connect(HOST, port, moon.PTYPE_SOCKET_TCP, 5000, client_tls)
+    test_assert.assert(fd, "tls connect failed")
+    socket.write(fd, "ping\n")
+    test_assert.equal(socket.read(fd, #payload), payload)
+    test_assert.equal(socket.read(fd, "\n"), "")
+    test_assert.equal(socket.read(fd, 200000), io.readfile("twitter.json"):sub(101, 200100))
+    test_assert.equal(socket.read(fd, "\n"), "")
+    socket.close(fd)
+    socket.close(listenfd)
+end
+
+------------------------PTYPE_SOCKET_WS---------------------------
+
+local function test_websocket()
+    local listenfd, port = listen(moon.PTYPE_SOCKET_WS)
+    local client
+
+    websocket.wson("message", function(fd, msg)
+        local data = moon.decode(msg, "Z")
+        if fd ~= client then
+            websocket.write(fd, data)
+            return
+        end
+        test_assert.equal(data, "hello wss")
+        socket.close(client)
+        socket.close(listenfd)
+        test_assert.success()
+    end)
+
+    socket.start(listenfd)
+
+    client = websocket.connect(string.format("wss://localhost:%d/", port), nil, 5000, client_tls)
+    test_assert.assert(json.decode(socket.stats(client)).tls, "websocket client is not TLS")
+    websocket.write(client, "hello wss")
+end
+
+moon.async(function()
+    local listenfd, port, ok, err = listen(moon.PTYPE_SOCKET_MOON)
+    if not ok then
+        -- built without --openssl
+        print("tls test skipped:", err)
+        socket.close(listenfd)
+        test_assert.success()
+        return
+    end
+    test_moon(listenfd, port)
+    test_stream()
+    test_websocket()
+end)
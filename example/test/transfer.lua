@@ -0,0 +1,81 @@
+local moon = require("moon")
+local json = require("json")
+local socket = require("moon.socket")
+local test_assert = require("test_assert")
+
+local conf = ...
+
+if conf.scene then
+    -- owner after the transfer, echo every message
+    socket.on("message", function(fd, msg)
+        local stats = json.decode(socket.stats(fd))
+        test_assert.equal(stats.owner, moon.id)
+        socket.write(fd, moon.decode(msg, "Z"))
+    end)
+
+    moon.dispatch("lua", function(_, _, cmd, fd)
+        test_assert.equal(cmd, "enter")
+        test_assert.assert(socket.write(fd, "welcome"), "write after transfer failed")
+    end)
+    return
+end
+
+local HOST = conf.ip or "127.0.0.1"
+local PORT = math.tointeger(conf.port) or 30007
+
+local listenfd = 0
+while listenfd == 0 do
+    listenfd = socket.listen(HOST, PORT, moon.PTYPE_SOCKET_MOON)
+    if listenfd == 0 then
+        PORT = PORT + 1
+    end
+end
+
+local function read_moon_message(fd)
+    local data = socket.read(fd, 2)
+    if not data then
+        return false
+    end
+    return socket.read(fd, string.unpack(">H", data))
+end
+
+local scene
+
+socket.on("accept", function(fd)
+    moon.async(function()
+        -- still queued when the transfer starts
+        test_assert.assert(socket.write(fd, "queued"), "write before transfer failed")
+        test_assert.equal(socket.transfer(fd, scene), fd)
+        if moon.id >> 24 ~= scene >> 24 then
+            test_assert.assert(not socket.write(fd, "gone"), "old worker can still write")
+        end
+        moon.send("lua", scene, "enter", fd)
+    end)
+end)
+
+socket.on("message", function()
+    test_assert.assert(false, "old owner received a message after the transfer")
+end)
+
+moon.async(function()
+    local threads = math.tointeger(moon.env("THREAD_NUM")) or 1
+    local worker = moon.id >> 24
+    scene = moon.new_service({
+        name = "transfer_scene",
+        file = "transfer.lua",
+        scene = true,
+        threadid = worker % threads + 1,
+    })
+
+    socket.start(listenfd)
+
+    local fd = socket.connect(HOST, PORT, moon.PTYPE_SOCKET_TCP)
+    test_assert.equal(read_moon_message(fd), "queued")
+    test_assert.equal(read_moon_message(fd), "welcome")
+    socket.write(fd, string.pack(">s2", "hello scene"))
+    test_assert.equal(read_moon_message(fd), "hello scene")
+    socket.close(fd)
+    socket.close(listenfd)
+    moon.kill(scene)
+    test_assert.success()
+end)
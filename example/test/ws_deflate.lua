@@ -0,0 +1,208 @@
+local moon = require("moon")
+local socket = require("moon.socket")
+local websocket = require("moon.http.websocket")
+local test_assert = require("test_assert")
+
+local conf = ...
+
+local HOST = conf.ip or "127.0.0.1"
+local PORT = math.tointeger(conf.port) or 30011
+
+local THRESHOLD = 256
+local BIG = string.rep("deflate ", 100)
+
+-- raw deflate blocks, built by hand: the test has no zlib of its own
+local function bitwriter()
+    local bytes, acc, n = {}, 0, 0
+    local w = {}
+    -- header fields and extra bits, least significant bit first
+    function w.bits(v, count)
+        for i = 0, count - 1 do
+            acc = acc | (((v >> i) & 1) << n)
+            n = n + 1
+            if n == 8 then
+                bytes[#bytes + 1] = string.char(acc)
+                acc, n = 0, 0
+            end
+        end
+    end
+    -- huffman codes, most significant bit first
+    function w.code(c, len)
+        for i = len - 1, 0, -1 do
+            w.bits((c >> i) & 1, 1)
+        end
+    end
+    function w.finish()
+        if n > 0 then
+            bytes[#bytes + 1] = string.char(acc)
+        end
+        return table.concat(bytes)
+    end
+    return w
+end
+
+-- A message ends like a sync flush: the header bits of an empty stored block, whose
+-- 00 00 ff ff lengths the receiver appends
+
+-- a non-final stored block
+local function stored(data)
+    return string.pack("<BI2I2", 0, #data, ~#data & 0xFFFF) .. data .. "\0"
+end
+
+-- "a" followed by repeats * 258 copies of it: a dynamic huffman block where
+-- length 258 and distance 1 take one bit each, about 2 bits per 258 bytes
+local function bomb(repeats)
+    local w = bitwriter()
+    w.bits(0, 1) -- BFINAL
+    w.bits(2, 2) -- BTYPE dynamic
+    w.bits(29, 5) -- HLIT: 286 literal/length codes
+    w.bits(0, 5) -- HDIST: 1 distance code
+    w.bits(14, 4) -- HCLEN: 18 code length codes
+    -- code length code lengths in RFC 1951 order: 18 -> 1 bit, 2 -> 2 bits, 1 -> 2 bits
+    local order = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1 }
+    local cl = { [18] = 1, [2] = 2, [1] = 2 }
+    for _, sym in ipairs(order) do
+        w.bits(cl[sym] or 0, 3)
+    end
+    -- canonical codes: 18 = 0, 1 = 10, 2 = 11
+    local function zeros(count)
+        w.code(0, 1)
+        w.bits(count - 11, 7)
+    end
+    zeros(97) -- 0..96
+    w.code(3, 2) -- 97 'a': 2 bits
+    zeros(138) -- 98..235
+    zeros(20) -- 236..255
+    w.code(3, 2) -- 256 end of block: 2 bits
+    zeros(28) -- 257..284
+    w.code(2, 2) -- 285 length 258: 1 bit
+    w.code(2, 2) -- distance code 0: 1 bit
+    -- literal/length codes: 285 = 0, 'a' = 10, end of block = 11
+    w.code(2, 2)
+    for _ = 1, repeats do
+        w.code(0, 1) -- length 258
+        w.code(0, 1) -- distance 1
+    end
+    w.code(3, 2)
+    w.bits(0, 3) -- the empty stored block of the flush
+    return w.finish()
+end
+
+-- client frames are masked, a zero key leaves the payload as it is
+local function write_frame(fd, payload, compressed)
+    local b0 = 0x80 | 0x02 | (compressed and 0x40 or 0)
+    local header
+    if #payload < 126 then
+        header = string.pack(">BB", b0, 0x80 | #payload)
+    else
+        assert(#payload < 65536)
+        header = string.pack(">BBI2", b0, 0x80 | 126, #payload)
+    end
+    socket.write(fd, header .. "\0\0\0\0" .. payload)
+end
+
+local function read_frame(fd)
+    local data = socket.read(fd, 2)
+    if not data then
+        return false
+    end
+    local b0, b1 = string.unpack(">BB", data)
+    local len = b1 & 0x7F
+    if len == 126 then
+        len = string.unpack(">I2", socket.read(fd, 2))
+    elseif len == 127 then
+        len = string.unpack(">I8", socket.read(fd, 8))
+    end
+    local payload = len > 0 and socket.read(fd, len) or ""
+    return payload, (b0 & 0x40) ~= 0, b0 & 0x0F
+end
+
+local function handshake(fd)
+    socket.write(fd, table.concat({
+        "GET / HTTP/1.1",
+        "Host: " .. HOST,
+        "Upgrade: websocket",
+        "Connection: Upgrade",
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==",
+        "Sec-WebSocket-Version: 13",
+        "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits",
+        "", "",
+    }, "\r\n"))
+    return socket.read(fd, "\r\n\r\n")
+end
+
+local listenfd = 0
+while listenfd == 0 do
+    listenfd = socket.listen(HOST, PORT, moon.PTYPE_SOCKET_WS)
+    if listenfd == 0 then
+        PORT = PORT + 1
+    end
+end
+socket.set_ws_deflate(listenfd, { threshold = THRESHOLD, server_no_context_takeover = true })
+
+local BOMB_REPEATS = 1000
+local BOMB_DATA = string.rep("a", 1 + BOMB_REPEATS * 258)
+
+websocket.wson("message", function(fd, msg)
+    local data = moon.decode(msg, "Z")
+    if data == "echo" then
+        websocket.write(fd, BIG)
+    elseif data == BIG then
+        websocket.write(fd, "got big")
+    elseif data == BOMB_DATA then
+        websocket.write(fd, "got bomb")
+    else
+        websocket.write(fd, "bad " .. #data)
+    end
+end)
+
+local close_reason
+websocket.wson("close", function(_, msg)
+    close_reason = moon.decode(msg, "Z")
+end)
+
+socket.start(listenfd)
+
+moon.async(function()
+    local fd = socket.connect(HOST, PORT, moon.PTYPE_SOCKET_TCP)
+    local response = handshake(fd)
+    test_assert.assert(response and response:find("101", 1, true), "websocket handshake failed")
+    if not response:find("permessage-deflate", 1, true) then
+        -- built without --zlib
+        print("ws_deflate test skipped: permessage-deflate not negotiated")
+        socket.close(fd)
+        socket.close(listenfd)
+        test_assert.success()
+        return
+    end
+    test_assert.assert(response:find("server_no_context_takeover", 1, true), "extension parameters not echoed")
+
+    -- inflate on receive, the reply is under the threshold and sent as it is
+    write_frame(fd, stored(BIG), true)
+    local payload, compressed = read_frame(fd)
+    test_assert.equal(payload, "got big")
+    test_assert.equal(compressed, false)
+
+    -- deflate on send, the server's own output inflates back to the same message
+    write_frame(fd, "echo", false)
+    payload, compressed = read_frame(fd)
+    test_assert.equal(compressed, true)
+    test_assert.assert(#payload < #BIG, "compressed frame is not smaller")
+    write_frame(fd, payload, true)
+    test_assert.equal(read_frame(fd), "got big")
+
+    write_frame(fd, bomb(BOMB_REPEATS), true)
+    test_assert.equal(read_frame(fd), "got bomb")
+
+    -- inflates past the 16MB limit: the connection is closed
+    local big_bomb = bomb(16 * 1024 * 1024 // 258 + 1000)
+    test_assert.assert(#big_bomb < 65536, "bomb does not fit one frame")
+    write_frame(fd, big_bomb, true)
+    local _, _, op = read_frame(fd)
+    test_assert.assert(not op or op == 0x8, "inflate limit not enforced")
+    moon.sleep(10)
+    test_assert.assert(close_reason and close_reason:find("exceeded", 1, true), "closed for another reason")
+    socket.close(fd)
+    socket.close(listenfd)
+    test_assert.success()
+end)
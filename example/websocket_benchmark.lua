@@ -0,0 +1,89 @@
+local moon = require("moon")
+local socket = require("moon.socket")
+local websocket = require("moon.http.websocket")
+
+local conf = ...
+
+conf.host = "127.0.0.1"
+conf.port = 33889
+conf.batch = 100
+
+-- Client frames are masked, so the server side measures the unmask path.
+-- Server does not accept 127 length frames, 65535 is the largest payload.
+local cases = {
+    { size = 64, count = 200000 },
+    { size = 1024, count = 100000 },
+    { size = 65535, count = 5000 },
+}
+
+if conf.name == "server" then
+    local received = 0
+
+    websocket.on_accept(function(fd)
+        socket.setnodelay(fd)
+    end)
+
+    websocket.wson("message", function(fd, msg)
+        received = received + 1
+        if received == conf.batch then
+            received = 0
+            websocket.write_text(fd, "ack")
+        end
+    end)
+
+    websocket.listen(conf.host, conf.port)
+
+    print(string.format("\nwebsocket benchmark run at %s %d, batch %d frames.", conf.host, conf.port, conf.batch))
+    return
+end
+
+local fd
+local index = 0
+local sent = 0
+local start_time = 0
+local data
+
+local function run_case()
+    index = index + 1
+    local case = cases[index]
+    if not case then
+        websocket.close(fd)
+        moon.kill(moon.queryservice("server"))
+        moon.exit(0)
+        return
+    end
+    data = string.rep("x", case.size)
+    sent = 0
+    start_time = moon.clock()
+    for _ = 1, conf.batch do
+        websocket.write(fd, data)
+    end
+    sent = conf.batch
+end
+
+websocket.wson("message", function(_, msg)
+    local case = cases[index]
+    if sent < case.count then
+        for _ = 1, conf.batch do
+            websocket.write(fd, data)
+        end
+        sent = sent + conf.batch
+        return
+    end
+
+    local cost = moon.clock() - start_time
+    print(string.format("%6d bytes x %6d frames: %8.02f frames/s %8.02f MB/s",
+        case.size, case.count, case.count / cost, case.size * case.count / cost / 1024 / 1024))
+    run_case()
+end)
+
+moon.async(function()
+    moon.new_service({
+        name = "server",
+        file = "websocket_benchmark.lua",
+    })
+
+    fd = websocket.connect(string.format("ws://%s:%d/", conf.host, conf.port))
+    socket.setnodelay(fd)
+    run_case()
+end)
@@ -24,7 +24,6 @@ local seri             = require("seri")
 local pairs            = pairs
 local type             = type
 local error            = error
-local tremove          = table.remove
 local traceback        = debug.traceback
 
 -- Localize coroutine functions
@@ -36,8 +35,14 @@ local co_close         = coroutine.close
 
 -- Localize core functions for better performance
 local _send            = core.send
+local _call_direct     = core.call_direct
 local _now             = core.now
 local _addr            = core.id
+local _co_take         = core.co_take
+local _co_put          = core.co_put
+local _session_wait    = core.session_wait
+local _session_take    = core.session_take
+local _session_break   = core.session_break
 local _timeout         = core.timeout
 local _newservice      = core.new_service
 local _queryservice    = core.queryservice
@@ -146,10 +151,9 @@ setmetatable(
 )
 
 -- Internal state management tables
----@type table<integer, thread?>
-local session_id_coroutine = {}  -- Maps session IDs to coroutines
+-- The coroutines waiting for a session and the idle coroutines are kept by core,
+-- see core.session_wait and core.co_take
 local protocol = {}              -- Registered message protocols
-local session_watcher = {}       -- Tracks session watchers for cleanup
 local timer_routine = {}         -- Maps timer IDs to coroutines or functions
 local timer_profile_trace = {}   -- Timer profiling information
 
@@ -230,12 +234,8 @@ end
 function moon.quit()
     local running = co_running()
     -- Close all session-related coroutines
-    for k, co in pairs(session_id_coroutine) do
-        if type(co) == "thread" and co ~= running then
-            co_close(co)
-            ---@diagnostic disable-next-line: assign-type-mismatch
-            session_id_coroutine[k] = false
-        end
+    for _, co in ipairs(core.session_break_all(running)) do
+        co_close(co)
     end
 
     -- Close all timer-related coroutines
@@ -300,9 +300,6 @@ end
 -- Coroutine pool management
 local co_num = 0  -- Number of currently running coroutines
 
--- Coroutine pool for reuse to avoid creating new coroutines frequently
-local co_pool = setmetatable({}, { __mode = "kv" })
-
 --- Executes a function and manages coroutine lifecycle
 --- @param co thread @ The coroutine to execute
 --- @param fn function @ The function to execute
@@ -311,7 +308,7 @@ local function invoke(co, fn, ...)
     co_num = co_num + 1
     fn(...)
     co_num = co_num - 1
-    co_pool[#co_pool + 1] = co
+    _co_put(co)
 end
 
 --- Main coroutine routine that handles function execution and yielding
@@ -349,7 +346,7 @@ end
 --- @param ... any @ Optional parameters, passed to the `fn` function
 --- @return thread @ The newly created coroutine
 function moon.async(fn, ...)
-    local co = tremove(co_pool) or co_create(routine)
+    local co = _co_take() or co_create(routine)
     coresume(co, fn, ...)
     return co
 end
@@ -367,10 +364,7 @@ end
 --- @return any ... @ Returns the unpacked message if the coroutine is resumed by a message. If the coroutine is resumed by `moon.wakeup`, it returns the additional parameters passed by `moon.wakeup`. If the coroutine is broken, it returns `false` and "BREAK".
 function moon.wait(session, receiver, is_raw)
     if session then
-        session_id_coroutine[session] = co_running()
-        if receiver then
-            session_watcher[session] = receiver
-        end
+        _session_wait(session, co_running(), receiver)
     else
         if type(receiver) == "string" then -- receiver is error message
             return false, receiver
@@ -387,8 +381,7 @@ function moon.wait(session, receiver, is_raw)
     else
         -- false, "BREAK", {...} - Wakeup or error
         if session then
-            ---@diagnostic disable-next-line: assign-type-mismatch
-            session_id_coroutine[session] = false
+            _session_break(session)
         end
 
         if c then -- Extra parameters passed to moon.wakeup
@@ -419,7 +412,7 @@ end
 --- This is useful for monitoring system performance and debugging.
 --- @return integer, integer @ The first integer is the count of running coroutines. The second integer is the total number of coroutines in the coroutine pool.
 function moon.coroutine_num()
-    return co_num, #co_pool
+    return co_num, (core.co_stats())
 end
 
 ------------------------------------------
@@ -457,6 +450,30 @@ function moon.call(PTYPE, receiver, ...)
     return moon.wait(_send(p.PTYPE, receiver, p.pack(...)))
 end
 
+--- Calls a lua service of the same worker by running its dispatch now, on this thread.
+--- The receiver must be another lua service of this worker that is not handling a message,
+--- otherwise an error is raised. If the handler responds before it yields, the response is
+--- returned without a message; if it yields first, this waits like `moon.call`.
+--- Meant for stateless helper services, e.g. config lookups.
+--- @async
+--- @param PTYPE PTYPE @ The protocol type
+--- @param receiver integer @ The service ID of the receiver
+--- @param ... any @ The message content to send
+--- @return any ... @ The response from the receiver
+--- @nodiscard
+function moon.call_direct(PTYPE, receiver, ...)
+    local p = protocol[PTYPE]
+    if not p then
+        error(string.format("moon call_direct unknown PTYPE[%s] message", PTYPE))
+    end
+
+    local session, _, sz, len, rtype = _call_direct(p.PTYPE, receiver, p.pack(...))
+    if sz then
+        return protocol[rtype].unpack(sz, len)
+    end
+    return moon.wait(session, receiver)
+end
+
 --- Responds to a request from `moon.call`.
 --- This function should be called by the service that received a call to send back a response.
 --- @param PTYPE PTYPE @ The protocol type
@@ -494,9 +511,7 @@ local function _dispatch(PTYPE, sender, session, sz, len, m)
 
     if session > 0 then
         -- Handle response messages (request-response pattern)
-        session_watcher[session] = nil
-        local co = session_id_coroutine[session]
-        session_id_coroutine[session] = nil
+        local co = _session_take(session)
         if co then
             --print(coroutine.status(co))
             coresume(co, sz, len, PTYPE)
@@ -517,7 +532,7 @@ local function _dispatch(PTYPE, sender, session, sz, len, m)
 
         if not p.israw then
             -- Create new coroutine for message handling
-            local co = tremove(co_pool) or co_create(routine)
+            local co = _co_take() or co_create(routine)
             if not p.unpack then
                 error(string.format("PTYPE %s has no unpack function.", p.PTYPE))
             end
@@ -633,15 +648,9 @@ local system_command = {}
 --- @param sender integer @ The service ID that exited
 --- @param what string @ The exit reason
 system_command._service_exit = function(sender, what)
-    for k, v in pairs(session_watcher) do
-        if v == sender then
-            local co = session_id_coroutine[k]
-            if co then
-                session_id_coroutine[k] = nil
-                coresume(co, false, what)
-                return
-            end
-        end
+    local co = core.session_watched(sender)
+    if co then
+        coresume(co, false, what)
     end
 end
 
@@ -839,8 +848,38 @@ end
 --- System state command
 --- @return string @ Formatted string with coroutine and CPU information
 debug_command.state = function()
-    local running_num, free_num = moon.coroutine_num()
-    return string.format("coroutine: running %d free %d. cpu:%d", running_num, free_num, moon.cpu())
+    local running_num = moon.coroutine_num()
+    local free_num, hit, miss = core.co_stats()
+    return string.format("coroutine: running %d free %d hit %d miss %d. cpu:%d gc:%.3f", running_num, free_num,
+        hit, miss, moon.cpu(), moon.gc_time())
+end
+
+--- Sampling profiler command
+--- @param period? integer @ Start sampling every period VM instructions, nil stops sampling
+--- @return string? @ Collapsed stacks for flamegraph.pl when stopped
+debug_command.profile = function(_, _, period)
+    local profile = require("coroutine.profile")
+    if period then
+        profile.sample_start(math.tointeger(period))
+        return
+    end
+    return profile.sample_stop()
+end
+
+--- Allocation profiler command
+--- @param rate? integer @ Start sampling an allocation every rate bytes, nil stops tracking
+--- @return string? @ The top allocation sites when stopped
+debug_command.alloc = function(_, _, rate, top)
+    local profile = require("coroutine.profile")
+    if rate == "report" then
+        -- keeps tracking and the collected sites
+        return profile.alloc_report(top)
+    end
+    if rate then
+        profile.alloc_start(math.tointeger(rate))
+        return
+    end
+    return profile.alloc_stop()
 end
 
 --- Debug protocol - for remote debugging commands
@@ -50,6 +50,13 @@ function core.server_stats(opt) end
 ---@param force boolean @ If true, forces immediate collection; if false, suggests collection
 function core.collect(force) end
 
+--- Get the memory of this service. With mimalloc each service allocates from a heap of its own
+--- and the committed bytes are those of that heap, otherwise both values are the bytes lua allocated.
+---@return integer @ bytes in use
+---@return integer @ bytes committed
+---@nodiscard
+function core.memory() end
+
 --- Print console log with specified level
 ---@param loglv string @ Log level: "DEBUG", "INFO", "WARN", or "ERROR"
 ---@param ... any @ Values to log (will be converted to strings)
@@ -65,6 +72,82 @@ function core.loglevel(lv) end
 ---@nodiscard
 function core.cpu() end
 
+--- Get the seconds this service spent in garbage collection since the last call
+---@return number
+---@nodiscard
+function core.gc_time() end
+
+---@class gc_options
+---@field mode? "incremental"|"generational" @ GC mode, services start generational
+---@field pause? integer @ Parameters of collectgarbage("param"), in percent
+---@field stepmul? integer
+---@field stepsize? integer
+---@field minormul? integer
+---@field minormajor? integer
+---@field majorminor? integer
+---@field idle? integer @ Milliseconds of GC steps to run when the worker is idle after this service handled messages, 0 disables
+
+--- Set the garbage collector mode and parameters of this service
+---@param opts gc_options
+function core.set_gc(opts) end
+
+--- Interrupt a message handler of this service with an error when it runs longer than millseconds.
+--- Checked every 10000 VM instructions, loops inside C functions are not interrupted.
+---@param millseconds integer @ 0 disables
+function core.set_budget(millseconds) end
+
+--- Internal, used by moon.call_direct. Dispatch a call to a lua service of this worker now.
+---@param PTYPE integer
+---@param receiver integer
+---@param data? string|buffer_ptr
+---@return integer @ session
+---@return integer @ receiver
+---@return lightuserdata|integer|nil @ response data, nil when the handler yielded before responding
+---@return integer? @ response size
+---@return integer? @ response type
+function core.call_direct(PTYPE, receiver, data) end
+
+--- Get the coroutine pool of moon.async and message handlers
+---@return integer @ idle coroutines in the pool
+---@return integer @ coroutines taken from the pool
+---@return integer @ coroutines created because the pool was empty
+---@nodiscard
+function core.co_stats() end
+
+--- Internal, used by moon.lua. Take an idle coroutine from the pool.
+---@return thread?
+function core.co_take() end
+
+--- Internal, used by moon.lua. Return an idle coroutine to the pool.
+---@param co thread
+---@return boolean @ false when the pool is full
+function core.co_put(co) end
+
+--- Internal, used by moon.lua. Record the coroutine waiting for a session.
+---@param session integer
+---@param co thread
+---@param receiver? integer @ the service called, its exit breaks the wait
+function core.session_wait(session, co, receiver) end
+
+--- Internal, used by moon.lua. Remove the waiting coroutine of a session.
+---@param session integer
+---@return thread|false|nil @ false when the wait was broken
+function core.session_take(session) end
+
+--- Internal, used by moon.lua. Mark the wait of a session broken, the response is ignored.
+---@param session integer
+function core.session_break(session) end
+
+--- Internal, used by moon.lua. Remove a coroutine waiting for a session of receiver.
+---@param receiver integer
+---@return thread?
+function core.session_watched(receiver) end
+
+--- Internal, used by moon.lua. Break the waits of all coroutines except running.
+---@param running thread
+---@return thread[]
+function core.session_break_all(running) end
+
 --- Remove/kill a service
 ---@param addr integer|string @ Service ID or name to terminate
 function core.kill(addr) end
@@ -122,7 +205,7 @@ function core.escape_print(str) end
 
 --- Send signal to worker thread
 ---@param wid integer @ Worker thread ID [1, THREAD_NUM]
----@param val integer @ Signal value (0 = break loop, >0 = custom signal)
+---@param val integer @ Signal value for the running service (0 = break loop, 1 = log memory, 2 = lua services of the worker that track allocations log the top sites, see coroutine.profile.alloc_start)
 function core.signal(wid, val) end
 
 ---@class asio
@@ -150,6 +233,25 @@ function asio.listen(host, port, protocol) end
 ---@return boolean @ True if data was queued successfully, false otherwise
 function asio.write(fd, data, mask) end
 
+--- Queue a file range on a PTYPE_SOCKET_TCP connection, written in order with socket.write.
+--- Uses sendfile(2) on Linux so the bytes never enter user space; TLS connections without kTLS
+--- and other platforms copy the file in chunks.
+---@param fd integer @ Socket file descriptor
+---@param path string @ File path
+---@param offset? integer @ Start offset, default 0
+---@param len? integer @ Number of bytes, default the rest of the file
+---@param mask? integer @ Optional mask for send options, e.g. close after the file is sent
+---@return boolean, string? @ false and the error message if the file or range is invalid
+function asio.sendfile(fd, path, offset, len, mask) end
+
+--- Send the same data to a list of sockets. The protocol frame is encoded once per
+--- protocol type and shared by every connection.
+---@param fds integer[] @ Socket file descriptors
+---@param data string|buffer_ptr|buffer_shr_ptr @ Data to send
+---@param mask? integer @ Optional mask for send options (protocol-dependent)
+---@return integer @ Number of connections on the current worker that queued the data
+function asio.broadcast(fds, data, mask) end
+
 --- Send a message object to a socket
 ---@param fd integer @ Socket file descriptor
 ---@param m message_ptr @ Message object to send
@@ -179,12 +281,75 @@ function asio.setnodelay(fd) end
 ---@return boolean @ True if chunked mode was enabled
 function asio.set_enable_chunked(fd, mode) end
 
+--- Set the read-ahead cache of a Moon protocol socket
+---@param fd integer @ Socket file descriptor
+---@param size integer @ Cache size in bytes [512, 1M], rounded up to a power of two
+---@param batch? boolean @ Deliver all complete frames of one read as a single "batch" event
+---@return boolean @ False if fd is not a Moon protocol socket
+function asio.set_read_cache(fd, size, batch) end
+
+--- Set the length prefix of a Moon protocol socket, both peers must use the same size
+---@param fd integer @ Connection fd, or a listener fd to apply it to the connections accepted later
+---@param bytes integer @ 2 (default, chunked mode for large messages) or 4
+---@param max_size? integer @ Max incoming message size with 4 bytes prefix, default 64MB
+---@return boolean @ False if fd is not a Moon protocol socket or bytes is invalid
+function asio.set_length_prefix(fd, bytes, max_size) end
+
 --- Set send queue warning/error limits
 ---@param fd integer @ Socket file descriptor
----@param warnsize integer @ Warning threshold (bytes)
----@param errorsize integer @ Error threshold (bytes)
+---@param warnsize integer @ Warning threshold (bytes), 0 disables the limits
+---@param errorsize integer @ Close the connection above this (bytes), 0 disables it
+---@param drop? boolean @ Above warnsize, discard the oldest queued data written with mask_droppable
 ---@return boolean @ True if limits were set successfully
-function asio.set_send_queue_limit(fd, warnsize, errorsize) end
+function asio.set_send_queue_limit(fd, warnsize, errorsize, drop) end
+
+--- Close the connection when the peer does not read fast enough
+---@param fd integer @ Socket file descriptor
+---@param max_bytes integer @ Max bytes waiting in the send queue, 0 disables the check
+---@param max_stall? integer @ Max milliseconds a write may stay pending, 0 disables the check
+---@return boolean @ False if the connection does not exist
+function asio.set_slow_consumer(fd, max_bytes, max_stall) end
+
+--- Queue writes while messages are handled and write them once when the worker finishes
+--- its current batch, fewer syscalls and TCP segments for connections written many times
+---@param fd integer @ Connection fd, or a listener fd to apply it to the connections accepted later
+---@param enable? boolean @ Default true
+---@return boolean @ False if fd was not found
+function asio.set_deferred_flush(fd, enable) end
+
+---@class ws_deflate_options
+---@field enable? boolean @ Default true
+---@field threshold? integer @ Messages smaller than this (bytes) are sent uncompressed, default 256
+---@field level? integer @ zlib compression level [-1, 9], default -1
+---@field server_max_window_bits? integer @ [9, 15], default 15
+---@field client_max_window_bits? integer @ [8, 15], default 15
+---@field server_no_context_takeover? boolean @ Reset the server compressor after every message
+---@field client_no_context_takeover? boolean @ Ask the client to reset its compressor after every message
+
+--- Configure permessage-deflate for a websocket listener, must be called before accept
+---@param listenfd integer @ Listening socket file descriptor (PTYPE_SOCKET_WS)
+---@param opts ws_deflate_options
+---@return boolean @ False if fd is not a websocket listener
+function asio.set_ws_deflate(listenfd, opts) end
+
+---@class tls_options
+---@field certificate? string @ PEM certificate chain file, required for listeners
+---@field private_key? string @ PEM private key file, default is the certificate file
+---@field ca? string @ PEM file of trusted certificates, default is the system CA paths
+---@field server_name? string @ connect only, SNI and the host name checked against the certificate
+---@field verify? boolean @ Verify the peer certificate, default false
+
+--- Terminate TLS on the connections a listener accepts afterwards. Needs a build with --openssl.
+--- When the kernel and OpenSSL support it, record encryption moves to kTLS after the handshake.
+---@param listenfd integer @ Listening socket file descriptor
+---@param opts tls_options
+---@return boolean, string? @ false and the error message if the certificate or key can not be loaded
+function asio.set_tls(listenfd, opts) end
+
+--- Get connection statistics as a json string
+---@param fd integer @ Socket file descriptor
+---@return string? @ nil if the connection does not exist
+function asio.stats(fd) end
 
 --- Get socket address as string
 ---@param fd integer @ Socket file descriptor
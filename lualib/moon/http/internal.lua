@@ -2,6 +2,7 @@
 ---@field public headers? table<string,string>
 ---@field public timeout? integer @ The timeout is applied from when the request starts connecting until the response body has finished. milliseconds, default 10000
 ---@field public proxy? string @ host:port
+---@field public tls? tls_options @ https without proxy, default verifies the server certificate against the system CA paths
 
 ---@class HttpRequest
 ---@field address string
@@ -127,6 +128,7 @@ local http_status_msg         = {
 ---@field public body string @ raw body string
 ---@field public json? fun(response:HttpResponse):table @ Returns the json-encoded content of a response, if decode failed return nil and error string. if status_code not 200, return nil
 ---@field public socket_fd? integer @ socket fd if response.headers["connection"]:lower() == "upgrade"
+---@field public file? string @ server only, body sent with socket.sendfile, see http_response:write_file
 local http_response           = {}
 
 http_response.__index         = http_response
@@ -152,8 +154,21 @@ function http_response:write(body)
     end
 end
 
+---Send a file as the body, with socket.sendfile after the header
+---@param path string
+---@param size? integer @ default the file size
+function http_response:write_file(path, size)
+    if not size then
+        local f = assert(io.open(path, "rb"))
+        size = f:seek("end")
+        f:close()
+    end
+    self.file = path
+    self.headers['Content-Length'] = size
+end
+
 function http_response:tb()
-    if not self.body then
+    if not self.body and not self.file then
         self.headers['Content-Length'] = 0
     end
 
@@ -384,14 +399,16 @@ function M.read_request(fd, prefix_data, opt)
 end
 
 ---@param options HttpOptions
-local function do_request(baseaddress, options, req, method, protocol)
+---@param tls? tls_options
+local function do_request(baseaddress, options, req, method, protocol, tls)
     options.timeout = options.timeout or default_timeout
 
     local fd, err
-    local pool = keep_alive_host[baseaddress]
+    local pool_key = tls and ("https://" .. baseaddress) or baseaddress
+    local pool = keep_alive_host[pool_key]
     if not pool then
         pool = {}
-        keep_alive_host[baseaddress] = pool
+        keep_alive_host[pool_key] = pool
     end
 
     fd = table.remove(pool)
@@ -402,7 +419,7 @@ local function do_request(baseaddress, options, req, method, protocol)
         local host, port = baseaddress:match("([^:]+):?(%d*)$")
         port = math.tointeger(port) or (protocol == 'https' and 443 or 80)
         local start_time = moon.clock()
-        fd, err = socket.connect(host, port, moon.PTYPE_SOCKET_TCP, timeout)
+        fd, err = socket.connect(host, port, moon.PTYPE_SOCKET_TCP, timeout, tls)
         if not fd then
             return { error = err }
         end
@@ -542,13 +559,11 @@ function M.request(method, str_url, options, body)
         options.proxy = options.proxy or moon.env("HTTPS_PROXY")
     end
 
+    local tls
     if options.proxy then
         url.path = string.format("%s://%s%s", protocol, host, url.path)
-    else
-        if protocol == "https" then
-            error(
-                'Error: The protocol is set to "https", but no HTTP to HTTPS forward proxy has been set. Please set a proxy using the "options.proxy" parameter.')
-        end
+    elseif protocol == "https" then
+        tls = options.tls or { server_name = url.host, verify = true }
     end
 
     local cache = {}
@@ -592,9 +607,9 @@ function M.request(method, str_url, options, body)
         protocol, host = check_protocol(options.proxy)
     end
 
-    local response = do_request(host, options, cache, method, protocol)
+    local response = do_request(host, options, cache, method, protocol, tls)
     if response.error then
-        response = do_request(host, options, cache, method, protocol)
+        response = do_request(host, options, cache, method, protocol, tls)
     end
 
     if not response.error then
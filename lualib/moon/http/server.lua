@@ -45,6 +45,8 @@ M.header_max_len = 8192
 M.content_max_len = false
 --is enable keepalvie
 M.keepalive = true
+--static files of this size or larger are sent with socket.sendfile instead of kept in memory
+M.static_sendfile_size = 65536
 
 local routers = {}
 local fallbacks = {}
@@ -53,6 +55,41 @@ fallbacks.next = fallbacks
 
 local traceback = debug.traceback
 
+---return keepalive
+---@param fd integer
+---@param response HttpResponse
+---@param close boolean
+local function send_response(fd, response, close)
+    if close then
+        response:write_header("Connection", "close")
+    end
+
+    local data = buffer.concat(response:tb())
+    if not response.file then
+        if close then
+            socket.write_then_close(fd, data)
+            return
+        end
+        socket.write(fd, data)
+        return true
+    end
+
+    socket.write(fd, data)
+    local size = tonumber(response.headers['Content-Length'])
+    local ok, err
+    if close then
+        ok, err = socket.sendfile_then_close(fd, response.file, 0, size)
+    else
+        ok, err = socket.sendfile(fd, response.file, 0, size)
+    end
+    if not ok then
+        moon.error("HTTP_SERVER_ERROR: " .. tostring(err))
+        socket.close(fd)
+        return
+    end
+    return not close
+end
+
 ---return keepalive
 ---@param fd integer
 ---@param request HttpRequest
@@ -64,15 +101,12 @@ local function request_handler(fd, request)
         local static_src = static_content[request_path]
         if static_src then
             response:write_header("Content-Type", static_src.mime)
-            response:write(static_src.bin)
-            if not M.keepalive or request.headers["connection"] == "close" then
-                response:write_header("Connection", "close")
-                socket.write_then_close(fd, buffer.concat(response:tb()))
-                return
+            if static_src.path then
+                response:write_file(static_src.path, static_src.size)
             else
-                socket.write(fd, buffer.concat(response:tb()))
-                return true
+                response:write(static_src.bin)
             end
+            return send_response(fd, response, not M.keepalive or request.headers["connection"] == "close")
         end
     end
 
@@ -99,18 +133,13 @@ local function request_handler(fd, request)
 
         request.headers["connection"] = "close"
 
+        response.file = nil
         response.status_code = 500
         response:write_header("Content-Type", "text/plain")
         response:write("Server Internal Error")
     end
 
-    if not M.keepalive or request.headers["connection"] == "close" then
-        response:write_header("Connection", "close")
-        socket.write_then_close(fd, buffer.concat(response:tb()))
-    else
-        socket.write(fd, buffer.concat(response:tb()))
-        return true
-    end
+    return send_response(fd, response, not M.keepalive or request.headers["connection"] == "close")
 end
 
 -----------------------------------------------------------------
@@ -200,10 +229,18 @@ end
 
 local function read_asset(file, mime)
     mime = mime or mimes[fs.ext(file)]
-    return {
-        mime = mime or fs.ext(file),
-        bin = io.readfile(file)
-    }
+    local asset = { mime = mime or fs.ext(file) }
+    local f = assert(io.open(file, "rb"))
+    local size = f:seek("end")
+    if M.static_sendfile_size and size >= M.static_sendfile_size then
+        asset.path = file
+        asset.size = size
+    else
+        f:seek("set")
+        asset.bin = f:read("a")
+    end
+    f:close()
+    return asset
 end
 
 function M.static(dir, showdebug)
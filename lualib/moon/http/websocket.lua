@@ -40,9 +40,10 @@ function websocket.close(fd)
     socket.close(fd)
 end
 
-function websocket.connect(url, headers, timeout)
-    local protocol, host, uri = string.match(url, "^(ws)://([^/]+)(.*)$")
-    if protocol ~= "ws" then
+---@param tls? tls_options @ wss:// only, default verifies the server certificate against the system CA paths
+function websocket.connect(url, headers, timeout, tls)
+    local protocol, host, uri = string.match(url, "^(wss?)://([^/]+)(.*)$")
+    if protocol ~= "ws" and protocol ~= "wss" then
         error(string.format("Invalid protocol: %s", protocol))
     end
     assert(host)
@@ -65,9 +66,10 @@ function websocket.connect(url, headers, timeout)
         end
     end
 
-    local response = internal.request("GET", "http://" .. host .. uri, {
+    local response = internal.request("GET", (protocol == "wss" and "https://" or "http://") .. host .. uri, {
         timeout = timeout,
-        headers = request_header
+        headers = request_header,
+        tls = tls
     })
 
     local recvheader = response.headers
@@ -100,9 +102,18 @@ function websocket.connect(url, headers, timeout)
     return response.socket_fd
 end
 
-function websocket.listen(host, port)
+---@class websocket_listen_options
+---@field deflate? ws_deflate_options @ enable permessage-deflate on accepted connections
+
+---@param opts? websocket_listen_options
+function websocket.listen(host, port, opts)
     local fd = socket.listen(host, port, moon.PTYPE_SOCKET_WS)
     assert(fd > 0)
+    if opts and opts.deflate then
+        if not socket.set_ws_deflate(fd, opts.deflate) then
+            moon.warn("websocket.listen: permessage-deflate is not enabled")
+        end
+    end
     socket.start(fd)
     return fd
 end
@@ -131,6 +142,18 @@ function websocket.write_text(fd, data)
     return socket.write(fd, data, flag_ws_text)
 end
 
+--- Send one binary frame to many connections, the frame is encoded only once
+---@param fds integer[]
+function websocket.broadcast(fds, data)
+    return socket.broadcast(fds, data)
+end
+
+--- Send one text frame to many connections, the frame is encoded only once
+---@param fds integer[]
+function websocket.broadcast_text(fds, data)
+    return socket.broadcast(fds, data, flag_ws_text)
+end
+
 --- NOTE:  PTYPE_SOCKET_WS specific functions
 function websocket.write_ping(fd, data)
     return socket.write(fd, data, flag_ws_ping)
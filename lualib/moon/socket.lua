@@ -6,8 +6,10 @@ local id = moon.id
 local close = core.close
 local accept = core.accept
 local connect = core.connect
+local transfer = core.transfer
 local read = core.read
 local write = core.write
+local sendfile = core.sendfile
 local udp = core.udp
 local unpack_udp = core.unpack_udp
 
@@ -15,6 +17,8 @@ local unpack_udp = core.unpack_udp
 local mask_close<const> = 2
 ---@type integer
 local mask_raw<const> = 32
+---@type integer
+local mask_droppable<const> = 64
 
 ---@type table<string|integer, string|integer>
 local supported_tcp_protocol = {
@@ -26,9 +30,11 @@ local supported_tcp_protocol = {
 
 ---@class socket : asio
 ---@field mask_raw integer Raw data mask for socket operations
+---@field mask_droppable integer Data may be dropped while queued, see set_send_queue_limit
 local socket = core
 
 socket.mask_raw = mask_raw
+socket.mask_droppable = mask_droppable
 
 ---Accept a new connection on a listening socket
 ---@async
@@ -59,21 +65,38 @@ end
 ---@param port integer The port number to connect to
 ---@param protocol integer|string The protocol to use ("tcp", "moon", or protocol constants)
 ---@param timeout? integer Connection timeout in milliseconds, defaults to 0 (no timeout)
+---@param tls? tls_options Run a TLS handshake before the connection is returned, the timeout includes it
 ---@return integer|nil fd The connected socket file descriptor, or nil on error
 ---@return string? err Error message if the connection failed
-function socket.connect(host, port, protocol, timeout)
+function socket.connect(host, port, protocol, timeout, tls)
     assert(supported_tcp_protocol[protocol], "not support")
     if type(protocol) == "string" then
         protocol = supported_tcp_protocol[protocol]
     end
     timeout = timeout or 0
-    local fd, err = moon.wait(connect(host, port, protocol, timeout))
+    local fd, err = moon.wait(connect(host, port, protocol, timeout, tls))
     if not fd then
         return nil, err
     end
     return fd
 end
 
+---Hand a connection over to another service, the fd does not change. When the service runs on
+---another worker the socket I/O moves to that worker, queued writes and buffered input are kept.
+---Data received before the transfer completes is still delivered to the current owner.
+---@async
+---@param fd integer The connection fd, must not have a pending socket.read
+---@param serviceid integer The new owner
+---@return integer|nil fd The connection fd, or nil on error
+---@return string? err Error message if the operation failed
+function socket.transfer(fd, serviceid)
+    local res, err = moon.wait(transfer(fd, serviceid))
+    if not res then
+        return nil, err
+    end
+    return res
+end
+
 ---Read data from a socket
 --- NOTE: Used only when protocol == moon.PTYPE_SOCKET_TCP
 ---@async
@@ -98,6 +121,17 @@ function socket.write_then_close(fd, data)
     write(fd, data, mask_close)
 end
 
+---Send a file range and then close the socket, see socket.sendfile
+---@param fd integer The socket file descriptor
+---@param path string The file path
+---@param offset? integer Start offset, default 0
+---@param len? integer Number of bytes, default the rest of the file
+---@return boolean ok
+---@return string? err Error message if the file or range is invalid
+function socket.sendfile_then_close(fd, path, offset, len)
+    return sendfile(fd, path, offset, len, mask_close)
+end
+
 ---Write raw data to a socket, bypassing any message encoding
 --- This function sends raw network data, bypassing any message encoding.
 --- If you need to send data that must be encoded in a specific way, you should encode the data before calling this function.
@@ -107,12 +141,21 @@ function socket.write_raw(fd, data)
     write(fd, data, mask_raw)
 end
 
+---Write data that may be discarded while it waits in the send queue, e.g. position updates.
+---Only takes effect after `socket.set_send_queue_limit(fd, warnsize, errorsize, true)`.
+---@param fd integer The socket file descriptor
+---@param data string|buffer_ptr|buffer_shr_ptr The data to be written
+function socket.write_droppable(fd, data)
+    return write(fd, data, mask_droppable)
+end
+
 ---@type table<string, integer>
 local socket_data_type = {
     connect = 1,
     accept = 2,
     message = 3,
     close = 4,
+    batch = 7,
 }
 
 ---@alias socket_event
@@ -120,6 +163,7 @@ local socket_data_type = {
 ---| 'accept'  # New connection accepted
 ---| 'message' # Data message received
 ---| 'close'   # Socket closed
+---| 'batch'   # Several messages received, see socket.set_read_cache
 
 --- PTYPE_SOCKET_MOON callbacks
 ---@type table<integer, fun(fd: integer, msg: message_ptr)>
@@ -151,6 +195,22 @@ function socket.on(name, cb)
     end
 end
 
+---Iterate the messages of a 'batch' event
+---@param msg message_ptr
+---@return fun(): string?
+function socket.frames(msg)
+    local data = _decode(msg, "Z")
+    local pos = 1
+    return function()
+        if pos > #data then
+            return nil
+        end
+        local frame
+        frame, pos = string.unpack(">s2", data, pos)
+        return frame
+    end
+end
+
 ---@type table<integer, fun(data: string, endpoint: string)>
 local udp_callbacks = {}
 
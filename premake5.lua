@@ -6,6 +6,16 @@ newoption {
    description = "Generate/Build release configuration"
 }
 
+newoption {
+   trigger     = "zlib",
+   description = "Enable websocket permessage-deflate (links the system zlib)"
+}
+
+newoption {
+   trigger     = "openssl",
+   description = "Enable TLS for listeners and connect (links the system OpenSSL)"
+}
+
 newoption {
   trigger = "package",
   value = "URL",
@@ -313,6 +323,16 @@ project "moon"
         "MOON_ENABLE_MIMALLOC"
     }
 
+    if _OPTIONS["zlib"] then
+        defines { "MOON_ENABLE_ZLIB" }
+        links { "z" }
+    end
+
+    if _OPTIONS["openssl"] then
+        defines { "MOON_ENABLE_OPENSSL" }
+        links { "ssl", "crypto" }
+    end
+
     filter { "system:windows" }
         defines {"_WIN32_WINNT=0x0601"}
         linkoptions { '/STACK:"8388608"' }
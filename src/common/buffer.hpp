@@ -503,6 +503,15 @@ public:
         return ((v & std::to_underlying(e)) != 0);
     }
 
+    template<typename Enum>
+    Enum bitmask() const noexcept {
+        static_assert(
+            std::is_enum_v<Enum> && std::is_same_v<std::underlying_type_t<Enum>, uint8_t>,
+            "Enum type must be an enum with uint8_t as its underlying type to fit in the 8-bit bitmask"
+        );
+        return static_cast<Enum>(pair_.bitmask);
+    }
+
     template<typename Enum>
     void clear_bitmask(Enum e) noexcept {
         static_assert(
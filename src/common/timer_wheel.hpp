@@ -0,0 +1,89 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+namespace moon {
+/**
+ * Hashed timing wheel. advance() only visits the slots of the ticks that passed, so the cost
+ * is proportional to the entries that expire, not to all entries. Deadlines more than one turn
+ * away stay in their slot until their turn comes. Not thread safe.
+ */
+template<typename Value>
+class timer_wheel {
+    struct entry {
+        int64_t tick;
+        int64_t deadline;
+        Value value;
+    };
+
+public:
+    // tick: granularity, in the unit of the deadlines. now: the current time.
+    timer_wheel(int64_t tick, int64_t now, size_t slots = 512):
+        tick_(std::max<int64_t>(tick, 1)),
+        current_(now / tick_),
+        slots_(slots) {
+        assert(slots > 0);
+    }
+
+    timer_wheel(const timer_wheel&) = delete;
+
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    int64_t tick() const {
+        return tick_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // Expires on the first tick at or after deadline, a deadline that already passed expires
+    // on the next tick
+    void add(int64_t deadline, Value value) {
+        int64_t t = std::max((deadline + tick_ - 1) / tick_, current_ + 1);
+        slots_[static_cast<size_t>(t) % slots_.size()].emplace_back(t, deadline, std::move(value));
+        ++size_;
+    }
+
+    // Call handler(value, deadline) for the entries that expire at or before now. The handler
+    // may add entries.
+    template<typename Handler>
+    void advance(int64_t now, Handler&& handler) {
+        int64_t now_tick = now / tick_;
+        if (now_tick <= current_) {
+            return;
+        }
+
+        // after a long pause every slot is visited once
+        int64_t first = std::max(current_ + 1, now_tick - static_cast<int64_t>(slots_.size()) + 1);
+        current_ = now_tick;
+        for (int64_t t = first; t <= now_tick; ++t) {
+            auto& slot = slots_[static_cast<size_t>(t) % slots_.size()];
+            if (slot.empty()) {
+                continue;
+            }
+
+            expired_.clear();
+            std::swap(expired_, slot);
+            for (auto& e: expired_) {
+                if (e.tick > now_tick) {
+                    slot.emplace_back(std::move(e));
+                    continue;
+                }
+                --size_;
+                handler(e.value, e.deadline);
+            }
+        }
+        expired_.clear();
+    }
+
+private:
+    int64_t tick_;
+    int64_t current_; // last tick advance() processed
+    size_t size_ = 0;
+    std::vector<std::vector<entry>> slots_;
+    std::vector<entry> expired_;
+};
+} // namespace moon
@@ -27,6 +27,7 @@ SOFTWARE.
 #pragma once
 
 #include <algorithm>
+#include <cassert>
 #include <limits>
 #include <memory>
 #include <new>
@@ -311,21 +312,21 @@ public:
 
     T& front()
     {
-        LUAU_ASSERT(!empty());
+        assert(!empty());
 
         return buffer[head];
     }
 
     const T& front() const
     {
-        LUAU_ASSERT(!empty());
+        assert(!empty());
 
         return buffer[head];
     }
 
     T& back()
     {
-        LUAU_ASSERT(!empty());
+        assert(!empty());
 
         size_t back = logicalToPhysical(queue_size - 1);
         return buffer[back];
@@ -333,7 +334,7 @@ public:
 
     const T& back() const
     {
-        LUAU_ASSERT(!empty());
+        assert(!empty());
 
         size_t back = logicalToPhysical(queue_size - 1);
         return buffer[back];
@@ -474,7 +475,7 @@ public:
 
     void pop_back()
     {
-        LUAU_ASSERT(!empty());
+        assert(!empty());
 
         queue_size--;
         size_t next_back = logicalToPhysical(queue_size);
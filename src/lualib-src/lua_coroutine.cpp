@@ -13,10 +13,138 @@ void signal_hook(lua_State* L, lua_Debug*) {
     }
 }
 
+constexpr int PROFILE_MAX_DEPTH = 64;
+constexpr int ALLOC_SITE_MAX_DEPTH = 16;
+
+// current_line: the line the frame is running instead of the line the function is defined
+static void sample_frame(lua_State* L, lua_Debug* ar, bool current_line, std::string& key) {
+    lua_getinfo(L, current_line ? "Snl" : "Sn", ar);
+    size_t pos = key.size();
+    if (nullptr != ar->name) {
+        key.append(ar->name);
+    } else if (*ar->what == 'm') {
+        key.append("main chunk");
+    } else {
+        key.append("?");
+    }
+    if (*ar->what == 'C') {
+        key.append("@[C]");
+    } else {
+        key.append(std::format(
+            "@{}:{}",
+            ar->short_src,
+            current_line ? ar->currentline : ar->linedefined
+        ));
+    }
+    // ';' separates the frames, ' ' the count
+    for (size_t i = pos; i < key.size(); ++i) {
+        if (key[i] == ';' || key[i] == ' ')
+            key[i] = '_';
+    }
+}
+
+// Collapsed stack of L, root first, frames deeper than max_depth are dropped
+static void stack_key(
+    lua_State* L,
+    std::vector<lua_Debug>& frames,
+    int max_depth,
+    bool current_line,
+    std::string& key
+) {
+    frames.resize(max_depth);
+    int depth = 0;
+    while (depth < max_depth && lua_getstack(L, depth, &frames[depth]))
+        ++depth;
+
+    key.clear();
+    for (int level = depth - 1; level >= 0; --level) {
+        if (!key.empty())
+            key.push_back(';');
+        sample_frame(L, &frames[level], current_line, key);
+    }
+}
+
+void reset_hook(lua_State* L, lua_service* S);
+
+void alloc_hook(lua_State* L, lua_Debug*);
+
+// Instructions between two checks of the dispatch budget
+constexpr int BUDGET_CHECK_COUNT = 10000;
+
+static void check_budget(lua_State* L, lua_service* S) {
+    if (S->budget > 0 && moon::time::clock() > S->budget_deadline) {
+        // once per message, the handlers that catch the error and go on are not stopped again
+        S->budget_deadline = std::numeric_limits<double>::max();
+        luaL_error(
+            L,
+            "interrupted: message handler ran longer than the dispatch budget %d ms",
+            static_cast<int>(S->budget * 1000)
+        );
+    }
+}
+
+static void budget_hook(lua_State* L, lua_Debug*) {
+    check_budget(L, lua_service::get(L));
+}
+
+// Count hook of the sampling profiler, adds the stack of the running coroutine
+static void sample_hook(lua_State* L, lua_Debug*) {
+    lua_service* S = lua_service::get(L);
+    lua_profiler* p = S->profiler.get();
+    if (nullptr == p) {
+        // stopped, coroutines that were running keep the hook until they run again
+        reset_hook(L, S);
+        return;
+    }
+
+    stack_key(L, p->frames, PROFILE_MAX_DEPTH, false, p->key);
+    ++p->stacks[p->key];
+    check_budget(L, S);
+}
+
+// Install the hook a running coroutine keeps: the sampling profiler, which also checks the
+// dispatch budget, or the dispatch budget, or none
+void reset_hook(lua_State* L, lua_service* S) {
+    lua_Hook h = lua_gethook(L);
+    if (nullptr != S->profiler) {
+        if (h != sample_hook || lua_gethookcount(L) != S->profiler->period)
+            lua_sethook(L, sample_hook, LUA_MASKCOUNT, S->profiler->period);
+    } else if (S->budget > 0) {
+        if (h != budget_hook)
+            lua_sethook(L, budget_hook, LUA_MASKCOUNT, BUDGET_CHECK_COUNT);
+    } else if (h == sample_hook || h == budget_hook) {
+        lua_sethook(L, nullptr, 0, 0);
+    }
+}
+
+// Set by lalloc after a sampled allocation, runs once at the next instruction
+void alloc_hook(lua_State* L, lua_Debug* ar) {
+    lua_service* S = lua_service::get(L);
+    // a signal between the trap check of lalloc and its lua_sethook had its hook replaced
+    if (S->trap.load(std::memory_order_acquire)) {
+        signal_hook(L, ar);
+        return;
+    }
+    lua_sethook(L, nullptr, 0, 0);
+    reset_hook(L, S);
+
+    if (lua_alloc_profiler* p = S->alloc_profiler.get(); nullptr != p && !p->pending.empty()) {
+        stack_key(L, p->frames, ALLOC_SITE_MAX_DEPTH, true, p->key);
+        p->add_site();
+    }
+
+    if (S->alloc_report.load(std::memory_order_relaxed)) {
+        S->report_alloc();
+    }
+    check_budget(L, S);
+}
+
 static void switchL(lua_State* L, lua_service* S) {
     S->activeL = L;
     if (S->trap.load(std::memory_order_acquire)) {
         lua_sethook(L, signal_hook, LUA_MASKCOUNT, 1);
+    } else {
+        reset_hook(L, S);
     }
 }
 
@@ -242,10 +370,97 @@ static int lstop(lua_State* L) {
     return 1;
 }
 
+static int lsample_start(lua_State* L) {
+    lua_service* S = lua_service::get(L);
+    auto period = luaL_optinteger(L, 1, 10000);
+    luaL_argcheck(L, period > 0 && period <= INT32_MAX, 1, "invalid period");
+    if (nullptr != S->profiler) {
+        return luaL_error(L, "coroutine.profile.sample_start: the service is already being sampled");
+    }
+    S->profiler = std::make_unique<lua_profiler>();
+    S->profiler->period = static_cast<int>(period);
+    // other coroutines are hooked when they are resumed
+    lua_sethook(L, sample_hook, LUA_MASKCOUNT, S->profiler->period);
+    return 0;
+}
+
+static int lsample_stop(lua_State* L) {
+    lua_service* S = lua_service::get(L);
+    if (nullptr == S->profiler) {
+        return luaL_error(
+            L,
+            "coroutine.profile.sample_stop: call sample_start() before sample_stop()"
+        );
+    }
+    auto p = std::move(S->profiler);
+    reset_hook(L, S);
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (const auto& [stack, count]: p->stacks) {
+        auto line = std::format("{} {}\n", stack, count);
+        luaL_addlstring(&b, line.data(), line.size());
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int lalloc_start(lua_State* L) {
+    lua_service* S = lua_service::get(L);
+    auto rate = luaL_optinteger(L, 1, 512 * 1024);
+    luaL_argcheck(L, rate > 0, 1, "invalid rate");
+    if (nullptr != S->alloc_profiler) {
+        return luaL_error(L, "coroutine.profile.alloc_start: allocations are already tracked");
+    }
+    auto p = std::make_unique<lua_alloc_profiler>();
+    p->rate = static_cast<size_t>(rate);
+    S->alloc_profiler = std::move(p);
+    return 0;
+}
+
+static int lalloc_report(lua_State* L) {
+    lua_service* S = lua_service::get(L);
+    if (nullptr == S->alloc_profiler) {
+        return luaL_error(
+            L,
+            "coroutine.profile.alloc_report: call alloc_start() before alloc_report()"
+        );
+    }
+    auto top = luaL_optinteger(L, 1, 20);
+    luaL_argcheck(L, top > 0, 1, "invalid top");
+    auto res = S->alloc_profiler->report(static_cast<size_t>(top));
+    lua_pushlstring(L, res.data(), res.size());
+    return 1;
+}
+
+static int lalloc_stop(lua_State* L) {
+    lua_service* S = lua_service::get(L);
+    if (nullptr == S->alloc_profiler) {
+        return luaL_error(
+            L,
+            "coroutine.profile.alloc_stop: call alloc_start() before alloc_stop()"
+        );
+    }
+    auto top = luaL_optinteger(L, 1, 20);
+    luaL_argcheck(L, top > 0, 1, "invalid top");
+    auto p = std::move(S->alloc_profiler);
+    auto res = p->report(static_cast<size_t>(top));
+    lua_pushlstring(L, res.data(), res.size());
+    return 1;
+}
+
 LUAMOD_API int luaopen_coroutine_profile(lua_State* L) {
     luaL_Reg l[] = {
-        { "start", lstart },     { "stop", lstop }, { "resume", luaB_coresume },
-        { "wrap", luaB_cowrap }, { NULL, NULL },
+        { "start", lstart },
+        { "stop", lstop },
+        { "resume", luaB_coresume },
+        { "wrap", luaB_cowrap },
+        { "sample_start", lsample_start },
+        { "sample_stop", lsample_stop },
+        { "alloc_start", lalloc_start },
+        { "alloc_report", lalloc_report },
+        { "alloc_stop", lalloc_stop },
+        { NULL, NULL },
     };
 
     luaL_newlibtable(L, l); //L [-0, +1]
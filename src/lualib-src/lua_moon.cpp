@@ -194,6 +194,53 @@ static int lmoon_cpu(lua_State* L) {
     return 1;
 }
 
+static int lmoon_gc_time(lua_State* L) {
+    lua_service* S = lua_service::get(L);
+    lua_pushnumber(L, S->gc());
+    return 1;
+}
+
+static int lmoon_set_gc(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_service* S = lua_service::get(L);
+
+    if (auto mode = lua_opt_field<std::string_view>(L, 1, "mode"); !mode.empty()) {
+        if (mode == "incremental")
+            S->set_gc_mode(true);
+        else if (mode == "generational")
+            S->set_gc_mode(false);
+        else
+            return luaL_error(L, "invalid gc mode '%s'", mode.data());
+    }
+
+    static constexpr std::pair<std::string_view, int> params[] = {
+        { "minormul", LUA_GCPMINORMUL }, { "majorminor", LUA_GCPMAJORMINOR },
+        { "minormajor", LUA_GCPMINORMAJOR }, { "pause", LUA_GCPPAUSE },
+        { "stepmul", LUA_GCPSTEPMUL }, { "stepsize", LUA_GCPSTEPSIZE },
+    };
+    for (const auto& [name, param]: params) {
+        if (auto v = lua_opt_field<int>(L, 1, name, -1); v >= 0)
+            lua_gc(L, LUA_GCPARAM, param, v);
+    }
+
+    if (lua_getfield(L, 1, "idle") != LUA_TNIL)
+        S->set_idle_gc((uint32_t)luaL_checkinteger(L, -1));
+    lua_pop(L, 1);
+    return 0;
+}
+
+void reset_hook(lua_State* L, lua_service* S);
+
+static int lmoon_set_budget(lua_State* L) {
+    lua_service* S = lua_service::get(L);
+    auto ms = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, ms >= 0 && ms <= UINT32_MAX, 1, "invalid budget");
+    S->set_budget(static_cast<uint32_t>(ms));
+    // other coroutines are hooked when they are resumed
+    reset_hook(L, S);
+    return 0;
+}
+
 static int lmoon_send(lua_State* L) {
     lua_service* S = lua_service::get(L);
 
@@ -214,6 +261,65 @@ static int lmoon_send(lua_State* L) {
     return 2;
 }
 
+static int lmoon_call_direct(lua_State* L) {
+    lua_service* S = lua_service::get(L);
+
+    auto type = (uint8_t)luaL_checkinteger(L, 1);
+    luaL_argcheck(L, type > 0, 1, "moon.call_direct: message type must be greater than 0");
+
+    auto receiver = (uint32_t)luaL_checkinteger(L, 2);
+    auto* w = S->get_worker();
+    auto* target = dynamic_cast<lua_service*>(w->find_service(receiver));
+    if (nullptr == target || target == S) {
+        lua_pushfstring(
+            L,
+            "moon.call_direct: service '%I' is not another lua service of this worker",
+            (lua_Integer)receiver
+        );
+        return lua_error(L);
+    }
+
+    if (!target->ok() || target->dispatching()) {
+        lua_pushfstring(
+            L,
+            "moon.call_direct: service '%I' is not ready or is handling a message",
+            (lua_Integer)receiver
+        );
+        return lua_error(L);
+    }
+
+    int64_t session = S->next_sequence();
+    bool captured = false;
+    {
+        message m { type, S->id(), receiver, -session, moon_to_buffer(L, 3, "call_direct") };
+        message response { 0 };
+
+        // a handler that responds before it yields is answered without a message
+        auto prev = w->capture_response({ S->id(), session, &response });
+        w->handle_nested(target, std::move(m));
+        captured = (w->capture_response(prev).out == nullptr);
+        if (captured) {
+            S->direct_response = std::make_unique<message>(std::move(response));
+        }
+    }
+
+    lua_pushinteger(L, session);
+    lua_pushinteger(L, receiver);
+    if (!captured) {
+        return 2;
+    }
+
+    auto& r = *S->direct_response;
+    if (r.is_bytes()) {
+        lua_pushlightuserdata(L, (void*)r.data());
+    } else {
+        lua_pushinteger(L, r.as_ptr());
+    }
+    lua_pushinteger(L, r.size());
+    lua_pushinteger(L, r.type);
+    return 5;
+}
+
 static void table_tostring(std::string& res, lua_State* L, int index) {
     index = lua_absindex(L, index);
 
@@ -493,11 +599,19 @@ static int lmi_collect(lua_State* L) {
     (void)L;
 #ifdef MOON_ENABLE_MIMALLOC
     bool force = (luaL_opt(L, lua_toboolean, 2, 1) != 0);
+    lua_service::get(L)->collect(force);
     mi_collect(force);
 #endif
     return 0;
 }
 
+static int lmoon_memory(lua_State* L) {
+    auto [used, committed] = lua_service::get(L)->memory();
+    lua_pushinteger(L, static_cast<lua_Integer>(used));
+    lua_pushinteger(L, static_cast<lua_Integer>(committed));
+    return 2;
+}
+
 static int escape_print(lua_State* L) {
     auto s = moon::lua_check<std::string_view>(L, 1);
     auto res = moon::escape_print(s);
@@ -515,6 +629,198 @@ static int moon_signal(lua_State* L) {
     return 0;
 }
 
+/**
+ * Idle coroutines of moon.async and the coroutines waiting for a session. The threads are
+ * kept in the array part of a table with reused slot numbers, so an RPC does not grow or
+ * rehash a lua table. Upvalue 1 is the registry, upvalue 2 the table.
+ */
+struct coroutine_registry {
+    static constexpr size_t MAX_POOL = 4096;
+
+    struct session_entry {
+        int slot = 0; // 0: the wait was broken, a late response is ignored
+        uint32_t receiver = 0;
+    };
+
+    std::vector<int> free_slots;
+    int max_slot = 0;
+    std::vector<int> pool;
+    std::unordered_map<int64_t, session_entry> sessions;
+    int64_t pool_hit = 0;
+    int64_t pool_miss = 0;
+
+    static coroutine_registry* get(lua_State* L) {
+        return static_cast<coroutine_registry*>(lua_touserdata(L, lua_upvalueindex(1)));
+    }
+
+    // Store the value at the top in a slot
+    int ref(lua_State* L) {
+        int slot = 0;
+        if (!free_slots.empty()) {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            slot = ++max_slot;
+        }
+        lua_rawseti(L, lua_upvalueindex(2), slot);
+        return slot;
+    }
+
+    // Push the value of slot and free the slot
+    void unref(lua_State* L, int slot) {
+        lua_rawgeti(L, lua_upvalueindex(2), slot);
+        lua_pushnil(L);
+        lua_rawseti(L, lua_upvalueindex(2), slot);
+        free_slots.push_back(slot);
+    }
+};
+
+static int lco_release(lua_State* L) {
+    std::destroy_at(static_cast<coroutine_registry*>(lua_touserdata(L, 1)));
+    return 0;
+}
+
+static int lco_take(lua_State* L) {
+    auto* r = coroutine_registry::get(L);
+    if (r->pool.empty()) {
+        ++r->pool_miss;
+        return 0;
+    }
+    ++r->pool_hit;
+    int slot = r->pool.back();
+    r->pool.pop_back();
+    r->unref(L, slot);
+    return 1;
+}
+
+static int lco_put(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTHREAD);
+    auto* r = coroutine_registry::get(L);
+    if (r->pool.size() >= coroutine_registry::MAX_POOL) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_settop(L, 1);
+    r->pool.push_back(r->ref(L));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int lco_stats(lua_State* L) {
+    auto* r = coroutine_registry::get(L);
+    lua_pushinteger(L, static_cast<lua_Integer>(r->pool.size()));
+    lua_pushinteger(L, r->pool_hit);
+    lua_pushinteger(L, r->pool_miss);
+    return 3;
+}
+
+static int lsession_wait(lua_State* L) {
+    auto session = luaL_checkinteger(L, 1);
+    luaL_checktype(L, 2, LUA_TTHREAD);
+    auto receiver = static_cast<uint32_t>(luaL_optinteger(L, 3, 0));
+    auto* r = coroutine_registry::get(L);
+    lua_settop(L, 2);
+    auto& e = r->sessions[session];
+    if (e.slot != 0) {
+        r->unref(L, e.slot);
+        lua_pop(L, 1);
+    }
+    e.slot = r->ref(L);
+    e.receiver = receiver;
+    return 0;
+}
+
+// The coroutine waiting for session, false when the wait was broken, nil when unknown
+static int lsession_take(lua_State* L) {
+    auto session = luaL_checkinteger(L, 1);
+    auto* r = coroutine_registry::get(L);
+    auto it = r->sessions.find(session);
+    if (it == r->sessions.end()) {
+        return 0;
+    }
+    int slot = it->second.slot;
+    r->sessions.erase(it);
+    if (slot == 0) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    r->unref(L, slot);
+    return 1;
+}
+
+static int lsession_break(lua_State* L) {
+    auto session = luaL_checkinteger(L, 1);
+    auto* r = coroutine_registry::get(L);
+    auto& e = r->sessions[session];
+    if (e.slot != 0) {
+        r->unref(L, e.slot);
+        lua_pop(L, 1);
+        e.slot = 0;
+    }
+    return 0;
+}
+
+// Take one coroutine waiting for a session of receiver
+static int lsession_watched(lua_State* L) {
+    auto receiver = static_cast<uint32_t>(luaL_checkinteger(L, 1));
+    auto* r = coroutine_registry::get(L);
+    for (auto it = r->sessions.begin(); it != r->sessions.end(); ++it) {
+        if (it->second.receiver == receiver && it->second.slot != 0) {
+            int slot = it->second.slot;
+            r->sessions.erase(it);
+            r->unref(L, slot);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Break every wait except the one of the given coroutine, returns the coroutines
+static int lsession_break_all(lua_State* L) {
+    auto* r = coroutine_registry::get(L);
+    lua_State* running = lua_tothread(L, 1);
+    lua_createtable(L, static_cast<int>(r->sessions.size()), 0);
+    int n = 0;
+    for (auto& [session, e]: r->sessions) {
+        if (e.slot == 0) {
+            continue;
+        }
+        lua_rawgeti(L, lua_upvalueindex(2), e.slot);
+        if (lua_tothread(L, -1) == running) {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_pop(L, 1);
+        r->unref(L, e.slot);
+        lua_rawseti(L, -2, ++n);
+        e.slot = 0;
+    }
+    return 1;
+}
+
+static void open_coroutine_registry(lua_State* L) {
+    luaL_Reg l[] = {
+        { "co_take", lco_take },
+        { "co_put", lco_put },
+        { "co_stats", lco_stats },
+        { "session_wait", lsession_wait },
+        { "session_take", lsession_take },
+        { "session_break", lsession_break },
+        { "session_watched", lsession_watched },
+        { "session_break_all", lsession_break_all },
+        { NULL, NULL },
+    };
+
+    void* p = lua_newuserdatauv(L, sizeof(coroutine_registry), 0);
+    new (p) coroutine_registry();
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, lco_release);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_createtable(L, 64, 0);
+    luaL_setfuncs(L, l, 2);
+}
+
 LUAMOD_API int luaopen_moon_core(lua_State* L) {
     luaL_Reg l[] = {
         { "clock", lmoon_clock },
@@ -524,7 +830,11 @@ LUAMOD_API int luaopen_moon_core(lua_State* L) {
         { "log", lmoon_log },
         { "loglevel", lmoon_loglevel },
         { "cpu", lmoon_cpu },
+        { "gc_time", lmoon_gc_time },
+        { "set_gc", lmoon_set_gc },
+        { "set_budget", lmoon_set_budget },
         { "send", lmoon_send },
+        { "call_direct", lmoon_call_direct },
         { "new_service", lmoon_new_service },
         { "kill", lmoon_kill },
         { "scan_services", lmoon_scan_services },
@@ -539,6 +849,7 @@ LUAMOD_API int luaopen_moon_core(lua_State* L) {
         { "decode", message_decode },
         { "redirect", message_redirect },
         { "collect", lmi_collect },
+        { "memory", lmoon_memory },
         { "escape_print", escape_print },
         { "signal", moon_signal },
         /* placeholders */
@@ -549,6 +860,7 @@ LUAMOD_API int luaopen_moon_core(lua_State* L) {
     };
 
     luaL_newlib(L, l);
+    open_coroutine_registry(L);
     const lua_service* S = lua_service::get(L);
     lua_pushinteger(L, S->id());
     lua_setfield(L, -2, "id");
@@ -602,6 +914,16 @@ static int lasio_accept(lua_State* L) {
     return 1;
 }
 
+static moon::tls_options check_tls_options(lua_State* L, int index) {
+    moon::tls_options opt;
+    opt.certificate = lua_opt_field<std::string>(L, index, "certificate");
+    opt.private_key = lua_opt_field<std::string>(L, index, "private_key");
+    opt.ca = lua_opt_field<std::string>(L, index, "ca");
+    opt.server_name = lua_opt_field<std::string>(L, index, "server_name");
+    opt.verify = lua_opt_field<bool>(L, index, "verify", false);
+    return opt;
+}
+
 static int lasio_connect(lua_State* L) {
     lua_service* S = lua_service::get(L);
 
@@ -610,8 +932,13 @@ static int lasio_connect(lua_State* L) {
     auto port = (uint16_t)luaL_checkinteger(L, 2);
     auto type = (uint8_t)luaL_checkinteger(L, 3);
     auto timeout = (uint32_t)luaL_checkinteger(L, 4);
+    std::optional<moon::tls_options> tls;
+    if (!lua_isnoneornil(L, 5)) {
+        luaL_checktype(L, 5, LUA_TTABLE);
+        tls = check_tls_options(L, 5);
+    }
     int64_t session = S->next_sequence();
-    sock.connect(host, port, S->id(), type, session, timeout);
+    sock.connect(host, port, S->id(), type, session, timeout, std::move(tls));
     lua_pushinteger(L, session);
     return 1;
 }
@@ -665,6 +992,63 @@ static int lasio_write(lua_State* L) {
     return 1;
 }
 
+static int lasio_sendfile(lua_State* L) {
+    const lua_service* S = lua_service::get(L);
+    auto& sock = S->get_worker()->socket_server();
+    auto fd = (uint32_t)luaL_checkinteger(L, 1);
+    std::string path = lua_check<std::string>(L, 2);
+    int64_t offset = luaL_optinteger(L, 3, 0);
+    int64_t size = luaL_optinteger(L, 4, -1);
+    auto n = static_cast<int>(luaL_optinteger(L, 5, 0));
+    // only close applies to a file segment
+    luaL_argcheck(
+        L,
+        n == 0 || n == static_cast<int>(moon::socket_send_mask::close),
+        5,
+        "asio.sendfile: invalid send mask"
+    );
+    std::string err = sock.sendfile(fd, path, offset, size, static_cast<moon::socket_send_mask>(n));
+    if (!err.empty()) {
+        lua_pushboolean(L, 0);
+        lua_pushlstring(L, err.data(), err.size());
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int lasio_broadcast(lua_State* L) {
+    const lua_service* S = lua_service::get(L);
+    auto& sock = S->get_worker()->socket_server();
+    luaL_checktype(L, 1, LUA_TTABLE);
+    auto n = static_cast<int>(luaL_optinteger(L, 3, 0));
+    luaL_argcheck(
+        L,
+        n >= 0 && n < static_cast<int>(moon::socket_send_mask::max_mask),
+        3,
+        "asio.broadcast: invalid send mask"
+    );
+    auto mask = static_cast<moon::socket_send_mask>(n);
+
+    std::vector<uint32_t> fds;
+    fds.reserve(lua_rawlen(L, 1));
+    for (lua_Integer i = 1, len = (lua_Integer)lua_rawlen(L, 1); i <= len; ++i) {
+        lua_rawgeti(L, 1, i);
+        fds.emplace_back(static_cast<uint32_t>(luaL_checkinteger(L, -1)));
+        lua_pop(L, 1);
+    }
+
+    buffer_shr_ptr_t data;
+    if (LUA_TUSERDATA == lua_type(L, 2)) {
+        data = *static_cast<buffer_shr_ptr_t*>(lua_touserdata(L, 2));
+    } else {
+        data = moon_to_shr_buffer(L, 2, "broadcast");
+    }
+    size_t count = sock.broadcast(std::move(fds), std::move(data), mask);
+    lua_pushinteger(L, static_cast<lua_Integer>(count));
+    return 1;
+}
+
 static int lasio_write_message(lua_State* L) {
     const lua_service* S = lua_service::get(L);
     auto& sock = S->get_worker()->socket_server();
@@ -704,6 +1088,21 @@ static int lasio_switch_type(lua_State* L) {
     return 1;
 }
 
+static int lasio_transfer(lua_State* L) {
+    lua_service* S = lua_service::get(L);
+    auto& sock = S->get_worker()->socket_server();
+    auto fd = (uint32_t)luaL_checkinteger(L, 1);
+    auto owner = (uint32_t)luaL_checkinteger(L, 2);
+    int64_t session = S->next_sequence();
+    if (!sock.transfer(fd, owner, S->id(), session)) {
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "asio.transfer: fd(%I) can not be transferred to %I", fd, owner);
+        return 2;
+    }
+    lua_pushinteger(L, session);
+    return 1;
+}
+
 static int lasio_settimeout(lua_State* L) {
     const lua_service* S = lua_service::get(L);
     auto& sock = S->get_worker()->socket_server();
@@ -733,17 +1132,118 @@ static int lasio_set_enable_chunked(lua_State* L) {
     return 1;
 }
 
+static int lasio_set_read_cache(lua_State* L) {
+    const lua_service* S = lua_service::get(L);
+    auto& sock = S->get_worker()->socket_server();
+    auto fd = (uint32_t)luaL_checkinteger(L, 1);
+    auto size = moon::lua_check<size_t>(L, 2);
+    bool batch = lua_toboolean(L, 3);
+    bool ok = sock.set_read_cache(fd, size, batch);
+    lua_pushboolean(L, ok ? 1 : 0);
+    return 1;
+}
+
+static int lasio_set_length_prefix(lua_State* L) {
+    const lua_service* S = lua_service::get(L);
+    auto& sock = S->get_worker()->socket_server();
+    auto fd = (uint32_t)luaL_checkinteger(L, 1);
+    auto bytes = moon::lua_check<uint8_t>(L, 2);
+    auto max_size = (size_t)luaL_optinteger(L, 3, 0);
+    bool ok = sock.set_length_prefix(fd, bytes, max_size);
+    lua_pushboolean(L, ok ? 1 : 0);
+    return 1;
+}
+
 static int lasio_set_send_queue_limit(lua_State* L) {
     const lua_service* S = lua_service::get(L);
     auto& sock = S->get_worker()->socket_server();
     auto fd = (uint32_t)luaL_checkinteger(L, 1);
-    uint16_t warnsize = moon::lua_check<uint16_t>(L, 2);
-    uint16_t errorsize = moon::lua_check<uint16_t>(L, 3);
-    bool ok = sock.set_send_queue_limit(fd, warnsize, errorsize);
+    auto warnsize = moon::lua_check<size_t>(L, 2);
+    auto errorsize = moon::lua_check<size_t>(L, 3);
+    bool drop = lua_toboolean(L, 4);
+    bool ok = sock.set_send_queue_limit(fd, warnsize, errorsize, drop);
+    lua_pushboolean(L, ok ? 1 : 0);
+    return 1;
+}
+
+static int lasio_set_slow_consumer(lua_State* L) {
+    const lua_service* S = lua_service::get(L);
+    auto& sock = S->get_worker()->socket_server();
+    auto fd = (uint32_t)luaL_checkinteger(L, 1);
+    auto max_bytes = moon::lua_check<size_t>(L, 2);
+    auto max_stall = (uint32_t)luaL_optinteger(L, 3, 0);
+    bool ok = sock.set_slow_consumer_limit(fd, max_bytes, max_stall);
+    lua_pushboolean(L, ok ? 1 : 0);
+    return 1;
+}
+
+static int lasio_set_deferred_flush(lua_State* L) {
+    const lua_service* S = lua_service::get(L);
+    auto& sock = S->get_worker()->socket_server();
+    auto fd = (uint32_t)luaL_checkinteger(L, 1);
+    bool enable = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+    bool ok = sock.set_deferred_flush(fd, enable);
+    lua_pushboolean(L, ok ? 1 : 0);
+    return 1;
+}
+
+static int lasio_set_ws_deflate(lua_State* L) {
+    const lua_service* S = lua_service::get(L);
+    auto& sock = S->get_worker()->socket_server();
+    auto fd = (uint32_t)luaL_checkinteger(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    moon::ws_deflate_options opt;
+    opt.enable = lua_opt_field<bool>(L, 2, "enable", true);
+    opt.server_no_context_takeover = lua_opt_field<bool>(L, 2, "server_no_context_takeover", false);
+    opt.client_no_context_takeover = lua_opt_field<bool>(L, 2, "client_no_context_takeover", false);
+    opt.server_max_window_bits = lua_opt_field<uint8_t>(L, 2, "server_max_window_bits", 15);
+    opt.client_max_window_bits = lua_opt_field<uint8_t>(L, 2, "client_max_window_bits", 15);
+    opt.level = lua_opt_field<int8_t>(L, 2, "level", -1);
+    opt.threshold = lua_opt_field<uint32_t>(L, 2, "threshold", 256);
+    luaL_argcheck(
+        L,
+        opt.server_max_window_bits >= 9 && opt.server_max_window_bits <= 15,
+        2,
+        "asio.set_ws_deflate: server_max_window_bits must be in [9, 15]"
+    );
+    luaL_argcheck(
+        L,
+        opt.client_max_window_bits >= 8 && opt.client_max_window_bits <= 15,
+        2,
+        "asio.set_ws_deflate: client_max_window_bits must be in [8, 15]"
+    );
+    luaL_argcheck(L, opt.level >= -1 && opt.level <= 9, 2, "asio.set_ws_deflate: level must be in [-1, 9]");
+    bool ok = sock.set_ws_deflate(fd, opt);
     lua_pushboolean(L, ok ? 1 : 0);
     return 1;
 }
 
+static int lasio_set_tls(lua_State* L) {
+    const lua_service* S = lua_service::get(L);
+    auto& sock = S->get_worker()->socket_server();
+    auto fd = (uint32_t)luaL_checkinteger(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    std::string err = sock.set_tls(fd, check_tls_options(L, 2));
+    if (!err.empty()) {
+        lua_pushboolean(L, 0);
+        lua_pushlstring(L, err.data(), err.size());
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int lasio_stats(lua_State* L) {
+    const lua_service* S = lua_service::get(L);
+    auto& sock = S->get_worker()->socket_server();
+    auto fd = (uint32_t)luaL_checkinteger(L, 1);
+    std::string res = sock.stats(fd);
+    if (res.empty())
+        return 0;
+    lua_pushlstring(L, res.data(), res.size());
+    return 1;
+}
+
 static int lasio_address(lua_State* L) {
     const lua_service* S = lua_service::get(L);
     auto& sock = S->get_worker()->socket_server();
@@ -841,12 +1341,22 @@ LUAMOD_API int luaopen_asio_core(lua_State* L) {
         { "read", lasio_read },
         { "write", lasio_write },
         { "write_message", lasio_write_message },
+        { "sendfile", lasio_sendfile },
+        { "broadcast", lasio_broadcast },
         { "close", lasio_close },
         { "switch_type", lasio_switch_type },
+        { "transfer", lasio_transfer },
         { "settimeout", lasio_settimeout },
         { "setnodelay", lasio_setnodelay },
         { "set_enable_chunked", lasio_set_enable_chunked },
+        { "set_read_cache", lasio_set_read_cache },
+        { "set_length_prefix", lasio_set_length_prefix },
         { "set_send_queue_limit", lasio_set_send_queue_limit },
+        { "set_deferred_flush", lasio_set_deferred_flush },
+        { "set_slow_consumer", lasio_set_slow_consumer },
+        { "set_ws_deflate", lasio_set_ws_deflate },
+        { "set_tls", lasio_set_tls },
+        { "stats", lasio_stats },
         { "getaddress", lasio_address },
         { "udp", lasio_udp },
         { "udp_connect", lasio_udp_connect },
@@ -34,7 +34,9 @@ enum class socket_send_mask : uint8_t {
     ws_ping = 1 << 3,
     ws_pong = 1 << 4,
     raw = 1 << 5,
-    max_mask
+    droppable = 1 << 6, // may be discarded while queued when the send queue is over its limit
+    max_mask,
+    sendfile = 1 << 7, // internal, a file segment of the send queue, see base_connection::send_file
 };
 
 template<>
@@ -49,6 +51,7 @@ enum class socket_data_type : std::uint8_t {
     socket_close = 4,
     socket_ping = 5,
     socket_pong = 6,
+    socket_recv_batch = 7, // PTYPE_SOCKET_MOON frames of one read, see socket.set_read_cache
 };
 
 enum class enable_chunked : std::uint8_t {
@@ -76,6 +79,24 @@ struct service_conf {
     std::string params;
 };
 
+struct ws_deflate_options {
+    bool enable = false;
+    bool server_no_context_takeover = false; // reset our compressor after every message
+    bool client_no_context_takeover = false; // ask the client to reset its compressor
+    uint8_t server_max_window_bits = 15; // 9-15
+    uint8_t client_max_window_bits = 15; // 8-15
+    int8_t level = -1; // zlib compression level, -1 is Z_DEFAULT_COMPRESSION
+    uint32_t threshold = 256; // messages smaller than this are sent uncompressed
+};
+
+struct tls_options {
+    std::string certificate; // PEM certificate chain file, required for listeners
+    std::string private_key; // PEM private key file
+    std::string ca; // PEM file of trusted certificates, empty uses the system default paths
+    std::string server_name; // connect: SNI and the host name checked against the certificate
+    bool verify = false; // verify the peer certificate
+};
+
 constexpr uint32_t BOOTSTRAP_ADDR = 0x01000001; //The first service's id
 
 using message_size_t = uint16_t; //PTYPE_SOCKET_MOON message length type
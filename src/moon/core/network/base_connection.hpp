@@ -5,10 +5,19 @@
 #include "config.hpp"
 #include "error.hpp"
 #include "message.hpp"
+#include "tls_stream.hpp"
 #include "write_queue.hpp"
 
+#if TARGET_PLATFORM == PLATFORM_LINUX || TARGET_PLATFORM == PLATFORM_MAC
+    #include <netinet/tcp.h>
+#endif
+
+#if TARGET_PLATFORM == PLATFORM_LINUX
+    #include <sys/sendfile.h>
+#endif
+
 namespace moon {
-enum class connection_mask : uint8_t {
+enum class connection_mask : uint16_t {
     none = 0,
     server = 1 << 0,
     would_close = 1 << 1,
@@ -16,6 +25,13 @@ enum class connection_mask : uint8_t {
     chunked_recv = 1 << 3,
     chunked_send = 1 << 4,
     chunked_both = 1 << 5,
+    queue_warned = 1 << 6,
+    queue_drop = 1 << 7, // drop oldest droppable buffers when over the warn limit
+    batch_recv = 1 << 8,
+    wide_header = 1 << 9, // PTYPE_SOCKET_MOON 4 bytes length prefix
+    sending = 1 << 10, // a write is pending on the socket
+    deferred_flush = 1 << 11, // writes are started by socket_server::flush
+    handshake = 1 << 12, // TLS handshake in progress
 };
 
 template<>
@@ -27,6 +43,39 @@ class base_connection: public std::enable_shared_from_this<base_connection> {
 public:
     using socket_t = asio::ip::tcp::socket;
 
+    // Read operation pending on the socket. A header read only fills the read cache and can
+    // be cancelled and started again on another io_context, a body read can not.
+    enum class read_state : uint8_t {
+        idle,
+        header,
+        body,
+    };
+
+    using transfer_context = socket_server::transfer_context;
+
+    // connections that do not finish the TLS handshake are closed
+    static constexpr int64_t TLS_HANDSHAKE_TIMEOUT = 10000; // ms
+
+    // Largest file chunk written at once, other connections are served between chunks
+    static constexpr size_t FILE_CHUNK_SIZE = 1024 * 1024;
+
+    // Chunk size when the file has to be copied through user space
+    static constexpr size_t FILE_COPY_CHUNK_SIZE = 65536;
+
+    struct file_deleter {
+        void operator()(std::FILE* f) const {
+            std::fclose(f);
+        }
+    };
+
+    using file_ptr = std::unique_ptr<std::FILE, file_deleter>;
+
+    struct file_segment {
+        file_ptr file;
+        int64_t offset;
+        size_t remaining;
+    };
+
     template<typename... Args>
     explicit base_connection(
         uint32_t serviceid,
@@ -37,6 +86,7 @@ public:
         type_(type),
         serviceid_(serviceid),
         parent_(s),
+        net_(&s->net_stats()),
         socket_(std::forward<Args>(args)...) {}
 
     base_connection(const base_connection&) = delete;
@@ -49,7 +99,8 @@ public:
         if (!server) {
             mask_ = enum_unset_bitmask(mask_, connection_mask::server);
         }
-        recvtime_ = parent_->time();
+        recvtime_ = parent_->now();
+        arm_timeout();
     }
 
     virtual direct_read_result read(size_t, std::string_view, int64_t) {
@@ -64,28 +115,134 @@ public:
             return false;
         }
 
-        if (wq_warn_size_ != 0 && wqueue_.writeable() >= wq_warn_size_) {
-            CONSOLE_WARN("network send queue too long. size: {}", wqueue_.writeable());
-            if (wq_error_size_ != 0 && wqueue_.writeable() >= wq_error_size_) {
-                asio::post(socket_.get_executor(), [this, self = shared_from_this()]() {
-                    error(make_error_code(moon::error::send_queue_too_big));
-                });
-                return false;
-            }
+        if (!check_queue_limit(data->size())) {
+            asio::post(socket_.get_executor(), [this, self = shared_from_this()]() {
+                error(make_error_code(moon::error::send_queue_too_big));
+            });
+            return false;
+        }
+
+        if (slow_consumer(data->size())) {
+            kick();
+            return false;
         }
 
         if (data->has_bitmask(socket_send_mask::close)) {
             mask_ = mask_ | connection_mask::would_close;
         }
 
-        if (wqueue_.enqueue(std::move(data)) == 1) {
+        net_queued_ += data->size();
+        socket_server::network_stats::add(net_->queued_bytes, data->size());
+
+        // during a transfer the queue is kept and sent by the new worker
+        if (wqueue_.enqueue(std::move(data)) == 1 && nullptr == transfer_) {
+            if (enum_has_any_bitmask(mask_, connection_mask::deferred_flush) && nullptr != parent_) {
+                parent_->defer_flush(shared_from_this());
+            } else {
+                post_send();
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Queue size bytes of file from offset, written after the data queued before it. Plain and
+     * kTLS sockets use sendfile(2) and the bytes never enter user space, other connections
+     * copy the file in chunks.
+     */
+    bool send_file(file_ptr file, int64_t offset, size_t size, socket_send_mask mask) {
+        auto marker = std::make_shared<buffer>(0);
+        // the marker must stay paired with its files_ entry, so it is never droppable
+        marker->add_bitmask((mask & socket_send_mask::close) | socket_send_mask::sendfile);
+        files_.emplace_back(std::move(file), offset, size);
+        if (!send(std::move(marker))) {
+            files_.pop_back();
+            return false;
+        }
+        return true;
+    }
+
+    void set_deferred_flush(bool v) {
+        mask_ = v ? (mask_ | connection_mask::deferred_flush)
+                  : enum_unset_bitmask(mask_, connection_mask::deferred_flush);
+    }
+
+    // Start writing what was queued since the last flush, see set_deferred_flush
+    void flush() {
+        if (wqueue_.writeable() > 0 && nullptr == transfer_ && is_open()
+            && !enum_has_any_bitmask(mask_, connection_mask::sending))
+        {
             post_send();
         }
+    }
 
+    bool can_transfer() const {
+        return nullptr == transfer_ && nullptr != parent_ && is_open()
+            && !enum_has_any_bitmask(
+                mask_,
+                connection_mask::reading | connection_mask::would_close | connection_mask::handshake
+            );
+    }
+
+    /**
+     * Move the connection to the socket_server of another worker, see socket_server::transfer.
+     * The pending write and a pending body read are completed first, a pending header read is
+     * cancelled. Read cache and send queue stay with the connection.
+     */
+    bool transfer(const transfer_context& ctx) {
+        if (!can_transfer()) {
+            return false;
+        }
+        transfer_ = std::make_unique<transfer_context>(ctx);
+        try_transfer();
         return true;
     }
 
+    // Called on the old worker, the connection gives up its native socket
+    socket_t::native_handle_type detach(asio::error_code& ec) {
+        socket_server::network_stats::sub(net_->queued_bytes, net_queued_);
+        return socket_.release(ec);
+    }
+
+    // Called on the new worker
+    void attach(
+        socket_server* s,
+        uint32_t owner,
+        const asio::ip::tcp& protocol,
+        socket_t::native_handle_type handle,
+        asio::error_code& ec
+    ) {
+        parent_ = s;
+        net_ = &s->net_stats();
+        timer_deadline_ = 0;
+        serviceid_ = owner;
+        socket_server::network_stats::add(net_->queued_bytes, net_queued_);
+        socket_ = socket_t(s->context_);
+        socket_.assign(protocol, handle, ec);
+        if (ec) {
+            asio::error_code ignore_ec;
+            asio::detail::socket_ops::state_type state = 0;
+            asio::detail::socket_ops::close(handle, state, true, ignore_ec);
+        }
+    }
+
+    void resume() {
+        if (wqueue_.writeable() > 0) {
+            post_send();
+        }
+        resume_read();
+        arm_timeout();
+    }
+
     void close() {
+        socket_server::network_stats::sub(net_->queued_bytes, net_queued_);
+        net_queued_ = 0;
+#ifdef MOON_ENABLE_OPENSSL
+        if (nullptr != stream_.tls_ && socket_.is_open()) {
+            stream_.tls_->shutdown();
+        }
+#endif
         if (socket_.is_open()) {
             asio::error_code ignore_ec;
             socket_.shutdown(asio::ip::tcp::socket::shutdown_both, ignore_ec);
@@ -97,6 +254,68 @@ public:
         return socket_;
     }
 
+    void set_tls([[maybe_unused]] std::shared_ptr<tls_context> ctx) {
+#ifdef MOON_ENABLE_OPENSSL
+        stream_.tls_ = std::make_unique<tls_stream>(std::move(ctx), socket_);
+#endif
+    }
+
+    // Take over the TLS session of the connection the socket was moved from
+    void take_tls([[maybe_unused]] base_connection& other) {
+#ifdef MOON_ENABLE_OPENSSL
+        if (nullptr != other.stream_.tls_) {
+            stream_.tls_ = std::move(other.stream_.tls_);
+            stream_.tls_->socket(socket_);
+        }
+#endif
+    }
+
+    bool is_tls() const {
+#ifdef MOON_ENABLE_OPENSSL
+        return nullptr != stream_.tls_;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Run the TLS handshake of a connection with TLS, before start(). handler(ec) is called
+     * on the connection's io thread.
+     */
+    template<typename CompletionToken>
+    auto async_handshake(bool server, CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken, void(asio::error_code)>(
+            [this, server](auto handler) {
+                mask_ = mask_ | connection_mask::handshake;
+                if (nullptr != parent_) {
+                    recvtime_ = parent_->now();
+                    arm_timeout();
+                }
+#ifdef MOON_ENABLE_OPENSSL
+                assert(nullptr != stream_.tls_);
+                auto slot = asio::get_associated_cancellation_slot(handler);
+                stream_.tls_->async_handshake(
+                    server,
+                    asio::bind_cancellation_slot(
+                        slot,
+                        [this, h = std::move(handler)](const asio::error_code& ec) mutable {
+                            mask_ = enum_unset_bitmask(mask_, connection_mask::handshake);
+                            std::move(h)(ec);
+                        }
+                    )
+                );
+#else
+                (void)server;
+                asio::post(socket_.get_executor(), [this, h = std::move(handler)]() mutable {
+                    mask_ = enum_unset_bitmask(mask_, connection_mask::handshake);
+                    std::move(h)(asio::error_code { asio::error::operation_not_supported });
+                });
+#endif
+            },
+            token
+        );
+    }
+
     bool is_open() const {
         return socket_.is_open();
     }
@@ -117,17 +336,90 @@ public:
         return serviceid_;
     }
 
+    void owner(uint32_t serviceid) {
+        serviceid_ = serviceid;
+    }
+
     bool is_server() const {
         return enum_has_any_bitmask(mask_, connection_mask::server);
     }
 
-    void timeout(time_t now) {
-        if ((0 != timeout_) && (0 != recvtime_) && (now - recvtime_ > timeout_)) {
-            asio::post(socket_.get_executor(), [this, self = shared_from_this()]() {
-                error(make_error_code(moon::error::read_timeout));
-            });
+    // Make sure the timer wheel of parent_ checks this connection at next_timeout()
+    void arm_timeout() {
+        if (nullptr == parent_) {
+            return;
+        }
+        auto deadline = next_timeout(parent_->now());
+        if (0 == deadline || (0 != timer_deadline_ && timer_deadline_ <= deadline)) {
+            return;
+        }
+        timer_deadline_ = deadline;
+        parent_->schedule_timeout(fd_, deadline);
+    }
+
+    // Called by the timer wheel of parent_ with the deadline given to schedule_timeout
+    void on_timer(int64_t deadline, int64_t now) {
+        if (deadline != timer_deadline_) {
+            // replaced by an earlier deadline
             return;
         }
+        timer_deadline_ = 0;
+        if (timeout(now)) {
+            arm_timeout();
+        }
+    }
+
+    // Earliest time (ms) timeout() has something to check, 0 if none
+    int64_t next_timeout(int64_t now) const {
+        if (enum_has_any_bitmask(mask_, connection_mask::handshake)) {
+            return recvtime_ + TLS_HANDSHAKE_TIMEOUT;
+        }
+
+        int64_t next = 0;
+        auto earlier = [&next](int64_t t) {
+            if (0 != t && (0 == next || t < next)) {
+                next = t;
+            }
+        };
+        if (0 != timeout_ && 0 != recvtime_) {
+            earlier(recvtime_ + static_cast<int64_t>(timeout_) * 1000);
+        }
+        if (0 != stall_limit_ && 0 != send_start_) {
+            earlier(send_start_ + stall_limit_ + 1);
+        }
+        earlier(memory_timeout(now));
+        return next;
+    }
+
+    // Returns false when the connection is closed
+    bool timeout(int64_t now) {
+        if (enum_has_any_bitmask(mask_, connection_mask::handshake)) {
+            if (now - recvtime_ >= TLS_HANDSHAKE_TIMEOUT) {
+                // the pending handshake completes with operation_aborted
+                asio::error_code ec;
+                socket_.close(ec);
+                return false;
+            }
+            return true;
+        }
+
+        if ((0 != timeout_) && (0 != recvtime_)
+            && (now - recvtime_ >= static_cast<int64_t>(timeout_) * 1000))
+        {
+            error(make_error_code(moon::error::read_timeout));
+            return false;
+        }
+
+        if (slow_consumer(0)) {
+            if (parent_ != nullptr) {
+                socket_server::network_stats::add(net_->kicked, 1);
+            }
+            error(make_error_code(moon::error::slow_consumer));
+            return false;
+        }
+
+        release_memory(now);
+        return true;
     }
 
     bool set_no_delay() {
@@ -139,13 +431,39 @@ public:
 
     void settimeout(uint32_t v) {
         timeout_ = v;
-        if(parent_ != nullptr)
-            recvtime_ = parent_->time();
+        if (parent_ != nullptr) {
+            recvtime_ = parent_->now();
+            arm_timeout();
+        }
+    }
+
+    void set_send_queue_limit(size_t warn_bytes, size_t error_bytes, bool drop) {
+        wq_warn_bytes_ = warn_bytes;
+        wq_error_bytes_ = error_bytes;
+        mask_ = drop ? (mask_ | connection_mask::queue_drop)
+                     : enum_unset_bitmask(mask_, connection_mask::queue_drop);
     }
 
-    void set_send_queue_limit(uint16_t warnsize, uint16_t errorsize) {
-        wq_warn_size_ = warnsize;
-        wq_error_size_ = errorsize;
+    void set_slow_consumer_limit(size_t max_bytes, uint32_t max_stall_ms) {
+        queue_bytes_limit_ = max_bytes;
+        stall_limit_ = max_stall_ms;
+    }
+
+    // Smoothed round trip time reported by the kernel in microseconds, -1 if unknown
+    int64_t rtt() {
+#if TARGET_PLATFORM == PLATFORM_LINUX
+        struct tcp_info info {};
+        socklen_t len = sizeof(info);
+        if (::getsockopt(socket_.native_handle(), IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+            return info.tcpi_rtt;
+#elif TARGET_PLATFORM == PLATFORM_MAC && defined(TCP_CONNECTION_INFO)
+        struct tcp_connection_info info {};
+        socklen_t len = sizeof(info);
+        if (::getsockopt(socket_.native_handle(), IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &len)
+            == 0)
+            return static_cast<int64_t>(info.tcpi_srtt) * 1000;
+#endif
+        return -1;
     }
 
     std::string address() {
@@ -160,7 +478,106 @@ public:
         return address;
     }
 
+    // Broadcast support: connections that can share a frame get the bytes built once per
+    // protocol type by encode_shared_frame(), the others receive the payload through send().
+    virtual bool share_frame(const buffer_shr_ptr_t&) const {
+        return true;
+    }
+
+    virtual buffer_shr_ptr_t encode_shared_frame(const buffer_shr_ptr_t& data) const {
+        return data;
+    }
+
+    std::string stats() {
+        std::string res = std::format(
+            R"({{"fd":{},"type":{},"owner":{},"bytes_in":{},"bytes_out":{},"queue":{},"queue_bytes":{},"dropped":{},"stall":{},"max_stall":{},"rtt":{})",
+            fd_,
+            static_cast<int>(type_),
+            serviceid_,
+            bytes_in_,
+            bytes_out_,
+            wqueue_.writeable(),
+            wqueue_.bytes(),
+            dropped_,
+            stall_,
+            max_stall_,
+            rtt()
+        );
+#ifdef MOON_ENABLE_OPENSSL
+        if (const auto& tls = stream_.tls_; nullptr != tls) {
+            res.append(std::format(
+                R"(,"tls":"{}","ktls_send":{},"ktls_recv":{})",
+                tls->version(),
+                tls->ktls_send(),
+                tls->ktls_recv()
+            ));
+        }
+#endif
+        append_stats(res);
+        res.append("}");
+        return res;
+    }
+
 protected:
+    virtual void append_stats(std::string&) const {}
+
+    // Start reading on the new worker after a transfer, read_state_ was idle
+    virtual void resume_read() {}
+
+    void try_transfer() {
+        if (enum_has_any_bitmask(mask_, connection_mask::sending)) {
+            return; // continued by the write handler
+        }
+
+        switch (read_state_) {
+            case read_state::header: {
+                // the aborted read handler continues in error()
+                asio::error_code ignore_ec;
+                socket_.cancel(ignore_ec);
+                return;
+            }
+            case read_state::body:
+                return; // continued before the next header read
+            default:
+                break;
+        }
+
+        auto ctx = std::move(transfer_);
+        parent_->move_connection(shared_from_this(), *ctx);
+    }
+
+    // Returns true if the error was caused by a transfer and the connection is still alive
+    bool transfer_error(const asio::error_code& e) {
+        if (nullptr == transfer_) {
+            return false;
+        }
+
+        if (e == asio::error::operation_aborted && is_open()) {
+            try_transfer();
+            return true;
+        }
+
+        auto ctx = std::move(transfer_);
+        if (nullptr != parent_) {
+            parent_->response(
+                fd_,
+                ctx->caller,
+                std::format("socket_server::transfer {}({})", e.message(), e.value()),
+                ctx->sessionid,
+                PTYPE_ERROR
+            );
+        }
+        return false;
+    }
+
+    // Called by timeout(), give back memory kept for past peaks
+    virtual void release_memory(int64_t) {}
+
+    // When release_memory has something to release (ms), 0 if never
+    virtual int64_t memory_timeout(int64_t) const {
+        return 0;
+    }
+
     virtual void prepare_send(size_t default_once_send_bytes) {
         wqueue_.prepare_buffers(
             [this](const buffer_shr_ptr_t& elm) { wqueue_.consume(elm->data(), elm->size()); },
@@ -169,33 +586,228 @@ protected:
     }
 
     void post_send() {
-        prepare_send(262144);
+        if (parent_ != nullptr) {
+            send_start_ = parent_->now();
+            if (0 != stall_limit_) {
+                arm_timeout();
+            }
+        }
+
+        mask_ = mask_ | connection_mask::sending;
+        socket_server::network_stats::add(net_->writes, 1);
+
+        if (wqueue_.front_is_file()) {
+            write_file();
+            return;
+        }
 
+        prepare_send(262144);
         asio::async_write(
-            socket_,
+            stream_,
             make_buffers_ref(wqueue_.buffer_sequence()),
-            [this, self = shared_from_this()](const asio::error_code& e, std::size_t) {
+            [this, self = shared_from_this()](const asio::error_code& e, std::size_t n) {
+                mask_ = enum_unset_bitmask(mask_, connection_mask::sending);
                 if (e) {
                     error(e);
                     return;
                 }
 
-                wqueue_.commit_written();
+                on_written(n);
+                continue_send();
+            }
+        );
+    }
+
+    // A write completed, start the next one or finish a pending transfer or close
+    void continue_send() {
+        if (nullptr != transfer_) {
+            try_transfer();
+        } else if (wqueue_.writeable() > 0) {
+            post_send();
+        } else if (enum_has_any_bitmask(mask_, connection_mask::would_close) && parent_ != nullptr)
+        {
+            parent_->close(fd_);
+            parent_ = nullptr;
+        }
+    }
+
+    // Write the file segment at the front of the send queue, one chunk per call
+    void write_file() {
+        auto& seg = files_.front();
+        if (seg.remaining == 0) {
+            files_.pop_front();
+            wqueue_.consume();
+            mask_ = enum_unset_bitmask(mask_, connection_mask::sending);
+            on_written(0);
+            continue_send();
+            return;
+        }
 
-                if (wqueue_.writeable() > 0) {
-                    post_send();
-                } else if (enum_has_any_bitmask(mask_, connection_mask::would_close)
-                           && parent_ != nullptr)
-                {
-                    parent_->close(fd_);
-                    parent_ = nullptr;
+        asio::error_code ec;
+        int64_t n = sendfile_some(seg, ec);
+        if (n > 0) {
+            on_file_written(seg, static_cast<size_t>(n));
+        } else if (ec == asio::error::operation_not_supported) {
+            copy_file(seg);
+            return;
+        } else if (ec != asio::error::would_block) {
+            mask_ = enum_unset_bitmask(mask_, connection_mask::sending);
+            error(ec ? ec : asio::error::make_error_code(asio::error::eof));
+            return;
+        }
+
+        socket_.async_wait(
+            socket_t::wait_write,
+            [this, self = shared_from_this()](const asio::error_code& e) {
+                if (e) {
+                    mask_ = enum_unset_bitmask(mask_, connection_mask::sending);
+                    error(e);
+                    return;
+                }
+                write_file();
+            }
+        );
+    }
+
+    // One sendfile(2) call, operation_not_supported when the file has to be copied instead
+    int64_t sendfile_some(const file_segment& seg, asio::error_code& ec) {
+        size_t n = std::min(seg.remaining, FILE_CHUNK_SIZE);
+#ifdef MOON_ENABLE_OPENSSL
+        if (nullptr != stream_.tls_) {
+            return stream_.tls_->sendfile(::fileno(seg.file.get()), seg.offset, n, ec);
+        }
+#endif
+#if TARGET_PLATFORM == PLATFORM_LINUX
+        socket_.native_non_blocking(true, ec);
+        if (ec) {
+            return -1;
+        }
+        off_t offset = seg.offset;
+        ssize_t res = ::sendfile(socket_.native_handle(), ::fileno(seg.file.get()), &offset, n);
+        if (res < 0) {
+            ec = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                ? asio::error::would_block
+                : asio::error_code(errno, asio::error::get_system_category());
+        }
+        return res;
+#else
+        ec = asio::error::operation_not_supported;
+        return -1;
+#endif
+    }
+
+    void copy_file(const file_segment& seg) {
+        if (nullptr == file_buffer_) {
+            file_buffer_ = std::make_unique<char[]>(FILE_COPY_CHUNK_SIZE);
+        }
+
+        size_t n = std::min(seg.remaining, FILE_COPY_CHUNK_SIZE);
+#if TARGET_PLATFORM == PLATFORM_WINDOWS
+        int res = ::_fseeki64(seg.file.get(), seg.offset, SEEK_SET);
+#else
+        int res = ::fseeko(seg.file.get(), static_cast<off_t>(seg.offset), SEEK_SET);
+#endif
+        if (res != 0 || std::fread(file_buffer_.get(), 1, n, seg.file.get()) != n) {
+            mask_ = enum_unset_bitmask(mask_, connection_mask::sending);
+            error(asio::error::make_error_code(asio::error::eof));
+            return;
+        }
+
+        asio::async_write(
+            stream_,
+            asio::buffer(file_buffer_.get(), n),
+            [this, self = shared_from_this()](const asio::error_code& e, std::size_t n) {
+                if (e) {
+                    mask_ = enum_unset_bitmask(mask_, connection_mask::sending);
+                    error(e);
+                    return;
                 }
+                on_file_written(files_.front(), n);
+                write_file();
             }
         );
     }
 
+    void on_file_written(file_segment& seg, size_t n) {
+        seg.offset += static_cast<int64_t>(n);
+        seg.remaining -= n;
+        bytes_out_ += n;
+        socket_server::network_stats::add(net_->bytes_out, n);
+    }
+
+    void on_written(size_t n) {
+        if (parent_ != nullptr && send_start_ != 0) {
+            auto elapsed = parent_->now() - send_start_;
+            stall_ += elapsed;
+            max_stall_ = std::max(max_stall_, elapsed);
+        }
+        send_start_ = 0;
+
+        bytes_out_ += n;
+        socket_server::network_stats::add(net_->bytes_out, n);
+
+        size_t before = wqueue_.bytes();
+        wqueue_.commit_written();
+        size_t committed = std::min(before - wqueue_.bytes(), net_queued_);
+        net_queued_ -= committed;
+        socket_server::network_stats::sub(net_->queued_bytes, committed);
+    }
+
+    void on_read(size_t n) {
+        bytes_in_ += n;
+        socket_server::network_stats::add(net_->bytes_in, n);
+    }
+
+    // Apply the byte limits of the send queue to a new buffer of `incoming` bytes.
+    // Returns false when the error limit would be exceeded.
+    bool check_queue_limit(size_t incoming) {
+        if (wq_warn_bytes_ == 0 || wqueue_.bytes() + incoming < wq_warn_bytes_) {
+            mask_ = enum_unset_bitmask(mask_, connection_mask::queue_warned);
+            return true;
+        }
+
+        if (enum_has_any_bitmask(mask_, connection_mask::queue_drop)) {
+            auto limit = wq_warn_bytes_ - std::min(incoming, wq_warn_bytes_);
+            auto [count, bytes] = wqueue_.drop_oldest(limit);
+            if (count > 0) {
+                dropped_ += count;
+                auto n = std::min(bytes, net_queued_);
+                net_queued_ -= n;
+                socket_server::network_stats::sub(net_->queued_bytes, n);
+            }
+        }
+
+        size_t queued = wqueue_.bytes() + incoming;
+        if (queued >= wq_warn_bytes_ && !enum_has_any_bitmask(mask_, connection_mask::queue_warned)) {
+            mask_ = mask_ | connection_mask::queue_warned;
+            CONSOLE_WARN(
+                "network send queue too long. fd: {} bytes: {} buffers: {}",
+                fd_,
+                queued,
+                wqueue_.writeable()
+            );
+        }
+        return wq_error_bytes_ == 0 || queued <= wq_error_bytes_;
+    }
+
+    bool slow_consumer(size_t incoming) const {
+        if (queue_bytes_limit_ != 0 && wqueue_.bytes() + incoming > queue_bytes_limit_)
+            return true;
+        return stall_limit_ != 0 && send_start_ != 0 && parent_ != nullptr
+            && parent_->now() - send_start_ > stall_limit_;
+    }
+
+    void kick() {
+        asio::post(socket_.get_executor(), [this, self = shared_from_this()]() {
+            if (parent_ != nullptr) {
+                socket_server::network_stats::add(net_->kicked, 1);
+            }
+            error(make_error_code(moon::error::slow_consumer));
+        });
+    }
+
     virtual void error(const asio::error_code& e, const std::string& additional = "") {
-        if (nullptr == parent_) {
+        if (nullptr == parent_ || transfer_error(e)) {
             return;
         }
         std::string str = e.message();
@@ -222,7 +834,7 @@ protected:
     template<typename Message>
     void handle_message(Message&& m) {
         if (nullptr != parent_) {
-            recvtime_ = parent_->time();
+            recvtime_ = parent_->now();
             m.sender = fd_;
             parent_->handle_message(serviceid_, std::forward<Message>(m));
         }
@@ -230,15 +842,32 @@ protected:
 
 protected:
     connection_mask mask_ = connection_mask::server;
+    read_state read_state_ = read_state::idle;
     uint8_t type_ = 0;
-    uint16_t wq_warn_size_ = 0;
-    uint16_t wq_error_size_ = 0;
     uint32_t fd_ = 0;
     uint32_t timeout_ = 0;
     uint32_t serviceid_ = 0;
-    time_t recvtime_ = 0;
+    int64_t recvtime_ = 0; // ms
+    int64_t timer_deadline_ = 0; // ms, the earliest deadline scheduled in the timer wheel
+    // Counters below are only touched on the io thread of parent_
+    uint64_t bytes_in_ = 0;
+    uint64_t bytes_out_ = 0;
+    int64_t send_start_ = 0; // ms, 0 when no write is pending
+    int64_t stall_ = 0; // ms, total time writes were pending
+    int64_t max_stall_ = 0; // ms, longest pending write
+    uint32_t stall_limit_ = 0; // ms, slow consumer limit
+    size_t queue_bytes_limit_ = 0; // slow consumer limit
+    size_t wq_warn_bytes_ = 0;
+    size_t wq_error_bytes_ = 0;
+    uint64_t dropped_ = 0; // droppable buffers discarded from the send queue
+    size_t net_queued_ = 0; // bytes this connection added to net_->queued_bytes
     moon::socket_server* parent_;
+    socket_server::network_stats* net_;
+    std::unique_ptr<transfer_context> transfer_;
     write_queue wqueue_;
+    std::deque<file_segment> files_; // one for each sendfile marker in wqueue_
+    std::unique_ptr<char[]> file_buffer_;
     socket_t socket_;
+    socket_stream stream_ { socket_ };
 };
 } // namespace moon
\ No newline at end of file
@@ -0,0 +1,103 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define MOON_DELIM_SSE2
+#endif
+
+namespace moon {
+namespace detail {
+    inline int count_trailing_zeros(uint32_t v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long index = 0;
+        _BitScanForward(&index, v);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctz(v);
+#endif
+    }
+} // namespace detail
+
+/**
+ * Find the first occurrence of delim (1-7 bytes) in data, searching from offset `from`.
+ * Returns the position of the delimiter or std::string_view::npos.
+ *
+ * Candidates are found by comparing the first and the last delimiter byte of a whole
+ * vector at once, the bytes in between are verified with memcmp.
+ */
+inline size_t find_delimiter(std::string_view data, std::string_view delim, size_t from = 0) {
+    const size_t n = delim.size();
+    if (n == 0 || data.size() < n || from > data.size() - n) {
+        return std::string_view::npos;
+    }
+
+    const char* p = data.data();
+    const size_t size = data.size();
+
+    if (n == 1) {
+        auto r = static_cast<const char*>(std::memchr(p + from, delim[0], size - from));
+        return r ? static_cast<size_t>(r - p) : std::string_view::npos;
+    }
+
+    // last position where a delimiter can start
+    const size_t last = size - n;
+    size_t i = from;
+
+#if defined(__AVX2__)
+    const __m256i first = _mm256_set1_epi8(delim[0]);
+    const __m256i tail = _mm256_set1_epi8(delim[n - 1]);
+    for (; i + 32 <= last + 1; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + n - 1));
+        auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, tail))
+        ));
+        while (mask != 0) {
+            size_t pos = i + detail::count_trailing_zeros(mask);
+            if (n == 2 || std::memcmp(p + pos + 1, delim.data() + 1, n - 2) == 0) {
+                return pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(MOON_DELIM_SSE2)
+    const __m128i first = _mm_set1_epi8(delim[0]);
+    const __m128i tail = _mm_set1_epi8(delim[n - 1]);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + n - 1));
+        auto mask = static_cast<uint32_t>(
+            _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, tail)))
+        );
+        while (mask != 0) {
+            size_t pos = i + detail::count_trailing_zeros(mask);
+            if (n == 2 || std::memcmp(p + pos + 1, delim.data() + 1, n - 2) == 0) {
+                return pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    // memchr for the first byte, then compare the rest
+    while (i <= last) {
+        auto r = static_cast<const char*>(std::memchr(p + i, delim[0], last + 1 - i));
+        if (r == nullptr) {
+            break;
+        }
+        size_t pos = static_cast<size_t>(r - p);
+        if (std::memcmp(r + 1, delim.data() + 1, n - 1) == 0) {
+            return pos;
+        }
+        i = pos + 1;
+    }
+    return std::string_view::npos;
+}
+} // namespace moon
+
+#undef MOON_DELIM_SSE2
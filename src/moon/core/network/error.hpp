@@ -51,6 +51,7 @@ enum class error {
     ws_bad_size, //The WebSocket frame size was not canonical
     bad_frame_payload, //The WebSocket frame payload was not valid utf8
     ws_closed, //The WebSocket receive close frame
+    slow_consumer, //The peer does not read fast enough, send queue bytes or write stall exceeded limit
 };
 
 /// Error conditions corresponding to sets of error codes.
@@ -89,6 +90,8 @@ namespace detail {
                     return "Socket read timeout";
                 case error::send_queue_too_big:
                     return "The socket send message queue size exceeded configured(config.hpp) limit";
+                case error::slow_consumer:
+                    return "The socket peer is a slow consumer, send queue bytes or write stall exceeded limit";
                 case error::invalid_read_operation:
                     return "invalid read operation";
                 case error::ws_bad_http_header:
@@ -155,6 +158,7 @@ namespace detail {
                 case error::write_message_too_big:
                 case error::read_timeout:
                 case error::send_queue_too_big:
+                case error::slow_consumer:
                     return { ev, *this };
                 case error::ws_bad_http_version:
                 case error::ws_bad_method:
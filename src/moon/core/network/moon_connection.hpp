@@ -2,6 +2,7 @@
 #include "base_connection.hpp"
 #include "common/byte_convert.hpp"
 #include "streambuf.hpp"
+#include <bit>
 
 namespace moon {
 class moon_connection: public base_connection {
@@ -11,6 +12,12 @@ public:
 
     static constexpr size_t DEFAULT_READ_CACHE_SIZE = 512;
 
+    static constexpr size_t MAX_READ_CACHE_SIZE = 1024 * 1024;
+
+    static constexpr size_t DEFAULT_WIDE_MESSAGE_SIZE = 64 * 1024 * 1024;
+
+    using wide_size_t = uint32_t; // length prefix of the wide framing mode
+
     using base_connection_t = base_connection;
 
     template<
@@ -36,9 +43,11 @@ public:
     }
 
     bool send(buffer_shr_ptr_t data) override {
-        if (data->size() >= MESSAGE_CONTINUED_FLAG
-            && !enum_has_any_bitmask(mask_, connection_mask::chunked_send))
-        {
+        bool too_big = enum_has_any_bitmask(mask_, connection_mask::wide_header)
+            ? data->size() > std::numeric_limits<wide_size_t>::max()
+            : (data->size() >= MESSAGE_CONTINUED_FLAG
+               && !enum_has_any_bitmask(mask_, connection_mask::chunked_send));
+        if (too_big && !data->has_bitmask(socket_send_mask::raw)) {
             asio::post(socket_.get_executor(), [this, self = shared_from_this()]() {
                 error(make_error_code(moon::error::write_message_too_big));
             });
@@ -47,6 +56,51 @@ public:
         return base_connection_t::send(std::move(data));
     }
 
+    bool share_frame(const buffer_shr_ptr_t& data) const override {
+        // shared frames use the 2 bytes prefix
+        return data->size() < MESSAGE_CONTINUED_FLAG
+            && !enum_has_any_bitmask(mask_, connection_mask::wide_header);
+    }
+
+    buffer_shr_ptr_t encode_shared_frame(const buffer_shr_ptr_t& data) const override {
+        if (data->has_bitmask(socket_send_mask::raw)) {
+            return data;
+        }
+
+        auto header = static_cast<message_size_t>(data->size());
+        host2net(header);
+        auto frame = buffer::make_shared(sizeof(header) + data->size());
+        frame->write_back(header);
+        frame->write_back({ data->data(), data->size() });
+        frame->add_bitmask(socket_send_mask::raw);
+        frame->add_bitmask(
+            data->bitmask<socket_send_mask>()
+            & (socket_send_mask::close | socket_send_mask::droppable)
+        );
+        return frame;
+    }
+
+    // Size of the read-ahead cache, takes effect before the next socket read.
+    // With batch set, all complete frames of one read are delivered as a single message.
+    void set_read_cache(size_t size, bool batch) {
+        // buffer capacity is always a power of two
+        cache_size_ = std::bit_ceil(std::clamp(size, DEFAULT_READ_CACHE_SIZE, MAX_READ_CACHE_SIZE));
+        mask_ = batch ? (mask_ | connection_mask::batch_recv)
+                      : enum_unset_bitmask(mask_, connection_mask::batch_recv);
+    }
+
+    // Switch between the 2 bytes length prefix (with chunked continuation) and a 4 bytes
+    // prefix, both peers must use the same mode. Incoming messages larger than max_size
+    // close the connection.
+    void set_length_prefix(uint8_t bytes, size_t max_size) {
+        if (bytes == sizeof(wide_size_t)) {
+            mask_ = mask_ | connection_mask::wide_header;
+        } else {
+            mask_ = enum_unset_bitmask(mask_, connection_mask::wide_header);
+        }
+        wide_max_size_ = max_size;
+    }
+
     void set_enable_chunked(connection_mask v) {
         // Clear both chunked flags first
         mask_ = enum_unset_bitmask(
@@ -58,12 +112,23 @@ public:
     }
 
 private:
+    void resume_read() override {
+        read_header();
+    }
+
     void prepare_send(size_t default_once_send_bytes) override {
         wqueue_.prepare_buffers(
             [this](const buffer_shr_ptr_t& elm) {
                 size_t size = elm->size();
                 const char* data = elm->data();
-                if (!elm->has_bitmask(socket_send_mask::raw)) {
+                if (elm->has_bitmask(socket_send_mask::raw)) {
+                    wqueue_.consume(data, size);
+                } else if (enum_has_any_bitmask(mask_, connection_mask::wide_header)) {
+                    auto header = static_cast<wide_size_t>(size);
+                    host2net(header);
+                    wqueue_.consume();
+                    wqueue_.prepare_with_padding(&header, sizeof(header), data, size);
+                } else {
                     wqueue_.consume();
                     message_size_t slice_size = 0;
                     message_size_t header = 0;
@@ -82,8 +147,6 @@ private:
                         wqueue_
                             .prepare_with_padding(&header, sizeof(header), nullptr, 0); //end flag
                     }
-                } else {
-                    wqueue_.consume(data, size);
                 }
             },
             default_once_send_bytes
@@ -91,18 +154,46 @@ private:
     }
 
     void read_header() {
-        if (cache_.size() >= sizeof(message_size_t)) {
-            handle_header();
+        // Frames already in the cache are handled in a loop, a large read-ahead cache may hold
+        // thousands of them.
+        const bool wide = enum_has_any_bitmask(mask_, connection_mask::wide_header);
+        const size_t header_size = wide ? sizeof(wide_size_t) : sizeof(message_size_t);
+        while (cache_.size() >= header_size) {
+            if (wide) {
+                if (!handle_wide_header()) {
+                    return;
+                }
+                continue;
+            }
+            if (enum_has_any_bitmask(mask_, connection_mask::batch_recv) && nullptr == data_
+                && handle_batch())
+            {
+                continue;
+            }
+            if (!handle_header()) {
+                return;
+            }
+        }
+
+        if (nullptr != transfer_) {
+            try_transfer();
             return;
         }
 
+        if (cache_.capacity() != cache_size_) {
+            resize_cache();
+        }
+
+        read_state_ = read_state::header;
         asio::async_read(
-            socket_,
+            stream_,
             moon::streambuf(&cache_, cache_.capacity()),
-            asio::transfer_at_least(sizeof(message_size_t)),
-            [this, self = shared_from_this()](const asio::error_code& e, std::size_t) {
+            asio::transfer_at_least(header_size),
+            [this, self = shared_from_this()](const asio::error_code& e, std::size_t n) {
+                read_state_ = read_state::idle;
                 if (!e) {
-                    handle_header();
+                    on_read(n);
+                    read_header();
                     return;
                 }
                 error(e);
@@ -110,7 +201,41 @@ private:
         );
     }
 
-    void handle_header() {
+    // Deliver every complete frame in the cache as one socket_recv_batch message, the payload
+    // keeps the wire format: a sequence of [uint16 big-endian size][data].
+    bool handle_batch() {
+        const char* p = cache_.data();
+        size_t size = cache_.size();
+        size_t pos = 0;
+        while (pos + sizeof(message_size_t) <= size) {
+            message_size_t len = 0;
+            memcpy(&len, p + pos, sizeof(len));
+            net2host(len);
+            if (len == MESSAGE_CONTINUED_FLAG || pos + sizeof(len) + len > size) {
+                break;
+            }
+            pos += sizeof(len) + len;
+        }
+
+        if (pos == 0) {
+            return false;
+        }
+
+        auto buf = buffer::make_unique(pos + BUFFER_OPTION_CHEAP_PREPEND);
+        buf->commit_unchecked(BUFFER_OPTION_CHEAP_PREPEND);
+        buf->consume_unchecked(BUFFER_OPTION_CHEAP_PREPEND);
+        buf->write_back({ p, pos });
+        cache_.consume_unchecked(pos);
+        handle_message(message { type_,
+                                 0,
+                                 std::to_underlying(socket_data_type::socket_recv_batch),
+                                 0,
+                                 std::move(buf) });
+        return true;
+    }
+
+    // Returns true when the whole frame was taken from the cache
+    bool handle_header() {
         message_size_t header = 0;
         [[maybe_unused]] bool always_ok = cache_.read(&header, 1);
         net2host(header);
@@ -118,13 +243,26 @@ private:
         bool fin = (header != MESSAGE_CONTINUED_FLAG);
         if (!fin && !enum_has_any_bitmask(mask_, connection_mask::chunked_recv)) {
             error(make_error_code(moon::error::read_message_too_big));
-            return;
+            return false;
         }
 
-        read_body(header, fin);
+        return read_body(header, fin);
     }
 
-    void read_body(message_size_t size, bool fin) {
+    bool handle_wide_header() {
+        wide_size_t header = 0;
+        [[maybe_unused]] bool always_ok = cache_.read(&header, 1);
+        net2host(header);
+
+        if (header > wide_max_size_) {
+            error(make_error_code(moon::error::read_message_too_big));
+            return false;
+        }
+
+        return read_body(header, true);
+    }
+
+    bool read_body(size_t size, bool fin) {
         if (nullptr == data_) {
             // More conservative memory allocation for chunked messages
             // Allocate exact size for final chunks, or use a growth factor for continued chunks
@@ -143,23 +281,28 @@ private:
 
         if (diff >= 0) {
             handle_body(fin);
-            return;
+            return true;
         }
 
         cache_.clear();
 
+        read_state_ = read_state::body;
         asio::async_read(
-            socket_,
+            stream_,
             moon::streambuf(data_.get()),
             asio::transfer_exactly(static_cast<size_t>(-diff)),
-            [this, self = shared_from_this(), fin](const asio::error_code& e, std::size_t) {
+            [this, self = shared_from_this(), fin](const asio::error_code& e, std::size_t n) {
+                read_state_ = read_state::idle;
                 if (!e) {
+                    on_read(n);
                     handle_body(fin);
+                    read_header();
                     return;
                 }
                 error(e);
             }
         );
+        return false;
     }
 
     void handle_body(bool fin) {
@@ -173,10 +316,17 @@ private:
                           std::move(data_) }
             );
         }
-        read_header();
+    }
+
+    void resize_cache() {
+        buffer cache { std::max(cache_size_, cache_.size()) };
+        cache.write_back({ cache_.data(), cache_.size() });
+        cache_ = std::move(cache);
     }
 
 private:
+    size_t cache_size_ = DEFAULT_READ_CACHE_SIZE;
+    size_t wide_max_size_ = DEFAULT_WIDE_MESSAGE_SIZE;
     buffer cache_ { DEFAULT_READ_CACHE_SIZE };
     buffer_ptr_t data_;
 };
@@ -7,6 +7,7 @@
 #include "network/moon_connection.hpp"
 #include "network/stream_connection.hpp"
 #include "network/ws_connection.hpp"
+#include <filesystem>
 
 
 
@@ -29,11 +30,25 @@ awaitable<std::string> co_timeout(std::chrono::steady_clock::duration duration)
     co_return std::string { "timeout" };
 };
 
+// Tick of the connection timeout wheel in ms, the timeout_granularity of the init conf
+static int64_t timeout_granularity(server* s) {
+    int64_t v = 1000;
+    if (auto env = s->get_env("TIMEOUT_GRANULARITY"); env) {
+        std::errc ec {};
+        v = moon::string_convert<int64_t>(*env, ec);
+        if (ec != std::errc() || v <= 0) {
+            v = 1000;
+        }
+    }
+    return std::max<int64_t>(v, 10);
+}
+
 socket_server::socket_server(server* s, worker* w, asio::io_context& ioctx):
     server_(s),
     worker_(w),
     context_(ioctx),
-    timer_(ioctx) {
+    timer_(ioctx),
+    wheel_(timeout_granularity(s), now()) {
     timeout();
 }
 
@@ -75,7 +90,7 @@ socket_server::listen(const std::string& host, uint16_t port, uint32_t owner, ui
         ctx->acceptor.bind(endpoint);
         ctx->acceptor.listen(std::numeric_limits<int>::max());
         ctx->reset_reserve();
-        auto id = server_->nextfd();
+        auto id = server_->nextfd(worker_->id());
         ctx->fd = id;
         acceptors_.try_emplace(id, ctx);
         return std::make_pair(id, ctx->acceptor.local_endpoint());
@@ -95,7 +110,7 @@ uint32_t socket_server::udp_open(uint32_t owner, std::string_view host, uint16_t
             udp::endpoint endpoint = *resolver.resolve(host, std::to_string(port)).begin();
             ctx = std::make_shared<socket_server::udp_context>(owner, context_, endpoint);
         }
-        auto id = server_->nextfd();
+        auto id = server_->nextfd(worker_->id());
         ctx->fd = id;
         do_receive(ctx);
         udp_.try_emplace(id, std::move(ctx));
@@ -137,6 +152,21 @@ bool socket_server::accept(uint32_t fd, int64_t sessionid, uint32_t owner) {
         return false;
 
     auto c = w->socket_server().make_connection(owner, ctx->type, tcp::socket(w->io_context()));
+    if (ctx->ws_deflate.enable) {
+        std::static_pointer_cast<ws_connection>(c)->set_deflate_options(ctx->ws_deflate);
+    }
+    if (ctx->deferred_flush) {
+        c->set_deferred_flush(true);
+    }
+    if (nullptr != ctx->tls) {
+        c->set_tls(ctx->tls);
+    }
+    if (ctx->length_prefix != 0) {
+        std::static_pointer_cast<moon_connection>(c)->set_length_prefix(
+            ctx->length_prefix,
+            ctx->max_message_size
+        );
+    }
 
     ctx->acceptor.async_accept(
         c->socket(),
@@ -154,7 +184,7 @@ bool socket_server::accept(uint32_t fd, int64_t sessionid, uint32_t owner) {
                         PTYPE_ERROR
                     );
                 } else {
-                    c->fd(server_->nextfd());
+                    c->fd(server_->nextfd(w->id()));
                     w->socket_server().add_connection(this, ctx, c, sessionid);
                 }
             } else {
@@ -188,25 +218,42 @@ void socket_server::connect(
     uint32_t owner,
     uint8_t type,
     int64_t sessionid,
-    uint32_t millseconds
+    uint32_t millseconds,
+    std::optional<tls_options> tls
 ) {
     co_spawn(
         context_.get_executor(),
-        connect_with_timeout(host, port, owner, type, sessionid, millseconds),
+        connect_with_timeout(host, port, owner, type, sessionid, millseconds, std::move(tls)),
         detached
     );
 }
 
-awaitable<std::string>
-socket_server::do_connect(std::string host, uint16_t port, uint32_t owner, uint8_t type, int64_t sessionid) {
+awaitable<std::string> socket_server::do_connect(
+    std::string host,
+    uint16_t port,
+    uint32_t owner,
+    uint8_t type,
+    int64_t sessionid,
+    std::shared_ptr<tls_context> tls
+) {
     try {
         tcp::resolver resolver(context_.get_executor());
         auto results =
             co_await resolver.async_resolve(host, std::to_string(port), asio::use_awaitable);
         auto conn = make_connection(owner, type, tcp::socket(context_));
         co_await asio::async_connect(conn->socket(), results, asio::use_awaitable);
-        conn->fd(server_->nextfd());
+        // registered before the handshake, so the timer wheel finds it at the handshake timeout
+        conn->fd(server_->nextfd(worker_->id()));
         connections_.try_emplace(conn->fd(), conn);
+        if (nullptr != tls) {
+            conn->set_tls(std::move(tls));
+            try {
+                co_await conn->async_handshake(false, asio::use_awaitable);
+            } catch (...) {
+                close(conn->fd());
+                throw;
+            }
+        }
         conn->start(false);
         handle_message(owner, message { PTYPE_INTEGER, 0, 0, sessionid, conn->fd() });
     } catch (const std::exception& e) {
@@ -221,18 +268,30 @@ awaitable<void> socket_server::connect_with_timeout(
     uint32_t owner,
     uint8_t type,
     int64_t sessionid,
-    uint32_t millseconds
+    uint32_t millseconds,
+    std::optional<tls_options> tls
 ) {
     try {
+        std::shared_ptr<tls_context> tls_ctx;
+        if (tls) {
+#ifdef MOON_ENABLE_OPENSSL
+            std::string err;
+            if (tls_ctx = tls_context::make(*tls, false, err); nullptr == tls_ctx)
+                throw std::runtime_error(err);
+#else
+            throw std::runtime_error("TLS is not supported, build with --openssl");
+#endif
+        }
+
         if (millseconds > 0) {
             auto res = co_await (
-                do_connect(host, port, owner, type, sessionid)
+                do_connect(host, port, owner, type, sessionid, tls_ctx)
                 || co_timeout(std::chrono::milliseconds(millseconds))
             );
             if (auto err = res.index() == 0 ? std::get<0>(res) : std::get<1>(res); !err.empty())
                 throw std::runtime_error(err);
         } else {
-            auto err = co_await do_connect(host, port, owner, type, sessionid);
+            auto err = co_await do_connect(host, port, owner, type, sessionid, tls_ctx);
             if (!err.empty())
                 throw std::runtime_error(err);
         }
@@ -285,6 +344,132 @@ bool socket_server::write(uint32_t fd, buffer_shr_ptr_t data, socket_send_mask m
     return false;
 }
 
+std::string socket_server::sendfile(
+    uint32_t fd,
+    const std::string& path,
+    int64_t offset,
+    int64_t size,
+    socket_send_mask mask
+) {
+    auto iter = connections_.find(fd);
+    if (iter == connections_.end()) {
+        return "closed";
+    }
+
+    if (iter->second->type() != PTYPE_SOCKET_TCP) {
+        return "only PTYPE_SOCKET_TCP connections support sendfile";
+    }
+
+    std::error_code ec;
+    auto file_size = static_cast<int64_t>(std::filesystem::file_size(path, ec));
+    if (ec) {
+        return std::format("{}: {}", path, ec.message());
+    }
+
+    if (offset < 0 || offset > file_size) {
+        return std::format("{}: offset {} out of range, file size {}", path, offset, file_size);
+    }
+
+    if (size < 0) {
+        size = file_size - offset;
+    } else if (size > file_size - offset) {
+        return std::format(
+            "{}: {} bytes from offset {} out of range, file size {}",
+            path,
+            size,
+            offset,
+            file_size
+        );
+    }
+
+    base_connection::file_ptr file { std::fopen(path.data(), "rb") };
+    if (nullptr == file) {
+        return std::format("{}: {}", path, std::strerror(errno));
+    }
+
+    if (!iter->second->send_file(std::move(file), offset, static_cast<size_t>(size), mask)) {
+        return "closed";
+    }
+    return std::string {};
+}
+
+size_t socket_server::broadcast(
+    std::vector<uint32_t> fds,
+    buffer_shr_ptr_t data,
+    socket_send_mask mask
+) {
+    if (nullptr == data || 0 == data->size() || fds.empty())
+        return 0;
+
+    data->add_bitmask(mask);
+
+    broadcast_frames_t frames;
+    std::vector<uint32_t> missing;
+    size_t n = broadcast_local(fds, data, frames, &missing);
+    if (missing.empty())
+        return n;
+
+    std::unordered_map<uint32_t, std::vector<uint32_t>> owned;
+    for (auto fd: missing) {
+        if (auto id = server_->fd_worker(fd); id != 0 && id != worker_->id())
+            owned[id].emplace_back(fd);
+    }
+
+    for (auto& [id, list]: owned) {
+        worker* w = server_->get_worker(id);
+        if (nullptr == w)
+            continue;
+        asio::post(
+            w->io_context(),
+            [s = &w->socket_server(), list = std::move(list), data, frames]() mutable {
+                s->broadcast_local(list, data, frames, nullptr);
+            }
+        );
+    }
+    return n;
+}
+
+size_t socket_server::broadcast_local(
+    const std::vector<uint32_t>& fds,
+    const buffer_shr_ptr_t& data,
+    broadcast_frames_t& frames,
+    std::vector<uint32_t>* missing
+) {
+    size_t n = 0;
+    for (auto fd: fds) {
+        auto iter = connections_.find(fd);
+        if (iter == connections_.end()) {
+            if (nullptr != missing)
+                missing->emplace_back(fd);
+            continue;
+        }
+
+        const auto& c = iter->second;
+        if (!c->share_frame(data)) {
+            n += c->send(data) ? 1 : 0;
+            continue;
+        }
+
+        size_t slot = 0;
+        switch (c->type()) {
+            case PTYPE_SOCKET_WS:
+                slot = 1;
+                break;
+            case PTYPE_SOCKET_MOON:
+                slot = 2;
+                break;
+            default:
+                break;
+        }
+
+        auto& frame = frames[slot];
+        if (nullptr == frame)
+            frame = c->encode_shared_frame(data);
+        n += c->send(frame) ? 1 : 0;
+    }
+    return n;
+}
+
 bool socket_server::close(uint32_t fd) {
     if (auto iter = connections_.find(fd); iter != connections_.end()) {
         iter->second->close();
@@ -332,6 +517,18 @@ bool socket_server::settimeout(uint32_t fd, uint32_t seconds) {
     return false;
 }
 
+bool socket_server::set_slow_consumer_limit(
+    uint32_t fd,
+    size_t max_bytes,
+    uint32_t max_stall_ms
+) {
+    if (auto iter = connections_.find(fd); iter != connections_.end()) {
+        iter->second->set_slow_consumer_limit(max_bytes, max_stall_ms);
+        return true;
+    }
+    return false;
+}
+
 bool socket_server::setnodelay(uint32_t fd) {
     if (auto iter = connections_.find(fd); iter != connections_.end()) {
         return iter->second->set_no_delay();
@@ -369,14 +566,105 @@ bool socket_server::set_enable_chunked(uint32_t fd, std::string_view flag) {
     return false;
 }
 
-bool socket_server::set_send_queue_limit(uint32_t fd, uint16_t warnsize, uint16_t errorsize) {
+bool socket_server::set_read_cache(uint32_t fd, size_t size, bool batch) {
+    if (auto iter = connections_.find(fd); iter != connections_.end()) {
+        if (auto c = std::dynamic_pointer_cast<moon_connection>(iter->second)) {
+            c->set_read_cache(size, batch);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool socket_server::set_length_prefix(uint32_t fd, uint8_t bytes, size_t max_message_size) {
+    if (bytes != sizeof(message_size_t) && bytes != sizeof(moon_connection::wide_size_t)) {
+        return false;
+    }
+
+    if (max_message_size == 0) {
+        max_message_size = moon_connection::DEFAULT_WIDE_MESSAGE_SIZE;
+    }
+
+    if (auto iter = acceptors_.find(fd); iter != acceptors_.end()) {
+        if (iter->second->type != PTYPE_SOCKET_MOON)
+            return false;
+        iter->second->length_prefix = bytes;
+        iter->second->max_message_size = max_message_size;
+        return true;
+    }
+
+    if (auto iter = connections_.find(fd); iter != connections_.end()) {
+        if (auto c = std::dynamic_pointer_cast<moon_connection>(iter->second)) {
+            c->set_length_prefix(bytes, max_message_size);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool socket_server::set_send_queue_limit(
+    uint32_t fd,
+    size_t warn_bytes,
+    size_t error_bytes,
+    bool drop
+) {
     if (auto iter = connections_.find(fd); iter != connections_.end()) {
-        iter->second->set_send_queue_limit(warnsize, errorsize);
+        iter->second->set_send_queue_limit(warn_bytes, error_bytes, drop);
+        return true;
+    }
+    return false;
+}
+
+bool socket_server::set_deferred_flush(uint32_t fd, bool enable) {
+    if (auto iter = acceptors_.find(fd); iter != acceptors_.end()) {
+        iter->second->deferred_flush = enable;
+        return true;
+    }
+
+    if (auto iter = connections_.find(fd); iter != connections_.end()) {
+        iter->second->set_deferred_flush(enable);
+        if (!enable) {
+            iter->second->flush();
+        }
+        return true;
+    }
+    return false;
+}
+
+bool socket_server::set_ws_deflate(uint32_t fd, const ws_deflate_options& opt) {
+    if (auto iter = acceptors_.find(fd); iter != acceptors_.end()) {
+        if (iter->second->type != PTYPE_SOCKET_WS)
+            return false;
+        iter->second->ws_deflate = opt;
         return true;
     }
     return false;
 }
 
+std::string socket_server::set_tls(uint32_t fd, [[maybe_unused]] const tls_options& opt) {
+    auto iter = acceptors_.find(fd);
+    if (iter == acceptors_.end()) {
+        return "not a listener";
+    }
+#ifdef MOON_ENABLE_OPENSSL
+    std::string err;
+    auto ctx = tls_context::make(opt, true, err);
+    if (nullptr != ctx) {
+        iter->second->tls = std::move(ctx);
+    }
+    return err;
+#else
+    return "TLS is not supported, build with --openssl";
+#endif
+}
+
+std::string socket_server::stats(uint32_t fd) const {
+    if (auto iter = connections_.find(fd); iter != connections_.end()) {
+        return iter->second->stats();
+    }
+    return std::string();
+}
+
 static bool decode_endpoint(std::string_view address, udp::endpoint& ep) {
     if (address.empty() || (address[0] != '4' && address[0] != '6'))
         return false;
@@ -443,6 +731,8 @@ bool moon::socket_server::switch_type(uint32_t fd, uint8_t new_type) {
         if (c->type() != PTYPE_SOCKET_TCP)
             return false;
         auto newc = make_connection(c->owner(), new_type, std::move(c->socket()));
+        newc->take_tls(*c);
+        c->close(); // release the old connection's share of net_stats
         newc->fd(fd);
         iter->second = newc;
         newc->start(c->is_server());
@@ -451,6 +741,28 @@ bool moon::socket_server::switch_type(uint32_t fd, uint8_t new_type) {
     return false;
 }
 
+bool socket_server::transfer(uint32_t fd, uint32_t new_owner, uint32_t caller, int64_t sessionid) {
+    auto iter = connections_.find(fd);
+    if (iter == connections_.end() || !iter->second->can_transfer()) {
+        return false;
+    }
+
+    worker* w = server_->get_worker(0, new_owner);
+    if (nullptr == w) {
+        return false;
+    }
+
+    if (&w->socket_server() == this) {
+        iter->second->owner(new_owner);
+        asio::post(context_, [this, fd, caller, sessionid] {
+            handle_message(caller, message { PTYPE_INTEGER, 0, 0, sessionid, fd });
+        });
+        return true;
+    }
+
+    return iter->second->transfer(transfer_context { &w->socket_server(), new_owner, caller, sessionid });
+}
+
 std::string_view socket_server::encode_endpoint(const address& addr, port_type port) {
     static thread_local std::array<char, socket_server::addr_v6_size> buf {};
     size_t size = 0;
@@ -471,8 +783,8 @@ std::string_view socket_server::encode_endpoint(const address& addr, port_type p
     return std::string_view { buf.data(), size + sizeof(port) };
 }
 
-std::time_t moon::socket_server::time() const {
-    return server_->now_without_offset() / 1000;
+int64_t moon::socket_server::now() const {
+    return server_->now_without_offset();
 }
 
 connection_ptr_t
@@ -522,31 +834,139 @@ void socket_server::add_connection(
 ) {
     asio::dispatch(context_, [this, from, ctx, c, sessionid] {
         connections_.try_emplace(c->fd(), c);
-        c->start(true);
+        if (!c->is_tls()) {
+            start_accepted(from, ctx, c, sessionid);
+            return;
+        }
+
+        c->async_handshake(true, [this, from, ctx, c, sessionid](const asio::error_code& e) {
+            if (!e) {
+                start_accepted(from, ctx, c, sessionid);
+                return;
+            }
+
+            CONSOLE_DEBUG("tls handshake fd {} failed: {}({})", c->fd(), e.message(), e.value());
+            close(c->fd());
+            if (sessionid != 0) {
+                asio::dispatch(from->context_, [from, ctx, sessionid, e] {
+                    from->response(
+                        ctx->fd,
+                        ctx->owner,
+                        std::format("socket_server::accept tls {}({})", e.message(), e.value()),
+                        sessionid,
+                        PTYPE_ERROR
+                    );
+                });
+            }
+        });
+    });
+}
+
+void socket_server::start_accepted(
+    socket_server* from,
+    const acceptor_context_ptr_t& ctx,
+    const connection_ptr_t& c,
+    int64_t sessionid
+) {
+    c->start(true);
+
+    if (sessionid != 0) {
+        asio::dispatch(from->context_, [from, ctx, sessionid, fd = c->fd()] {
+            from->handle_message(ctx->owner, message { PTYPE_INTEGER, 0, 0, sessionid, fd });
+        });
+    }
+}
+
+void socket_server::move_connection(const connection_ptr_t& c, const transfer_context& ctx) {
+    auto fd = c->fd();
+    asio::error_code ec;
+    auto endpoint = c->socket().local_endpoint(ec);
+    tcp::socket::native_handle_type handle {};
+    if (!ec) {
+        handle = c->detach(ec);
+    }
+
+    if (ec) {
+        close(fd);
+        response(
+            fd,
+            ctx.caller,
+            std::format("socket_server::transfer {}({})", ec.message(), ec.value()),
+            ctx.sessionid,
+            PTYPE_ERROR
+        );
+        return;
+    }
 
-        if (sessionid != 0) {
-            asio::dispatch(from->context_, [from, ctx, sessionid, fd = c->fd()] {
-                from->handle_message(ctx->owner, message { PTYPE_INTEGER, 0, 0, sessionid, fd });
+    connections_.erase(fd);
+    std::erase(flush_list_, c);
+
+    auto target = ctx.target;
+    // broadcasts posted from now on reach the target after the connection is attached
+    server_->set_fd_worker(fd, target->worker_->id());
+    asio::post(target->context_, [this, target, c, ctx, handle, protocol = endpoint.protocol()] {
+        auto fd = c->fd();
+        asio::error_code ec;
+        c->attach(target, ctx.owner, protocol, handle, ec);
+        if (ec) {
+            target->server_->unlock_fd(fd);
+            asio::dispatch(context_, [this, fd, ctx, ec] {
+                response(
+                    fd,
+                    ctx.caller,
+                    std::format("socket_server::transfer {}({})", ec.message(), ec.value()),
+                    ctx.sessionid,
+                    PTYPE_ERROR
+                );
             });
+            return;
         }
+
+        target->connections_.try_emplace(fd, c);
+        c->resume();
+
+        asio::dispatch(context_, [this, fd, ctx] {
+            handle_message(ctx.caller, message { PTYPE_INTEGER, 0, 0, ctx.sessionid, fd });
+        });
     });
 }
 
+void socket_server::defer_flush(connection_ptr_t c) {
+    flush_list_.emplace_back(std::move(c));
+    if (flush_list_.size() == 1) {
+        // runs after the handlers that are ready now, e.g. the worker's message batch
+        asio::post(context_, [this] { flush(); });
+    }
+}
+
+void socket_server::flush() {
+    flushing_.swap(flush_list_);
+    for (const auto& c: flushing_) {
+        c->flush();
+    }
+    flushing_.clear();
+}
+
 service* socket_server::find_service(uint32_t serviceid) {
     return worker_->find_service(serviceid);
 }
 
 void socket_server::timeout() {
-    timer_.expires_after(std::chrono::seconds(5));
+    // wake up on the tick boundaries of the wheel
+    timer_.expires_after(std::chrono::milliseconds(wheel_.tick() - now() % wheel_.tick()));
     timer_.async_wait([this](const asio::error_code& e) {
         if (e) {
             return;
         }
 
-        auto now = time();
-        for (const auto& [_, v]: connections_) {
-            v->timeout(now);
-        }
+        auto now = this->now();
+        wheel_.advance(now, [this, now](uint32_t fd, int64_t deadline) {
+            if (auto iter = connections_.find(fd); iter != connections_.end()) {
+                // may close the connection
+                auto c = iter->second;
+                c->on_timer(deadline, now);
+            }
+        });
         timeout();
     });
 }
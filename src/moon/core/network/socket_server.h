@@ -1,6 +1,7 @@
 #pragma once
 #include "asio.hpp"
 #include "common/rwlock.hpp"
+#include "common/timer_wheel.hpp"
 #include "config.hpp"
 #include "message.hpp"
 #include "service.hpp"
@@ -14,6 +15,7 @@ namespace moon {
 class worker;
 class service;
 class base_connection;
+class tls_context;
 
 using connection_ptr_t = std::shared_ptr<base_connection>;
 
@@ -41,6 +43,11 @@ public:
         uint8_t type;
         uint32_t owner;
         uint32_t fd = 0;
+        bool deferred_flush = false;
+        uint8_t length_prefix = 0; // PTYPE_SOCKET_MOON, 0 keeps the default
+        size_t max_message_size = 0;
+        ws_deflate_options ws_deflate;
+        std::shared_ptr<tls_context> tls;
         tcp::socket reserve;
         tcp::acceptor acceptor;
     };
@@ -64,9 +71,37 @@ public:
         udp::endpoint from_ep;
     };
 
+    // Per worker network counters. Only the owning worker thread writes them (relaxed load and
+    // store, no read-modify-write), other threads may read them for server::info().
+    struct network_stats {
+        std::atomic<uint64_t> bytes_in = 0;
+        std::atomic<uint64_t> bytes_out = 0;
+        std::atomic<uint64_t> queued_bytes = 0;
+        std::atomic<uint64_t> kicked = 0;
+        std::atomic<uint64_t> writes = 0; // async_write operations started
+
+        static void add(std::atomic<uint64_t>& v, uint64_t n) {
+            v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        static void sub(std::atomic<uint64_t>& v, uint64_t n) {
+            v.store(v.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+        }
+    };
+
+    struct transfer_context {
+        socket_server* target = nullptr;
+        uint32_t owner = 0;
+        uint32_t caller = 0;
+        int64_t sessionid = 0;
+    };
+
     using acceptor_context_ptr_t = std::shared_ptr<acceptor_context>;
     using udp_context_ptr_t = std::shared_ptr<udp_context>;
 
+    // Pre-encoded broadcast frames, one slot per stream protocol (tcp, websocket, moon)
+    using broadcast_frames_t = std::array<buffer_shr_ptr_t, 3>;
+
 public:
     friend class base_connection;
 
@@ -93,13 +128,41 @@ public:
         uint32_t owner,
         uint8_t type,
         int64_t sessionid,
-        uint32_t millseconds = 0
+        uint32_t millseconds = 0,
+        std::optional<tls_options> tls = std::nullopt
     );
 
     direct_read_result read(uint32_t fd, size_t n, std::string_view delim, int64_t sessionid);
 
     bool write(uint32_t fd, buffer_shr_ptr_t data, socket_send_mask mask = socket_send_mask::none);
 
+    /**
+     * Queue size bytes of the file at path from offset on a PTYPE_SOCKET_TCP connection, in
+     * order with the other writes. size < 0 sends the rest of the file. The file is opened
+     * here and sent with sendfile(2) where the platform and the connection allow it.
+     * Returns an error message, empty on success.
+     */
+    std::string sendfile(
+        uint32_t fd,
+        const std::string& path,
+        int64_t offset,
+        int64_t size,
+        socket_send_mask mask = socket_send_mask::none
+    );
+
+    /**
+     * Send the same payload to a list of connections. The frame is encoded once per protocol
+     * type and the same refcounted bytes are queued on every connection. fds not owned by this
+     * worker are grouped by the worker that owns them, see server::fd_worker, and forwarded
+     * with one post per owning worker.
+     * Returns the number of connections of this worker that accepted the data.
+     */
+    size_t broadcast(
+        std::vector<uint32_t> fds,
+        buffer_shr_ptr_t data,
+        socket_send_mask mask = socket_send_mask::none
+    );
+
     bool close(uint32_t fd);
 
     void close_all() const;
@@ -110,7 +173,47 @@ public:
 
     bool set_enable_chunked(uint32_t fd, std::string_view flag);
 
-    bool set_send_queue_limit(uint32_t fd, uint16_t warnsize, uint16_t errorsize);
+    bool set_read_cache(uint32_t fd, size_t size, bool batch);
+
+    /**
+     * PTYPE_SOCKET_MOON length prefix: 2 bytes (default, chunked continuation for large
+     * messages) or 4 bytes. fd may be a connection or a listener, a listener applies it to
+     * the connections it accepts afterwards. max_message_size limits incoming 4 bytes prefixed
+     * messages, 0 means moon_connection::DEFAULT_WIDE_MESSAGE_SIZE.
+     */
+    bool set_length_prefix(uint32_t fd, uint8_t bytes, size_t max_message_size);
+
+    /**
+     * Byte limits of a connection's send queue. Above warn_bytes a warning is logged once and,
+     * if drop is set, the oldest queued buffers flagged socket_send_mask::droppable are
+     * discarded. Above error_bytes the connection is closed with error::send_queue_too_big.
+     */
+    bool set_send_queue_limit(uint32_t fd, size_t warn_bytes, size_t error_bytes, bool drop = false);
+
+    /**
+     * Disconnect a slow consumer: a connection is closed with error::slow_consumer when more
+     * than max_bytes are waiting in its send queue, or when one write has been pending for
+     * more than max_stall_ms. 0 disables the check.
+     */
+    bool set_slow_consumer_limit(uint32_t fd, size_t max_bytes, uint32_t max_stall_ms);
+
+    /**
+     * Deferred flush: writes of the connection are only queued while messages are handled,
+     * all queued data is written with one gathered write when the worker finishes its current
+     * batch of handlers. fd may be a connection or a listener, a listener applies it to the
+     * connections it accepts afterwards.
+     */
+    bool set_deferred_flush(uint32_t fd, bool enable);
+
+    bool set_ws_deflate(uint32_t fd, const ws_deflate_options& opt);
+
+    /**
+     * Terminate TLS on the connections a listener accepts afterwards, the handshake runs
+     * before the accept is reported. Returns an error message, empty on success.
+     */
+    std::string set_tls(uint32_t fd, const tls_options& opt);
+
+    std::string stats(uint32_t fd) const;
 
     bool send_to(uint32_t host, std::string_view address, buffer_shr_ptr_t data);
 
@@ -118,14 +221,44 @@ public:
 
     bool switch_type(uint32_t fd, uint8_t new_type);
 
+    /**
+     * Move a connection to new_owner, the fd does not change. If new_owner runs on another
+     * worker, the native socket is moved to that worker's io_context together with the
+     * queued writes and the read cache, I/O stops on this worker until the move is done.
+     * Data that arrives before the move still goes to the old owner. The caller gets the fd
+     * (PTYPE_INTEGER) or PTYPE_ERROR as the response of sessionid.
+     * Fails for listeners, udp sockets and connections with a pending socket.read.
+     */
+    bool transfer(uint32_t fd, uint32_t new_owner, uint32_t caller, int64_t sessionid);
+
     static std::string_view
     encode_endpoint(const address& addr, port_type port);
 
-    std::time_t time() const;
+    // Milliseconds
+    int64_t now() const;
+
+    // The connection fd is checked with base_connection::on_timer at deadline (ms)
+    void schedule_timeout(uint32_t fd, int64_t deadline) {
+        wheel_.add(deadline, fd);
+    }
+
+    network_stats& net_stats() {
+        return net_stats_;
+    }
+
+    const network_stats& net_stats() const {
+        return net_stats_;
+    }
 
 private:
-    asio::awaitable<std::string>
-    do_connect(std::string host, uint16_t port, uint32_t owner, uint8_t type, int64_t sessionid);
+    asio::awaitable<std::string> do_connect(
+        std::string host,
+        uint16_t port,
+        uint32_t owner,
+        uint8_t type,
+        int64_t sessionid,
+        std::shared_ptr<tls_context> tls
+    );
 
     asio::awaitable<void> connect_with_timeout(
         std::string host,
@@ -133,7 +266,8 @@ private:
         uint32_t owner,
         uint8_t type,
         int64_t sessionid,
-        uint32_t millseconds
+        uint32_t millseconds,
+        std::optional<tls_options> tls
     );
 
     connection_ptr_t make_connection(uint32_t serviceid, uint8_t type, tcp::socket&& sock);
@@ -153,9 +287,30 @@ private:
         int64_t sessionid
     );
 
+    // Start reading a connection added by add_connection and answer the accept
+    void start_accepted(
+        socket_server* from,
+        const acceptor_context_ptr_t& ctx,
+        const connection_ptr_t& c,
+        int64_t sessionid
+    );
+
+    void move_connection(const connection_ptr_t& c, const transfer_context& ctx);
+
+    void defer_flush(connection_ptr_t c);
+
+    void flush();
+
     template<typename Message>
     void handle_message(uint32_t serviceid, Message&& m);
 
+    size_t broadcast_local(
+        const std::vector<uint32_t>& fds,
+        const buffer_shr_ptr_t& data,
+        broadcast_frames_t& frames,
+        std::vector<uint32_t>* missing
+    );
+
     service* find_service(uint32_t serviceid);
 
     void timeout();
@@ -167,9 +322,13 @@ private:
     worker* worker_;
     asio::io_context& context_;
     asio::steady_timer timer_;
+    timer_wheel<uint32_t> wheel_; // connection timeouts
+    network_stats net_stats_;
 
     std::unordered_map<uint32_t, acceptor_context_ptr_t> acceptors_;
     std::unordered_map<uint32_t, connection_ptr_t> connections_;
+    std::vector<connection_ptr_t> flush_list_;
+    std::vector<connection_ptr_t> flushing_;
     std::unordered_map<uint32_t, udp_context_ptr_t> udp_;
 };
 
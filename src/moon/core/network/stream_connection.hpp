@@ -1,6 +1,7 @@
 #pragma once
 #include "base_connection.hpp"
 #include "common/static_string.hpp"
+#include "delimiter.hpp"
 #include "streambuf.hpp"
 
 namespace moon {
@@ -23,7 +24,10 @@ public:
     using base_connection_t = base_connection;
 
     static constexpr size_t DEFAULT_READ_CACHE_SIZE = 8192;
-    static constexpr size_t DOUBLE_CHAR_DELIM_SIZE = 2;
+    // read_exactly larger than this goes into its own buffer instead of growing read_cache_
+    static constexpr size_t DIRECT_READ_SIZE = DEFAULT_READ_CACHE_SIZE;
+    // ms without messages before a grown read_cache_ is released
+    static constexpr int64_t CACHE_SHRINK_IDLE = 10000;
 
     template<
         typename... Args,
@@ -54,55 +58,56 @@ public:
     }
 
 private:
-    static size_t find_delimiter(std::string_view data, std::string_view delim, size_t delim_size) {
-        if (delim_size == 1) {
-            return data.find(delim[0]);
-        } else if (delim_size == DOUBLE_CHAR_DELIM_SIZE) {
-            const char first = delim[0];
-            const char second = delim[1];
-            const size_t max_pos = data.size() - 1;
-
-            for (size_t i = 0; i < max_pos; ++i) {
-                if (data[i] == first && data[i + 1] == second) {
-                    return i;
-                }
-            }
-            return std::string_view::npos;
-        } else {
-            return data.find(delim);
+    direct_read_result read(const read_until& op) {
+        scanned_ = 0;
+        if (auto pos = search(op.delim.to_string_view()); pos != std::string_view::npos) {
+            mask_ = enum_unset_bitmask(mask_, connection_mask::reading);
+            const char* data = read_cache_.data();
+            read_cache_.as_buffer()->consume_unchecked(pos + op.delim.size());
+            return direct_read_result { true, { data, pos } };
         }
-    }
 
-    direct_read_result read(const read_until& op) {
-        const size_t delim_size = op.delim.size();
+        read_some_until(op);
+        return direct_read_result { true, {} };
+    }
 
-        if (read_cache_.size() >= delim_size) {
-            std::string_view data { read_cache_.data(), read_cache_.size() };
-            const size_t pos = find_delimiter(data, op.delim.to_string_view(), delim_size);
+    // Search the cache from where the previous search stopped, a delimiter may straddle the
+    // old end of data so the last delim_size - 1 bytes are scanned again.
+    size_t search(std::string_view delim) {
+        std::string_view data { read_cache_.data(), read_cache_.size() };
+        size_t pos = find_delimiter(data, delim, scanned_);
+        if (pos == std::string_view::npos && data.size() >= delim.size()) {
+            scanned_ = data.size() - delim.size() + 1;
+        }
+        return pos;
+    }
 
-            if (pos != std::string_view::npos) {
-                mask_ = enum_unset_bitmask(mask_, connection_mask::reading);
-                read_cache_.as_buffer()->consume_unchecked(pos + delim_size);
-                return direct_read_result { true, { data.data(), pos } };
-            }
+    void read_some_until(const read_until& op) {
+        buffer* buf = read_cache_.as_buffer();
+        if (buf->size() >= op.max_size) {
+            error(make_error_code(asio::error::not_found));
+            return;
         }
 
-        asio::async_read_until(
-            socket_,
-            moon::streambuf(read_cache_.as_buffer(), op.max_size),
-            op.delim.to_string_view(),
-            [this,
-             self = shared_from_this(),
-             delim_size =
-                 op.delim.size()](const asio::error_code& e, std::size_t bytes_transferred) {
-                if (!e) {
-                    response(bytes_transferred, delim_size);
+        size_t n = std::clamp<size_t>(buf->capacity() - buf->size(), 512, 65536);
+        auto [p, len] = buf->prepare(std::min(n, op.max_size - buf->size()));
+        stream_.async_read_some(
+            asio::buffer(p, len),
+            [this, self = shared_from_this(), op](const asio::error_code& e, std::size_t n) {
+                if (e) {
+                    error(e);
                     return;
                 }
-                error(e);
+
+                on_read(n);
+                read_cache_.as_buffer()->commit_unchecked(n);
+                if (auto pos = search(op.delim.to_string_view()); pos != std::string_view::npos) {
+                    response(pos + op.delim.size(), op.delim.size());
+                    return;
+                }
+                read_some_until(op);
             }
         );
-        return direct_read_result { true, {} };
     }
 
     direct_read_result read(read_exactly op) {
@@ -112,15 +117,21 @@ private:
             return direct_read_result { true, { read_cache_.data(), op.size } };
         }
 
+        if (op.size - read_cache_.size() > DIRECT_READ_SIZE) {
+            read_direct(op.size);
+            return direct_read_result { true, {} };
+        }
+
         const std::size_t need_size = op.size - read_cache_.size();
         asio::async_read(
-            socket_,
+            stream_,
             moon::streambuf { read_cache_.as_buffer(), op.size },
             asio::transfer_exactly(need_size),
             [this,
              self = shared_from_this(),
-             size = op.size](const asio::error_code& e, std::size_t) {
+             size = op.size](const asio::error_code& e, std::size_t n) {
                 if (!e) {
+                    on_read(n);
                     response(size, 0);
                     return;
                 }
@@ -130,9 +141,65 @@ private:
         return direct_read_result { true, {} };
     }
 
+    // Read into a buffer of exactly `size` bytes that is handed over with the message, so the
+    // shared read cache does not grow for large reads.
+    void read_direct(size_t size) {
+        buffer* cache = read_cache_.as_buffer();
+        direct_ = buffer::make_unique(size);
+        direct_->write_back({ cache->data(), cache->size() });
+        cache->clear();
+
+        asio::async_read(
+            stream_,
+            moon::streambuf { direct_.get(), size },
+            asio::transfer_exactly(size - direct_->size()),
+            [this, self = shared_from_this()](const asio::error_code& e, std::size_t n) {
+                if (e) {
+                    direct_.reset();
+                    error(e);
+                    return;
+                }
+
+                on_read(n);
+                mask_ = enum_unset_bitmask(mask_, connection_mask::reading);
+                handle_message(message {
+                    PTYPE_SOCKET_TCP, 0, 0, read_cache_.session, std::move(direct_) });
+            }
+        );
+    }
+
+    void release_memory(int64_t now) override {
+        buffer* buf = read_cache_.as_buffer();
+        if (buf->capacity() <= DEFAULT_READ_CACHE_SIZE
+            || enum_has_any_bitmask(mask_, connection_mask::reading)
+            || now - recvtime_ < CACHE_SHRINK_IDLE)
+        {
+            return;
+        }
+
+        buf->commit_unchecked(std::exchange(more_bytes_, 0));
+        buf->consume_unchecked(std::exchange(consume_, 0));
+        if (buf->size() > DEFAULT_READ_CACHE_SIZE / 2) {
+            return;
+        }
+
+        buffer cache { DEFAULT_READ_CACHE_SIZE };
+        cache.write_back({ buf->data(), buf->size() });
+        *buf = std::move(cache);
+    }
+
+    int64_t memory_timeout(int64_t now) const override {
+        buffer* buf = read_cache_.as_buffer();
+        if (buf->capacity() <= DEFAULT_READ_CACHE_SIZE) {
+            return 0;
+        }
+        auto deadline = recvtime_ + CACHE_SHRINK_IDLE;
+        return deadline > now ? deadline : now + CACHE_SHRINK_IDLE;
+    }
+
     void
     error(const asio::error_code& e, [[maybe_unused]] const std::string& additional = "") override {
-        if (parent_ == nullptr) {
+        if (parent_ == nullptr || transfer_error(e)) {
             return;
         }
 
@@ -176,11 +243,19 @@ private:
 
         assert(read_cache_.session != 0);
         handle_message(read_cache_);
+
+        if (auto b = read_cache_.as_buffer();
+            b != nullptr && b->capacity() > DEFAULT_READ_CACHE_SIZE)
+        {
+            arm_timeout();
+        }
     }
 
 protected:
     size_t more_bytes_ = 0;
     size_t consume_ = 0;
+    size_t scanned_ = 0; // read_cache_ bytes already searched for the delimiter
     message read_cache_ { DEFAULT_READ_CACHE_SIZE };
+    buffer_ptr_t direct_;
 };
 } // namespace moon
\ No newline at end of file
@@ -0,0 +1,419 @@
+#pragma once
+#include "asio.hpp"
+#include "config.hpp"
+#include <cerrno>
+
+#ifdef MOON_ENABLE_OPENSSL
+    #include <asio/ssl/error.hpp>
+    #include <openssl/err.h>
+    #include <openssl/ssl.h>
+#endif
+
+namespace moon {
+#ifdef MOON_ENABLE_OPENSSL
+class tls_context {
+public:
+    tls_context(const tls_context&) = delete;
+
+    tls_context& operator=(const tls_context&) = delete;
+
+    ~tls_context() {
+        SSL_CTX_free(ctx_);
+    }
+
+    // Returns nullptr and sets err when the certificate or the key can not be loaded
+    static std::shared_ptr<tls_context>
+    make(const tls_options& opt, bool server, std::string& err) {
+        ERR_clear_error();
+        std::shared_ptr<tls_context> res { new tls_context(
+            SSL_CTX_new(server ? TLS_server_method() : TLS_client_method()),
+            opt.server_name
+        ) };
+        SSL_CTX* ctx = res->ctx_;
+        if (nullptr == ctx) {
+            err = last_error("SSL_CTX_new");
+            return nullptr;
+        }
+
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        // OpenSSL moves the record layer into the kernel after the handshake when it is
+        // built with kTLS and the kernel tls module is loaded.
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+        SSL_CTX_set_mode(
+            ctx,
+            SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                | SSL_MODE_RELEASE_BUFFERS
+        );
+
+        if (server && opt.certificate.empty()) {
+            err = "certificate is required";
+            return nullptr;
+        }
+
+        if (!opt.certificate.empty()) {
+            const std::string& key = opt.private_key.empty() ? opt.certificate : opt.private_key;
+            if (SSL_CTX_use_certificate_chain_file(ctx, opt.certificate.data()) != 1) {
+                err = last_error(opt.certificate);
+                return nullptr;
+            }
+            if (SSL_CTX_use_PrivateKey_file(ctx, key.data(), SSL_FILETYPE_PEM) != 1
+                || SSL_CTX_check_private_key(ctx) != 1)
+            {
+                err = last_error(key);
+                return nullptr;
+            }
+        }
+
+        if (opt.verify) {
+            int ok = opt.ca.empty() ? SSL_CTX_set_default_verify_paths(ctx)
+                                    : SSL_CTX_load_verify_locations(ctx, opt.ca.data(), nullptr);
+            if (ok != 1) {
+                err = last_error(opt.ca);
+                return nullptr;
+            }
+            SSL_CTX_set_verify(
+                ctx,
+                SSL_VERIFY_PEER | (server ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT : 0),
+                nullptr
+            );
+        }
+        return res;
+    }
+
+    SSL_CTX* native_handle() const {
+        return ctx_;
+    }
+
+    const std::string& server_name() const {
+        return server_name_;
+    }
+
+private:
+    tls_context(SSL_CTX* ctx, std::string server_name):
+        ctx_(ctx),
+        server_name_(std::move(server_name)) {}
+
+    static std::string last_error(std::string_view what) {
+        char buf[256] = { 0 };
+        ERR_error_string_n(ERR_peek_last_error(), buf, sizeof(buf));
+        return std::format("{}: {}", what, buf);
+    }
+
+private:
+    SSL_CTX* ctx_ = nullptr;
+    std::string server_name_;
+};
+
+/**
+ * TLS over a non-blocking tcp socket. OpenSSL reads and writes the socket itself, the socket
+ * is only waited on when a call would block. Supports one pending read and one pending write,
+ * like the socket.
+ */
+class tls_stream {
+public:
+    using socket_t = asio::ip::tcp::socket;
+
+    // Largest TLS record payload, smaller buffers are coalesced up to this size
+    static constexpr size_t MAX_RECORD_SIZE = 16384;
+
+    tls_stream(std::shared_ptr<tls_context> ctx, socket_t& sock):
+        ctx_(std::move(ctx)),
+        socket_(&sock) {}
+
+    tls_stream(const tls_stream&) = delete;
+
+    tls_stream& operator=(const tls_stream&) = delete;
+
+    ~tls_stream() {
+        SSL_free(ssl_);
+    }
+
+    // The connection that owns the socket changed, see socket_server::switch_type
+    void socket(socket_t& sock) {
+        socket_ = &sock;
+    }
+
+    template<typename CompletionToken>
+    auto async_handshake(bool server, CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken, void(asio::error_code)>(
+            [this, server](auto handler) {
+                if (auto ec = prepare(server); ec) {
+                    asio::post(socket_->get_executor(), [h = std::move(handler), ec]() mutable {
+                        std::move(h)(ec);
+                    });
+                    return;
+                }
+                auto slot = asio::get_associated_cancellation_slot(handler);
+                perform(
+                    [this](size_t&) { return SSL_do_handshake(ssl_); },
+                    asio::bind_cancellation_slot(
+                        slot,
+                        [h = std::move(handler)](const asio::error_code& ec, size_t) mutable {
+                            std::move(h)(ec);
+                        }
+                    ),
+                    true
+                );
+            },
+            token
+        );
+    }
+
+    template<typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler) {
+        asio::mutable_buffer b;
+        for (auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers);
+             ++it)
+        {
+            if (asio::mutable_buffer v(*it); v.size() > 0) {
+                b = v;
+                break;
+            }
+        }
+
+        if (b.size() == 0) {
+            complete(std::forward<ReadHandler>(handler), asio::error_code {}, 0, true);
+            return;
+        }
+
+        perform(
+            [this, b](size_t& n) { return SSL_read_ex(ssl_, b.data(), b.size(), &n); },
+            std::forward<ReadHandler>(handler),
+            true
+        );
+    }
+
+    template<typename ConstBufferSequence, typename WriteHandler>
+    void async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler) {
+        asio::const_buffer b;
+        auto it = asio::buffer_sequence_begin(buffers);
+        auto end = asio::buffer_sequence_end(buffers);
+        for (; it != end; ++it) {
+            if (asio::const_buffer v(*it); v.size() > 0) {
+                b = v;
+                break;
+            }
+        }
+
+        // one record for the small buffers of a gathered write, instead of one record each
+        if (b.size() < MAX_RECORD_SIZE && it != end && std::next(it) != end) {
+            if (nullptr == write_buf_) {
+                write_buf_ = std::make_unique<char[]>(MAX_RECORD_SIZE);
+            }
+            size_t n = asio::buffer_copy(asio::buffer(write_buf_.get(), MAX_RECORD_SIZE), buffers);
+            b = asio::const_buffer(write_buf_.get(), n);
+        }
+
+        perform(
+            [this, b](size_t& n) { return SSL_write_ex(ssl_, b.data(), b.size(), &n); },
+            std::forward<WriteHandler>(handler),
+            true
+        );
+    }
+
+    // Send close_notify if possible, never blocks
+    void shutdown() {
+        if (nullptr != ssl_ && SSL_is_init_finished(ssl_)) {
+            ERR_clear_error();
+            SSL_shutdown(ssl_);
+        }
+    }
+
+    std::string_view version() const {
+        return nullptr != ssl_ ? SSL_get_version(ssl_) : "";
+    }
+
+    bool ktls_send() const {
+    #ifdef BIO_get_ktls_send
+        return nullptr != ssl_ && BIO_get_ktls_send(SSL_get_wbio(ssl_));
+    #else
+        return false;
+    #endif
+    }
+
+    bool ktls_recv() const {
+    #ifdef BIO_get_ktls_recv
+        return nullptr != ssl_ && BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+    #else
+        return false;
+    #endif
+    }
+
+    // SSL_sendfile, only with ktls_send(). Returns the bytes sent, or -1 and sets ec,
+    // asio::error::would_block when the socket is full.
+    int64_t sendfile(
+        [[maybe_unused]] int fd,
+        [[maybe_unused]] int64_t offset,
+        [[maybe_unused]] size_t size,
+        asio::error_code& ec
+    ) {
+    #ifdef BIO_get_ktls_send
+        if (ktls_send()) {
+            ERR_clear_error();
+            errno = 0;
+            ossl_ssize_t n = SSL_sendfile(ssl_, fd, static_cast<off_t>(offset), size, 0);
+            if (n >= 0) {
+                return n;
+            }
+            int e = SSL_get_error(ssl_, -1);
+            ec = e == SSL_ERROR_WANT_WRITE ? asio::error::would_block : error(e);
+            return -1;
+        }
+    #endif
+        ec = asio::error::operation_not_supported;
+        return -1;
+    }
+
+private:
+    asio::error_code prepare(bool server) {
+        asio::error_code ec;
+        socket_->non_blocking(true, ec);
+        if (ec) {
+            return ec;
+        }
+
+        ERR_clear_error();
+        ssl_ = SSL_new(ctx_->native_handle());
+        if (nullptr == ssl_ || SSL_set_fd(ssl_, static_cast<int>(socket_->native_handle())) != 1)
+        {
+            return ssl_error();
+        }
+
+        if (server) {
+            SSL_set_accept_state(ssl_);
+            return ec;
+        }
+
+        SSL_set_connect_state(ssl_);
+        if (const auto& name = ctx_->server_name(); !name.empty()) {
+            if (SSL_set_tlsext_host_name(ssl_, name.data()) != 1 || SSL_set1_host(ssl_, name.data()) != 1)
+            {
+                return ssl_error();
+            }
+        }
+        return ec;
+    }
+
+    // Call op until it does not need to wait for the socket. The handler is posted when op
+    // completes right away, like asio operations do.
+    template<typename Operation, typename Handler>
+    void perform(Operation&& op, Handler&& handler, bool initiating) {
+        size_t n = 0;
+        ERR_clear_error();
+        errno = 0;
+        int r = op(n);
+        if (r > 0) {
+            complete(std::forward<Handler>(handler), asio::error_code {}, n, initiating);
+            return;
+        }
+
+        int e = SSL_get_error(ssl_, r);
+        if (e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE) {
+            complete(std::forward<Handler>(handler), error(e), 0, initiating);
+            return;
+        }
+
+        // cancelling the handler, e.g. a timed out connect, cancels the wait
+        auto slot = asio::get_associated_cancellation_slot(handler);
+        socket_->async_wait(
+            e == SSL_ERROR_WANT_READ ? socket_t::wait_read : socket_t::wait_write,
+            asio::bind_cancellation_slot(
+                slot,
+                [this, op = std::forward<Operation>(op), h = std::forward<Handler>(handler)](
+                    const asio::error_code& ec
+                ) mutable {
+                    if (ec) {
+                        std::move(h)(ec, 0);
+                        return;
+                    }
+                    perform(std::move(op), std::move(h), false);
+                }
+            )
+        );
+    }
+
+    template<typename Handler>
+    void complete(Handler&& handler, const asio::error_code& ec, size_t n, bool initiating) {
+        if (!initiating) {
+            std::move(handler)(ec, n);
+            return;
+        }
+        asio::post(socket_->get_executor(), [h = std::forward<Handler>(handler), ec, n]() mutable {
+            std::move(h)(ec, n);
+        });
+    }
+
+    static asio::error_code error(int e) {
+        if (e == SSL_ERROR_ZERO_RETURN) {
+            return asio::error::eof;
+        }
+
+        if (e == SSL_ERROR_SYSCALL && ERR_peek_error() == 0) {
+            // peer closed without close_notify, or a socket error
+            if (errno != 0) {
+                return asio::error_code(errno, asio::error::get_system_category());
+            }
+            return asio::error::eof;
+        }
+        return ssl_error();
+    }
+
+    static asio::error_code ssl_error() {
+        return asio::error_code(static_cast<int>(ERR_get_error()), asio::error::get_ssl_category());
+    }
+
+private:
+    std::shared_ptr<tls_context> ctx_;
+    socket_t* socket_;
+    SSL* ssl_ = nullptr;
+    std::unique_ptr<char[]> write_buf_;
+};
+#else
+class tls_context;
+#endif
+
+/**
+ * The byte stream of a connection: the tcp socket itself, or TLS on top of it.
+ * Connections read and write through this, socket options use the socket directly.
+ */
+class socket_stream {
+public:
+    using socket_t = asio::ip::tcp::socket;
+    using executor_type = socket_t::executor_type;
+
+    explicit socket_stream(socket_t& sock): socket_(sock) {}
+
+    executor_type get_executor() {
+        return socket_.get_executor();
+    }
+
+    template<typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler) {
+#ifdef MOON_ENABLE_OPENSSL
+        if (nullptr != tls_) {
+            tls_->async_read_some(buffers, std::forward<ReadHandler>(handler));
+            return;
+        }
+#endif
+        socket_.async_read_some(buffers, std::forward<ReadHandler>(handler));
+    }
+
+    template<typename ConstBufferSequence, typename WriteHandler>
+    void async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler) {
+#ifdef MOON_ENABLE_OPENSSL
+        if (nullptr != tls_) {
+            tls_->async_write_some(buffers, std::forward<WriteHandler>(handler));
+            return;
+        }
+#endif
+        socket_.async_write_some(buffers, std::forward<WriteHandler>(handler));
+    }
+
+#ifdef MOON_ENABLE_OPENSSL
+    std::unique_ptr<tls_stream> tls_;
+#endif
+
+private:
+    socket_t& socket_;
+};
+} // namespace moon
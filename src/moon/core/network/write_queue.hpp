@@ -11,6 +11,7 @@ public:
 
     // Enqueue data into the send queue
     size_t enqueue(buffer_shr_ptr_t data) {
+        bytes_ += data->size();
         send_queue_.emplace_back(std::move(data));
         return send_queue_.size();
     }
@@ -20,9 +21,15 @@ public:
         return send_queue_.size();
     }
 
+    // Get the total payload bytes waiting in the queue
+    size_t bytes() const noexcept {
+        return bytes_;
+    }
+
     // Commit the written data
     void commit_written() {
         while (consume_size_-- > 0) {
+            bytes_ -= send_queue_[0]->size();
             send_queue_.pop_front();
         }
         consume_size_ = 0;
@@ -30,12 +37,51 @@ public:
         padding_.clear();
     }
 
-    // Prepare each buffer and call the handler
+    // Discard queued buffers flagged droppable, oldest first, until bytes() <= limit.
+    // Buffers of the write in flight, buffers that close the connection and file segment
+    // markers are kept.
+    // Returns the number of dropped buffers and their total size.
+    std::pair<size_t, size_t> drop_oldest(size_t limit) {
+        size_t count = 0;
+        size_t dropped = 0;
+        size_t w = consume_size_;
+        for (size_t i = consume_size_, n = send_queue_.size(); i < n; ++i) {
+            auto& elm = send_queue_[i];
+            if (bytes_ > limit && elm->has_bitmask(socket_send_mask::droppable)
+                && !elm->has_bitmask(socket_send_mask::close)
+                && !elm->has_bitmask(socket_send_mask::sendfile))
+            {
+                ++count;
+                dropped += elm->size();
+                bytes_ -= elm->size();
+                elm.reset();
+                continue;
+            }
+            if (w != i) {
+                send_queue_[w] = std::move(elm);
+            }
+            ++w;
+        }
+        while (send_queue_.size() > w) {
+            send_queue_.pop_back();
+        }
+        return { count, dropped };
+    }
+
+    // The next write is a file segment, it is sent on its own
+    bool front_is_file() const noexcept {
+        return !send_queue_.empty() && send_queue_.front()->has_bitmask(socket_send_mask::sendfile);
+    }
+
+    // Prepare each buffer and call the handler, up to the next file segment
     template<typename Handler>
     void prepare_buffers(const Handler& handler, size_t max_bytes = 0) {
         size_t bytes = 0;
         for (size_t i = 0, n = send_queue_.size(); i < n; ++i) {
             const auto& elm = send_queue_[i];
+            if (elm->has_bitmask(socket_send_mask::sendfile)) {
+                break;
+            }
             handler(elm);
             if (max_bytes && (bytes += elm->size()) >= max_bytes) {
                 break;
@@ -73,6 +119,8 @@ public:
 private:
     // Number of buffers to be sent
     size_t consume_size_ = 0;
+    // Sum of the buffer sizes in send_queue_
+    size_t bytes_ = 0;
     // Stores padding data for specific protocols
     std::deque<std::array<char, 16>> padding_;
     // Data structure needed for ASIO write operations
@@ -5,6 +5,8 @@
 #include "common/http_utility.hpp"
 #include "common/sha1.hpp"
 #include "streambuf.hpp"
+#include "ws_deflate.hpp"
+#include "ws_mask.hpp"
 
 //https://developer.mozilla.org/en-US/docs/Web/API/WebSockets_API/Writing_WebSocket_servers
 
@@ -85,8 +87,6 @@ namespace ws {
         crsvf = 15
     };
 
-    using mask_key_type = std::array<uint8_t, 4>;
-
     struct frame_header {
         bool fin;
         bool rsv1;
@@ -111,6 +111,9 @@ public:
     static constexpr size_t PAYLOAD_MID_LEN = 126;
     static constexpr size_t PAYLOAD_MAX_LEN = 127;
     static constexpr size_t FIN_FRAME_FLAG = 0x80; // 1 0 0 0 0 0 0 0
+    static constexpr size_t RSV1_FRAME_FLAG = 0x40; // 0 1 0 0 0 0 0 0
+
+    static constexpr size_t DEFLATE_MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
 
     static constexpr const std::string_view WEBSOCKET = "websocket"sv;
     static constexpr const std::string_view UPGRADE = "upgrade"sv;
@@ -132,18 +135,69 @@ public:
         }
     }
 
+    bool send(buffer_shr_ptr_t data) override {
+        if (deflate_ && data->size() >= deflate_opt_.threshold
+            && !data->has_bitmask(
+                socket_send_mask::raw | socket_send_mask::ws_ping | socket_send_mask::ws_pong
+            ))
+        {
+            if (auto frame = deflate_frame(data)) {
+                return base_connection_t::send(std::move(frame));
+            }
+        }
+
+        // client frames are masked in place, do not touch a payload someone else still holds
+        if (!is_server() && !data->has_bitmask(socket_send_mask::raw) && data.use_count() > 1) {
+            auto copy = buffer::make_shared(data->size());
+            copy->write_back({ data->data(), data->size() });
+            copy->add_bitmask(data->bitmask<socket_send_mask>());
+            data = std::move(copy);
+        }
+        return base_connection_t::send(std::move(data));
+    }
+
+    bool share_frame(const buffer_shr_ptr_t& data) const override {
+        // client frames need a fresh mask key per connection, and a compressed
+        // frame depends on the connection's deflate context
+        return is_server()
+            && (nullptr == deflate_ || data->size() < deflate_opt_.threshold
+                || data->has_bitmask(socket_send_mask::ws_ping | socket_send_mask::ws_pong));
+    }
+
+    buffer_shr_ptr_t encode_shared_frame(const buffer_shr_ptr_t& data) const override {
+        if (data->has_bitmask(socket_send_mask::raw)) {
+            return data;
+        }
+        return make_raw_frame({ data->data(), data->size() }, data, false);
+    }
+
+    void set_deflate_options(const ws_deflate_options& opt) {
+        deflate_opt_ = opt;
+    }
+
 private:
+    void resume_read() override {
+        handle_frame();
+    }
+
     void read_handshake() {
+        read_state_ = read_state::body;
         asio::async_read_until(
-            socket_,
+            stream_,
             moon::streambuf(&cache_, cache_.capacity()),
             STR_DCRLF,
-            [this, self = shared_from_this()](const asio::error_code& e, std::size_t size) {
+            [this, self = shared_from_this(), cached = cache_.size()](
+                const asio::error_code& e,
+                std::size_t size
+            ) {
+                read_state_ = read_state::idle;
                 if (e) {
                     error(e);
                     return;
                 }
 
+                on_read(cache_.size() - cached);
+
                 auto ec = handshake(size);
                 if (ec) {
                     send_response("HTTP/1.1 400 Bad Request\r\n\r\n", true);
@@ -176,15 +230,25 @@ private:
         if (method != "GET"sv)
             return make_error_code(moon::error::ws_bad_method);
 
-        std::string_view connection;
-        if (!moon::try_get_value(header, "connection"sv, connection))
+        auto [conn_first, conn_last] = header.equal_range("connection"sv);
+        if (conn_first == conn_last)
             return make_error_code(moon::error::ws_no_connection);
 
         std::string_view upgrade;
         if (!moon::try_get_value(header, "upgrade"sv, upgrade))
             return make_error_code(moon::error::ws_no_upgrade);
 
-        if (!iequal_string(connection, UPGRADE))
+        // Connection is a token list, e.g. "keep-alive, Upgrade"
+        bool has_upgrade_token = false;
+        for (auto it = conn_first; it != conn_last && !has_upgrade_token; ++it) {
+            for (auto token: moon::split<std::string_view>(it->second, ",")) {
+                if (iequal_string(moon::trim(token), UPGRADE)) {
+                    has_upgrade_token = true;
+                    break;
+                }
+            }
+        }
+        if (!has_upgrade_token)
             return make_error_code(moon::error::ws_no_connection_upgrade);
 
         if (!iequal_string(upgrade, WEBSOCKET))
@@ -208,7 +272,22 @@ private:
         std::string_view protocol;
         moon::try_get_value(header, "sec-websocket-protocol"sv, protocol);
 
-        auto answer = upgrade_response(sec_ws_key, protocol);
+        std::string extensions;
+        if (deflate_opt_.enable && ws::permessage_deflate::supported) {
+            auto [first, last] = header.equal_range("sec-websocket-extensions"sv);
+            for (auto it = first; it != last && nullptr == deflate_; ++it) {
+                ws::deflate_params params;
+                if (ws::negotiate_deflate(it->second, deflate_opt_, params, extensions)) {
+                    deflate_ = std::make_unique<ws::permessage_deflate>(params, deflate_opt_.level);
+                    if (!deflate_->ok()) {
+                        deflate_.reset();
+                        extensions.clear();
+                    }
+                }
+            }
+        }
+
+        auto answer = upgrade_response(sec_ws_key, protocol, extensions);
         send_response(answer);
         handle_message(
             message { type_,
@@ -226,16 +305,25 @@ private:
     }
 
     void read_payload(size_t size) {
+        if (nullptr != transfer_) {
+            try_transfer();
+            return;
+        }
+
+        read_state_ = read_state::header;
         asio::async_read(
-            socket_,
+            stream_,
             moon::streambuf(&cache_, cache_.capacity()),
             asio::transfer_at_least(size),
-            [this, self = shared_from_this()](const asio::error_code& ec, std::size_t) {
+            [this, self = shared_from_this()](const asio::error_code& ec, std::size_t n) {
+                read_state_ = read_state::idle;
                 if (ec) {
                     error(ec);
                     return;
                 }
 
+                on_read(n);
+
                 handle_frame();
             }
         );
@@ -311,7 +399,7 @@ private:
         switch (fh.op) {
             case ws::opcode::text:
             case ws::opcode::binary:
-                if (fh.rsv1 || fh.rsv2 || fh.rsv3) {
+                if ((fh.rsv1 && nullptr == deflate_) || fh.rsv2 || fh.rsv3) {
                     // reserved bits not cleared
                     return error(make_error_code(moon::error::ws_bad_reserved_bits));
                 }
@@ -385,22 +473,40 @@ private:
         // If the cache size is greater than or equal to the expected size, consume the expected size
         // Otherwise, consume the entire cache
         size_t consume_size = (diff >= 0 ? reallen : cache_.size());
-        data_->write_back({ cache_.data(), consume_size });
+        if (fh.mask) {
+            // unmask while copying out of the read cache, saves a second pass over the payload
+            auto [p, _] = data_->prepare(consume_size);
+            ws::xor_mask(
+                reinterpret_cast<uint8_t*>(p),
+                reinterpret_cast<const uint8_t*>(cache_.data()),
+                consume_size,
+                fh.mask_key
+            );
+            data_->commit_unchecked(consume_size);
+        } else {
+            data_->write_back({ cache_.data(), consume_size });
+        }
         cache_.consume_unchecked(consume_size);
 
         if (diff >= 0) {
-            return on_message(fh);
+            return on_message(fh, consume_size);
         }
 
         cache_.clear();
 
+        read_state_ = read_state::body;
         asio::async_read(
-            socket_,
+            stream_,
             moon::streambuf(data_.get()),
             asio::transfer_exactly(static_cast<size_t>(-diff)),
-            [this, self = shared_from_this(), fh](const asio::error_code& e, std::size_t) {
+            [this, self = shared_from_this(), fh, consume_size](
+                const asio::error_code& e,
+                std::size_t n
+            ) {
+                read_state_ = read_state::idle;
                 if (!e) {
-                    on_message(fh);
+                    on_read(n);
+                    on_message(fh, consume_size);
                     return;
                 }
                 error(e);
@@ -408,15 +514,23 @@ private:
         );
     }
 
-    void on_message(ws::frame_header fh) {
+    void on_message(ws::frame_header fh, size_t unmasked) {
         data_->consume_unchecked(BUFFER_OPTION_CHEAP_PREPEND);
 
-        if (fh.mask) {
-            // unmask data:
-            auto* d = reinterpret_cast<uint8_t*>(data_->data());
-            const size_t size = data_->size();
-            for (size_t i = 0; i < size; ++i) {
-                d[i] ^= fh.mask_key[i & 3]; // Use bitwise AND for modulo 4
+        if (fh.mask && data_->size() > unmasked) {
+            // unmask the part read directly from socket
+            ws::apply_mask(
+                reinterpret_cast<uint8_t*>(data_->data()) + unmasked,
+                data_->size() - unmasked,
+                fh.mask_key,
+                unmasked
+            );
+        }
+
+        if (fh.rsv1) {
+            data_ = deflate_->decompress({ data_->data(), data_->size() }, DEFLATE_MAX_MESSAGE_SIZE);
+            if (nullptr == data_) {
+                return error(make_error_code(moon::error::read_message_too_big));
             }
         }
 
@@ -482,6 +596,44 @@ private:
         );
     }
 
+    buffer_shr_ptr_t deflate_frame(const buffer_shr_ptr_t& data) {
+        auto z = deflate_->compress({ data->data(), data->size() });
+        if (z.empty()) {
+            return nullptr;
+        }
+        return make_raw_frame(z, data, true);
+    }
+
+    // Build a complete server frame (header + payload) that can be sent as raw bytes.
+    buffer_shr_ptr_t
+    make_raw_frame(std::string_view payload, const buffer_shr_ptr_t& data, bool compressed) const {
+        const auto opcode_mask =
+            socket_send_mask::ws_text | socket_send_mask::ws_ping | socket_send_mask::ws_pong;
+
+        auto frame = buffer::make_shared(payload.size() + BUFFER_OPTION_CHEAP_PREPEND);
+        frame->commit_unchecked(BUFFER_OPTION_CHEAP_PREPEND);
+        frame->consume_unchecked(BUFFER_OPTION_CHEAP_PREPEND);
+        frame->write_back(payload);
+        frame->add_bitmask(data->bitmask<socket_send_mask>() & opcode_mask);
+
+        buffer header = encode_frame(frame);
+        if (compressed) {
+            *header.data() |= RSV1_FRAME_FLAG;
+        }
+        [[maybe_unused]] bool always_ok = frame->write_front(header.data(), header.size());
+
+        frame->clear_bitmask(opcode_mask);
+        frame->add_bitmask(socket_send_mask::raw);
+        if (data->has_bitmask(socket_send_mask::close)) {
+            frame->add_bitmask(socket_send_mask::close);
+        }
+        // a compressed frame may be referenced by the peer's inflate window, never drop it
+        if (!compressed && data->has_bitmask(socket_send_mask::droppable)) {
+            frame->add_bitmask(socket_send_mask::droppable);
+        }
+        return frame;
+    }
+
     buffer encode_frame(const buffer_shr_ptr_t& data) const {
         buffer payload { 16 };
         payload.commit_unchecked(16);
@@ -492,11 +644,8 @@ private:
         const uint64_t size = data->size();
 
         if (!is_server()) {
-            auto* d = reinterpret_cast<uint8_t*>(data->data());
             const auto mask = randkey();
-            for (uint64_t i = 0; i < size; i++) {
-                d[i] ^= mask[i & 3]; // Use bitwise AND for modulo 4
-            }
+            ws::apply_mask(reinterpret_cast<uint8_t*>(data->data()), size, mask);
             always_ok = payload.write_front(mask.data(), mask.size());
         }
 
@@ -549,7 +698,11 @@ private:
         return base64_encode(shakey, sizeof(shakey));
     }
 
-    static std::string upgrade_response(std::string_view seckey, std::string_view wsprotocol) {
+    static std::string upgrade_response(
+        std::string_view seckey,
+        std::string_view wsprotocol,
+        std::string_view extensions
+    ) {
         std::string response;
         response.reserve(256); // Pre-allocate reasonable size
         response.append("HTTP/1.1 101 Switching Protocols\r\n");
@@ -563,11 +716,34 @@ private:
             response.append(wsprotocol);
             response.append(STR_CRLF);
         }
+        if (!extensions.empty()) {
+            response.append("Sec-WebSocket-Extensions: ");
+            response.append(extensions);
+            response.append(STR_CRLF);
+        }
         response.append(STR_CRLF);
         return response;
     }
 
+    void append_stats(std::string& res) const override {
+        if (nullptr == deflate_) {
+            return;
+        }
+        const auto& st = deflate_->stats();
+        res.append(std::format(
+            R"(,"deflate":{{"in":{},"inflated":{},"out":{},"deflated":{},"ratio":{:.3f},"cpu":{:.6f}}})",
+            st.in_bytes,
+            st.inflated_bytes,
+            st.out_bytes,
+            st.deflated_bytes,
+            st.ratio(),
+            st.cpu
+        ));
+    }
+
 private:
+    ws_deflate_options deflate_opt_;
+    std::unique_ptr<ws::permessage_deflate> deflate_;
     buffer cache_ { DEFAULT_READ_CACHE_SIZE };
     buffer_ptr_t data_;
 };
@@ -0,0 +1,281 @@
+#pragma once
+#include "common/string.hpp"
+#include "common/time.hpp"
+#include "config.hpp"
+
+#ifdef MOON_ENABLE_ZLIB
+    #include <zlib.h>
+#endif
+
+// RFC 7692 Compression Extensions for WebSocket (permessage-deflate)
+
+namespace moon {
+namespace ws {
+    struct deflate_params {
+        bool server_no_context_takeover = false;
+        bool client_no_context_takeover = false;
+        uint8_t server_max_window_bits = 15;
+        uint8_t client_max_window_bits = 15;
+    };
+
+    struct deflate_stats {
+        uint64_t in_bytes = 0; // compressed bytes received
+        uint64_t inflated_bytes = 0; // bytes after inflate
+        uint64_t out_bytes = 0; // bytes before deflate
+        uint64_t deflated_bytes = 0; // compressed bytes sent
+        double cpu = 0.0; // seconds spent in deflate/inflate
+
+        double ratio() const {
+            return out_bytes == 0 ? 1.0 : double(deflated_bytes) / double(out_bytes);
+        }
+    };
+
+    /**
+     * Parse one "Sec-WebSocket-Extensions" header value and pick the first
+     * permessage-deflate offer that can be accepted with the local options.
+     * On success fills params and the response header value.
+     */
+    inline bool negotiate_deflate(
+        std::string_view offers,
+        const ws_deflate_options& opt,
+        deflate_params& params,
+        std::string& response
+    ) {
+        auto parse_bits = [](std::string_view v, uint8_t& bits) {
+            if (v.size() >= 2 && v.front() == '"' && v.back() == '"')
+                v = v.substr(1, v.size() - 2);
+            std::errc ec {};
+            auto n = moon::string_convert<int>(v, ec);
+            if (ec != std::errc {} || n < 8 || n > 15)
+                return false;
+            bits = static_cast<uint8_t>(n);
+            return true;
+        };
+
+        for (auto offer: moon::split<std::string_view>(offers, ",")) {
+            auto items = moon::split<std::string_view>(offer, ";");
+            if (items.empty() || moon::trim(items[0]) != "permessage-deflate"sv)
+                continue;
+
+            bool ok = true;
+            bool has_server_bits = false;
+            bool has_client_bits = false;
+            bool server_no_takeover = false;
+            bool client_no_takeover = false;
+            uint8_t server_bits = 15;
+            uint8_t client_bits = 15;
+
+            for (size_t i = 1; i < items.size() && ok; ++i) {
+                auto item = moon::trim(items[i]);
+                std::string_view key = item;
+                std::string_view value;
+                if (auto pos = item.find('='); pos != std::string_view::npos) {
+                    key = moon::trim(item.substr(0, pos));
+                    value = moon::trim(item.substr(pos + 1));
+                }
+
+                if (key == "server_no_context_takeover"sv) {
+                    ok = !server_no_takeover && value.empty();
+                    server_no_takeover = true;
+                } else if (key == "client_no_context_takeover"sv) {
+                    ok = !client_no_takeover && value.empty();
+                    client_no_takeover = true;
+                } else if (key == "server_max_window_bits"sv) {
+                    ok = !has_server_bits && parse_bits(value, server_bits);
+                    has_server_bits = true;
+                } else if (key == "client_max_window_bits"sv) {
+                    ok = !has_client_bits && (value.empty() || parse_bits(value, client_bits));
+                    has_client_bits = true;
+                } else {
+                    ok = false;
+                }
+            }
+
+            // zlib can not produce a raw deflate stream with 256 bytes window
+            if (!ok || server_bits < 9)
+                continue;
+
+            params.server_no_context_takeover = server_no_takeover || opt.server_no_context_takeover;
+            params.client_no_context_takeover = client_no_takeover || opt.client_no_context_takeover;
+            params.server_max_window_bits = std::min(server_bits, opt.server_max_window_bits);
+            // the client may only be limited if it announced support for it
+            params.client_max_window_bits =
+                has_client_bits ? std::min(client_bits, opt.client_max_window_bits) : 15;
+
+            response = "permessage-deflate";
+            if (params.server_no_context_takeover)
+                response.append("; server_no_context_takeover");
+            if (params.client_no_context_takeover)
+                response.append("; client_no_context_takeover");
+            if (has_server_bits || params.server_max_window_bits < 15)
+                response.append(std::format(
+                    "; server_max_window_bits={}",
+                    static_cast<int>(params.server_max_window_bits)
+                ));
+            if (has_client_bits)
+                response.append(std::format(
+                    "; client_max_window_bits={}",
+                    static_cast<int>(params.client_max_window_bits)
+                ));
+            return true;
+        }
+        return false;
+    }
+
+#ifdef MOON_ENABLE_ZLIB
+    class permessage_deflate {
+    public:
+        static constexpr bool supported = true;
+
+        permessage_deflate(const deflate_params& params, int level): params_(params) {
+            ok_ = deflateInit2(
+                      &deflate_,
+                      level,
+                      Z_DEFLATED,
+                      -static_cast<int>(params.server_max_window_bits),
+                      8,
+                      Z_DEFAULT_STRATEGY
+                  )
+                    == Z_OK
+                && inflateInit2(&inflate_, -static_cast<int>(params.client_max_window_bits))
+                    == Z_OK;
+        }
+
+        permessage_deflate(const permessage_deflate&) = delete;
+        permessage_deflate& operator=(const permessage_deflate&) = delete;
+
+        ~permessage_deflate() {
+            deflateEnd(&deflate_);
+            inflateEnd(&inflate_);
+        }
+
+        bool ok() const {
+            return ok_;
+        }
+
+        // Compress one message. The result lives in an internal buffer and
+        // stays valid until the next call.
+        std::string_view compress(std::string_view data) {
+            double start = moon::time::clock();
+            out_.clear();
+            deflate_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+            deflate_.avail_in = static_cast<uInt>(data.size());
+            do {
+                auto [p, n] = out_.prepare(std::max<size_t>(data.size() / 2 + 64, 1024));
+                deflate_.next_out = reinterpret_cast<Bytef*>(p);
+                deflate_.avail_out = static_cast<uInt>(n);
+                if (deflate(&deflate_, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+                    return {};
+                out_.commit_unchecked(n - deflate_.avail_out);
+            } while (deflate_.avail_out == 0);
+
+            // A sync flush always ends with the empty stored block 00 00 FF FF,
+            // which is removed from the wire payload.
+            if (out_.size() >= 4)
+                out_.revert(4);
+
+            if (params_.server_no_context_takeover)
+                deflateReset(&deflate_);
+
+            stats_.out_bytes += data.size();
+            stats_.deflated_bytes += out_.size();
+            stats_.cpu += moon::time::clock() - start;
+            return std::string_view { out_.data(), out_.size() };
+        }
+
+        // Inflate one message into a new buffer with cheap prepend space.
+        // Returns nullptr on corrupt input or when the result exceeds max_size.
+        buffer_ptr_t decompress(std::string_view data, size_t max_size) {
+            static constexpr uint8_t tail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+            double start = moon::time::clock();
+            out_.clear();
+            bool ok = inflate_chunk(data, max_size)
+                && inflate_chunk(
+                          std::string_view { reinterpret_cast<const char*>(tail), sizeof(tail) },
+                          max_size
+                );
+
+            if (params_.client_no_context_takeover)
+                inflateReset(&inflate_);
+
+            stats_.cpu += moon::time::clock() - start;
+            if (!ok)
+                return nullptr;
+
+            stats_.in_bytes += data.size();
+            stats_.inflated_bytes += out_.size();
+
+            auto buf = buffer::make_unique(out_.size() + BUFFER_OPTION_CHEAP_PREPEND);
+            buf->commit_unchecked(BUFFER_OPTION_CHEAP_PREPEND);
+            buf->consume_unchecked(BUFFER_OPTION_CHEAP_PREPEND);
+            buf->write_back({ out_.data(), out_.size() });
+            return buf;
+        }
+
+        const deflate_stats& stats() const {
+            return stats_;
+        }
+
+    private:
+        bool inflate_chunk(std::string_view data, size_t max_size) {
+            inflate_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+            inflate_.avail_in = static_cast<uInt>(data.size());
+            do {
+                auto [p, n] = out_.prepare(std::max<size_t>(data.size() * 2, 4096));
+                inflate_.next_out = reinterpret_cast<Bytef*>(p);
+                inflate_.avail_out = static_cast<uInt>(n);
+                int ret = inflate(&inflate_, Z_SYNC_FLUSH);
+                out_.commit_unchecked(n - inflate_.avail_out);
+                if (out_.size() > max_size)
+                    return false;
+                if (ret == Z_STREAM_END) {
+                    // peer finished the stream with BFINAL, next message starts a new one
+                    inflateReset(&inflate_);
+                    return true;
+                }
+                if (ret == Z_BUF_ERROR)
+                    break; // no more progress possible: all input consumed and flushed
+                if (ret != Z_OK)
+                    return false;
+            } while (inflate_.avail_in > 0 || inflate_.avail_out == 0);
+            return inflate_.avail_in == 0;
+        }
+
+    private:
+        bool ok_ = false;
+        deflate_params params_;
+        deflate_stats stats_;
+        z_stream deflate_ {};
+        z_stream inflate_ {};
+        buffer out_ { 4096 };
+    };
+#else
+    class permessage_deflate {
+    public:
+        static constexpr bool supported = false;
+
+        permessage_deflate(const deflate_params&, int) {}
+
+        bool ok() const {
+            return false;
+        }
+
+        std::string_view compress(std::string_view) {
+            return {};
+        }
+
+        buffer_ptr_t decompress(std::string_view, size_t) {
+            return nullptr;
+        }
+
+        const deflate_stats& stats() const {
+            return stats_;
+        }
+
+    private:
+        deflate_stats stats_;
+    };
+#endif
+} // namespace ws
+} // namespace moon
@@ -0,0 +1,81 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define MOON_WS_MASK_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+    #include <arm_neon.h>
+    #define MOON_WS_MASK_NEON
+#endif
+
+namespace moon {
+namespace ws {
+    using mask_key_type = std::array<uint8_t, 4>;
+
+    /**
+     * XOR `size` bytes of src with the websocket mask key and store them to dst.
+     * dst and src may be the same pointer (in place). `offset` is the position
+     * of src[0] in the frame payload, so a payload can be unmasked in pieces.
+     */
+    inline void
+    xor_mask(uint8_t* dst, const uint8_t* src, size_t size, const mask_key_type& key, size_t offset = 0) {
+        mask_key_type rkey;
+        for (size_t i = 0; i < rkey.size(); ++i) {
+            rkey[i] = key[(i + offset) & 3];
+        }
+
+        uint32_t k32 = 0;
+        std::memcpy(&k32, rkey.data(), sizeof(k32));
+
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i k256 = _mm256_set1_epi32(static_cast<int>(k32));
+        for (; i + 32 <= size; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(v, k256));
+        }
+        const __m128i k128 = _mm_set1_epi32(static_cast<int>(k32));
+        for (; i + 16 <= size; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(v, k128));
+        }
+#elif defined(MOON_WS_MASK_SSE2)
+        const __m128i k128 = _mm_set1_epi32(static_cast<int>(k32));
+        for (; i + 16 <= size; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(v, k128));
+        }
+#elif defined(MOON_WS_MASK_NEON)
+        const uint8x16_t k128 = vreinterpretq_u8_u32(vdupq_n_u32(k32));
+        for (; i + 16 <= size; i += 16) {
+            vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), k128));
+        }
+#endif
+        // scalar fallback, 8 bytes at a time
+        const uint64_t k64 = (static_cast<uint64_t>(k32) << 32) | k32;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t v;
+            std::memcpy(&v, src + i, sizeof(v));
+            v ^= k64;
+            std::memcpy(dst + i, &v, sizeof(v));
+        }
+
+        // every step above is a multiple of 4, so the key is still aligned here
+        for (; i < size; ++i) {
+            dst[i] = src[i] ^ rkey[i & 3];
+        }
+    }
+
+    inline void apply_mask(uint8_t* data, size_t size, const mask_key_type& key, size_t offset = 0) {
+        xor_mask(data, data, size, key, offset);
+    }
+} // namespace ws
+} // namespace moon
+
+#undef MOON_WS_MASK_SSE2
+#undef MOON_WS_MASK_NEON
@@ -297,42 +297,76 @@ std::string server::info() const {
         log::instance().error_count()
     ));
     for (const auto& w: workers_) {
+        const auto& net = w->socket_server().net_stats();
         req.append(",\n");
         req.append(std::format(
-            R"({{"id":{}, "cpu":{}, "mqsize":{}, "service":{}, "timer":{}, "alive":{}}})",
+            R"({{"id":{}, "cpu":{}, "gc":{}, "mqsize":{}, "service":{}, "timer":{}, "alive":{}, "net_in":{}, "net_out":{}, "net_queued":{}, "kicked":{}, "net_writes":{}}})",
             w->id(),
             w->cpu(),
+            w->gc(),
             w->mq_size(),
             w->count(),
             timer_[w->id() - 1]->size(),
-            w->alive()
+            w->alive(),
+            net.bytes_in.load(std::memory_order_relaxed),
+            net.bytes_out.load(std::memory_order_relaxed),
+            net.queued_bytes.load(std::memory_order_relaxed),
+            net.kicked.load(std::memory_order_relaxed),
+            net.writes.load(std::memory_order_relaxed)
         ));
     }
     req.append("]");
     return req;
 }
 
-uint32_t server::nextfd() {
+uint32_t server::nextfd(uint32_t workerid) {
     uint32_t fd = 0;
     do {
         fd = fd_seq_.fetch_add(1, std::memory_order_relaxed);
-    } while (fd == 0 || !try_lock_fd(fd));
+    } while (fd == 0 || !try_lock_fd(fd, workerid));
     return fd;
 }
 
-bool server::try_lock_fd(uint32_t fd) {
-    std::unique_lock lck(fd_lock_);
-    return fd_watcher_.emplace(fd).second;
+bool server::try_lock_fd(uint32_t fd, uint32_t workerid) {
+    auto& shard = fd_shards_[fd % FD_SHARDS];
+    bool ok = false;
+    {
+        std::lock_guard lck(shard.lock);
+        ok = shard.fds.try_emplace(fd, workerid).second;
+    }
+    if (ok) {
+        fd_count_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return ok;
 }
 
 void server::unlock_fd(uint32_t fd) {
-    std::unique_lock lck(fd_lock_);
-    size_t count = fd_watcher_.erase(fd);
+    auto& shard = fd_shards_[fd % FD_SHARDS];
+    size_t count = 0;
+    {
+        std::lock_guard lck(shard.lock);
+        count = shard.fds.erase(fd);
+    }
     MOON_CHECK(count == 1, "socket fd erase failed!");
+    fd_count_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void server::set_fd_worker(uint32_t fd, uint32_t workerid) {
+    auto& shard = fd_shards_[fd % FD_SHARDS];
+    std::lock_guard lck(shard.lock);
+    if (auto iter = shard.fds.find(fd); iter != shard.fds.end()) {
+        iter->second = workerid;
+    }
+}
+
+uint32_t server::fd_worker(uint32_t fd) {
+    auto& shard = fd_shards_[fd % FD_SHARDS];
+    std::lock_guard lck(shard.lock);
+    auto iter = shard.fds.find(fd);
+    return iter != shard.fds.end() ? iter->second : 0;
 }
 
 size_t server::socket_num() const {
-    std::unique_lock lck(fd_lock_);
-    return fd_watcher_.size();
+    return fd_count_.load(std::memory_order_relaxed);
 }
 } // namespace moon
@@ -1,5 +1,6 @@
 #pragma once
 #include "common/concurrent_map.hpp"
+#include "common/spinlock.hpp"
 #include "common/timer.hpp"
 #include "config.hpp"
 #include "log.hpp"
@@ -7,6 +8,15 @@
 
 namespace moon {
 class server final {
+    // Live socket fds and the id of the worker that owns each, sharded by fd so that
+    // accepts and closes on different workers rarely touch the same lock
+    static constexpr size_t FD_SHARDS = 64;
+
+    struct alignas(64) fd_shard {
+        spin_lock lock;
+        std::unordered_map<uint32_t, uint32_t> fds;
+    };
+
     class timer_expire_policy {
     public:
         timer_expire_policy() = default;
@@ -101,12 +111,19 @@ public:
 
     std::string info() const;
 
-    uint32_t nextfd();
+    // A new fd owned by workerid
+    uint32_t nextfd(uint32_t workerid);
 
-    bool try_lock_fd(uint32_t fd);
+    bool try_lock_fd(uint32_t fd, uint32_t workerid);
 
     void unlock_fd(uint32_t fd);
 
+    // Record that fd moved to workerid, see socket_server::transfer
+    void set_fd_worker(uint32_t fd, uint32_t workerid);
+
+    // The worker that owns fd, 0 if fd is not open
+    uint32_t fd_worker(uint32_t fd);
+
     size_t socket_num() const;
 
     static uint32_t worker_id(uint32_t serviceid) {
@@ -122,13 +139,13 @@ private:
     std::atomic_int32_t exitcode_ = std::numeric_limits<int>::max();
     std::atomic<state> state_ = state::unknown;
     std::atomic<uint32_t> fd_seq_ = 1;
+    std::atomic<size_t> fd_count_ = 0;
     std::time_t now_ = 0;
     std::time_t now_without_offset_ = 0;
-    mutable std::mutex fd_lock_;
     std::unordered_map<std::string, register_func> regservices_;
     concurrent_map<std::string, std::shared_ptr<const std::string>, rwlock> env_;
     concurrent_map<std::string, uint32_t, rwlock> unique_services_;
-    std::unordered_set<uint32_t> fd_watcher_;
+    std::array<fd_shard, FD_SHARDS> fd_shards_;
     std::vector<std::unique_ptr<timer_type>> timer_;
     std::vector<std::unique_ptr<worker>> workers_;
 };
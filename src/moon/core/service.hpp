@@ -60,6 +60,11 @@ public:
         return std::exchange(cpu_, 0);
     }
 
+    // Seconds spent in garbage collection since the last call
+    double gc() {
+        return std::exchange(gc_, 0);
+    }
+
 public:
     virtual bool init(const service_conf& conf) = 0;
 
@@ -67,6 +72,16 @@ public:
 
     virtual void signal(int) {}
 
+    // Called on the worker thread between messages after a signal reached the worker, see
+    // worker::signal
+    virtual void signal_idle(int) {}
+
+    // Called when the worker is idle after handling messages, returns false when the
+    // service does not want to be called again. See worker::idle_gc.
+    virtual bool idle_gc() {
+        return false;
+    }
+
 protected:
     void set_unique(bool v) {
         unique_ = v;
@@ -87,6 +102,7 @@ protected:
     server* server_ = nullptr;
     worker* worker_ = nullptr;
     double cpu_ = 0.0; //
+    double gc_ = 0.0;
     std::string name_;
 };
 
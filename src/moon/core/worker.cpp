@@ -7,6 +7,13 @@
 #include "service.hpp"
 
 namespace moon {
+// Messages of the same-worker fast path handled in one pass, the rest waits in mq_ so that
+// services ping-ponging each other do not starve other senders
+constexpr size_t LOCAL_PASS_LIMIT = 1024;
+
+// The worker running on this thread
+static thread_local worker* this_worker = nullptr;
+
 worker::worker(server* srv, uint32_t id):
     workerid_(id),
     server_(srv),
@@ -27,6 +34,7 @@ void worker::run() {
     socket_server_ = std::make_unique<moon::socket_server>(server_, this, io_ctx_);
 
     thread_ = std::thread([this]() {
+        this_worker = this;
         CONSOLE_INFO("WORKER-{} START", workerid_);
         io_ctx_.run();
         socket_server_->close_all();
@@ -51,10 +59,19 @@ void worker::wait() {
     }
 }
 
-void worker::signal(int val) const{
+void worker::signal(int val) {
     if (auto s = current_.load(std::memory_order_acquire); s != nullptr) {
         s->signal(val);
     }
+
+    if (val == 2) {
+        // the services that are not running answer between messages
+        asio::post(io_ctx_, [this, val] {
+            for (auto& it: services_) {
+                it.second->signal_idle(val);
+            }
+        });
+    }
 }
 
 uint32_t worker::allocate_service_id(uint32_t opt_service_id) {
@@ -239,26 +256,96 @@ asio::io_context& worker::io_context() {
 }
 
 void worker::send(message&& msg) {
+    // draining_ and capture_ are only used on the worker's own thread
+    if (this_worker == this) {
+        if (nullptr != capture_.out && msg.session == capture_.session
+            && msg.receiver == capture_.receiver)
+        {
+            *std::exchange(capture_.out, nullptr) = std::move(msg);
+            return;
+        }
+
+        if (draining_) {
+            local_mq_.emplace_back(std::move(msg));
+            return;
+        }
+    }
+
     if (mq_.push_back(std::move(msg)) == 1) {
-        asio::post(io_ctx_, [this]() {
-            auto& read_queue = mq_.swap_on_read();
-            if (read_queue.empty()) {
-                return;
-            }
+        asio::post(io_ctx_, [this]() { drain(); });
+    }
+}
 
-            auto size = read_queue.size();
-            swapped_size_.store(size, std::memory_order_relaxed);
-            
-            // Process all messages in the queue
-            service* cached_service = nullptr;
-            for (auto& m: read_queue) {
-                cached_service = handle_one(cached_service, std::move(m));
-                swapped_size_.store(--size, std::memory_order_relaxed);
-            }
-            
-            read_queue.clear();
-            current_.store(nullptr, std::memory_order_relaxed);
-        });
+void worker::drain() {
+    auto& read_queue = mq_.swap_on_read();
+    if (read_queue.empty()) {
+        return;
+    }
+
+    draining_ = true;
+
+    auto size = read_queue.size();
+    swapped_size_.store(size, std::memory_order_relaxed);
+
+    // Process all messages in the queue
+    service* cached_service = nullptr;
+    for (auto& m: read_queue) {
+        cached_service = handle_one(cached_service, std::move(m));
+        swapped_size_.store(--size, std::memory_order_relaxed);
+    }
+
+    read_queue.clear();
+
+    // Then the messages sent meanwhile from this thread. They come after everything their
+    // sender sent before this pass, which was swapped with read_queue.
+    size_t handled = 0;
+    while (!local_mq_.empty() && handled < LOCAL_PASS_LIMIT) {
+        std::swap(local_mq_, local_read_);
+        size = local_read_.size();
+        handled += size;
+        swapped_size_.store(size, std::memory_order_relaxed);
+        for (auto& m: local_read_) {
+            cached_service = handle_one(cached_service, std::move(m));
+            swapped_size_.store(--size, std::memory_order_relaxed);
+        }
+        local_read_.clear();
+    }
+
+    draining_ = false;
+
+    // over the limit, queue the rest behind the other senders
+    for (auto& m: local_mq_) {
+        send(std::move(m));
+    }
+    local_mq_.clear();
+
+    current_.store(nullptr, std::memory_order_relaxed);
+
+    if (!idle_gc_.empty() && mq_.size() == 0) {
+        idle_gc();
+    }
+}
+
+void worker::add_idle_gc(uint32_t serviceid) {
+    if (std::find(idle_gc_.begin(), idle_gc_.end(), serviceid) == idle_gc_.end()) {
+        idle_gc_.emplace_back(serviceid);
+    }
+}
+
+void worker::idle_gc() {
+    for (size_t i = 0; i < idle_gc_.size();) {
+        if (mq_.size() > 0) {
+            // new messages first, the rest waits for the next idle pass
+            return;
+        }
+
+        auto s = find_service(idle_gc_[i]);
+        if (nullptr == s || !s->idle_gc()) {
+            idle_gc_[i] = idle_gc_.back();
+            idle_gc_.pop_back();
+            continue;
+        }
+        ++i;
     }
 }
 
@@ -281,6 +368,31 @@ bool worker::shared() const {
     return shared_.load();
 }
 
+void worker::handle_nested(service* s, message&& msg) {
+    uint32_t sender = msg.sender;
+    uint8_t type = msg.type;
+    service* running = current_.exchange(s, std::memory_order_acq_rel);
+    double outer = std::exchange(nested_, 0.0);
+
+    double start_time = moon::time::clock();
+    handle_message(s, std::move(msg));
+    double total_time = moon::time::clock() - start_time;
+
+    double diff_time = total_time - std::exchange(nested_, outer + total_time);
+    current_.store(running, std::memory_order_release);
+    s->add_cpu(diff_time);
+    if (diff_time > 0.1) {
+        CONSOLE_WARN(
+            "worker {} handle one nested message({}) cost {}, from {:08X} to {:08X}",
+            id(),
+            type,
+            diff_time,
+            sender,
+            s->id()
+        );
+    }
+}
+
 service* worker::handle_one(service* s, message&& msg) {
     uint32_t sender = msg.sender;
     uint32_t receiver = msg.receiver;
@@ -315,9 +427,11 @@ service* worker::handle_one(service* s, message&& msg) {
         double start_time = moon::time::clock();
         current_.store(s, std::memory_order_release);
         handle_message(s, std::move(msg));
-        double diff_time = moon::time::clock() - start_time;
+        double total_time = moon::time::clock() - start_time;
+        // the services it called with handle_nested were charged already
+        double diff_time = total_time - std::exchange(nested_, 0.0);
         s->add_cpu(diff_time);
-        cpu_ += diff_time;
+        cpu_ += total_time;
         if (diff_time > 0.1) {
             CONSOLE_WARN(
                 "worker {} handle one message({}) cost {}, from {:08X} to {:08X}",
@@ -341,6 +455,7 @@ service* worker::handle_one(service* s, message&& msg) {
             handle_message(v, msg);
         }
     }
+    nested_ = 0.0;
     return nullptr;
 }
 } // namespace moon
@@ -6,6 +6,13 @@
 namespace moon {
 class server;
 
+// A response sent from the worker's thread that is handed to out instead of queued
+struct response_capture {
+    uint32_t receiver = 0;
+    int64_t session = 0;
+    message* out = nullptr; // null when not capturing, or after the response was captured
+};
+
 class worker {
     using queue_type = concurrent_queue<message, std::mutex, std::vector>;
 
@@ -32,8 +39,24 @@ public:
 
     void scan(uint32_t sender, int64_t sessionid);
 
+    // Messages sent from this worker's own thread while it handles its queue skip the locked
+    // queue and are handled later in the same pass. Messages from one sender to one receiver
+    // stay in order.
     void send(message&& msg);
 
+    // Replace the response capture of this worker, returns the previous one. Only call on the
+    // worker's thread. Used by moon.call_direct.
+    response_capture capture_response(response_capture c) {
+        return std::exchange(capture_, c);
+    }
+
+    // Only call on the worker's thread
+    service* find_service(uint32_t serviceid) const;
+
+    // Let s handle msg now, inside the message the running service is handling. s counts as
+    // the running service meanwhile, for signals and its cpu time. Used by moon.call_direct.
+    void handle_nested(service* s, message&& msg);
+
     void shared(bool v);
 
     bool shared() const;
@@ -52,6 +75,17 @@ public:
         return std::exchange(cpu_, 0.0);
     }
 
+    double gc() {
+        return std::exchange(gc_, 0.0);
+    }
+
+    void add_gc(double v) {
+        gc_ += v;
+    }
+
+    // serviceid runs GC steps when this worker is idle, until its idle_gc returns false
+    void add_idle_gc(uint32_t serviceid);
+
     uint32_t count() const {
         return count_.load(std::memory_order_relaxed);
     }
@@ -62,15 +96,18 @@ public:
 
     void wait();
 
-    void signal(int val) const;
+    void signal(int val);
 
 private:
     service* handle_one(service* s, message&& msg);
 
-    service* find_service(uint32_t serviceid) const;
-
     uint32_t allocate_service_id(uint32_t opt_service_id);
 
+    void idle_gc();
+
+    // Handle the messages of mq_ and then those the services sent each other meanwhile
+    void drain();
+
 private:
     std::atomic_bool shared_ = true;
     std::atomic_uint32_t count_ = 0;
@@ -78,14 +115,21 @@ private:
     uint32_t nextid_ = 0;
     uint32_t workerid_ = 0;
     uint32_t version_ = 0;
+    bool draining_ = false;
     double cpu_ = 0.0;
+    double nested_ = 0.0; // seconds of handle_nested inside the message being timed
+    double gc_ = 0.0;
     server* server_;
     std::atomic<service*> current_ = nullptr;
     asio::io_context io_ctx_;
     asio_work_type work_;
     std::thread thread_;
     queue_type mq_;
+    std::vector<message> local_mq_; // sent during the current pass from this thread
+    std::vector<message> local_read_;
+    response_capture capture_;
     std::unique_ptr<moon::socket_server> socket_server_;
     std::unordered_map<uint32_t, service_ptr_t> services_;
+    std::vector<uint32_t> idle_gc_;
 };
 }; // namespace moon
@@ -126,6 +126,10 @@ int main(int argc, char* argv[]) {
         std::string bootstrap;
         std::string loglevel;
         std::string stat;
+        uint32_t timeout_granularity = 1000;
+        std::string codecache_bundle;
+        size_t lua_state_pool = 0;
+        uint32_t dispatch_budget = 0;
 
         int argn = 1;
         if (argc <= argn) {
@@ -185,6 +189,11 @@ int main(int argc, char* argv[]) {
             enable_stdout = lua_opt_field<bool>(L, -1, "enable_stdout", enable_stdout);
             loglevel = lua_opt_field<std::string>(L, -1, "loglevel", loglevel);
             lua_search_path = lua_opt_field<std::string>(L, -1, "path", "");
+            timeout_granularity =
+                lua_opt_field<uint32_t>(L, -1, "timeout_granularity", timeout_granularity);
+            codecache_bundle = lua_opt_field<std::string>(L, -1, "codecache_bundle", "");
+            lua_state_pool = lua_opt_field<size_t>(L, -1, "lua_state_pool", lua_state_pool);
+            dispatch_budget = lua_opt_field<uint32_t>(L, -1, "dispatch_budget", dispatch_budget);
             std::string cpath = lua_opt_field<std::string>(L, -1, "cpath", "");
             if (!cpath.empty()) {
                 server_->set_env(
@@ -243,6 +252,8 @@ int main(int argc, char* argv[]) {
         }
 
         server_->register_service("lua", []() -> service_ptr_t {
+            if (auto s = lua_service_pool::instance().take(); s)
+                return s;
             return std::make_unique<lua_service>();
         });
 
@@ -250,14 +261,27 @@ int main(int argc, char* argv[]) {
         fs::current_path(fs::absolute(fs::path(bootstrap)).parent_path());
         directory::working_directory = fs::current_path();
 
+#ifdef LUA_CACHELIB
+        if (!codecache_bundle.empty()) {
+            const char* err = luaL_opencodebundle(codecache_bundle.data());
+            MOON_CHECK(
+                err == nullptr,
+                std::format("codecache_bundle {}: {}", codecache_bundle, err)
+            );
+        }
+#endif
+
         server_->set_env("ARG", arg);
         server_->set_env("THREAD_NUM", std::to_string(thread_count));
+        server_->set_env("TIMEOUT_GRANULARITY", std::to_string(timeout_granularity));
+        server_->set_env("DISPATCH_BUDGET", std::to_string(dispatch_budget));
 
         log::instance().set_enable_console(enable_stdout);
         log::instance().set_level(loglevel);
         log::instance().init(logfile);
 
         server_->init(thread_count);
+        lua_service_pool::instance().start(server_.get(), lua_state_pool);
 
         auto conf = std::make_unique<moon::service_conf>();
         conf->type = "lua";
@@ -270,8 +294,9 @@ int main(int argc, char* argv[]) {
             conf->params.append(*cpath);
         conf->params.append(stat);
         conf->params.append("return {}");
-        server_->new_service(std::move(conf));
+        // registered first, services started by bootstrap may query it before new_service returns
         server_->set_unique_service("bootstrap", BOOTSTRAP_ADDR);
+        server_->new_service(std::move(conf));
 
         exitcode = server_->run();
     } catch (const std::exception& e) {
@@ -281,6 +306,7 @@ int main(int argc, char* argv[]) {
         exitcode = -1;
         CONSOLE_ERROR("ERROR: {}", e.what());
     }
+    lua_service_pool::instance().stop();
     CONSOLE_INFO("STOP");
     while (log::instance().size() > 0)
         thread_sleep(10);
@@ -1,6 +1,8 @@
 #include "lua_service.h"
 #include "common/hash.hpp"
 #include "common/lua_utility.hpp"
+#include "common/string.hpp"
+#include "common/time.hpp"
 #include "message.hpp"
 #include "server.h"
 #include "worker.h"
@@ -31,13 +33,31 @@ global_seed() {
 	return ret;
 }
 
+void alloc_hook(lua_State* L, lua_Debug*);
+
+void reset_hook(lua_State* L, lua_service* S);
+
+static void* service_realloc([[maybe_unused]] mi_heap_s* heap, void* ptr, size_t nsize) {
+#ifdef MOON_ENABLE_MIMALLOC
+    if (nullptr != heap) {
+        return mi_heap_realloc(heap, ptr, nsize);
+    }
+#endif
+    return realloc(ptr, nsize);
+}
+
 void* lua_service::lalloc(void* ud, void* ptr, size_t osize, size_t nsize) {
     auto* l = static_cast<lua_service*>(ud);
 
     if (nsize == 0) {
         if (ptr) {
-            free(ptr);
+            if (!l->closing_) {
+                free(ptr);
+            }
             l->mem -= osize;
+            if (nullptr != l->alloc_profiler) {
+                l->alloc_profiler->on_free(ptr);
+            }
         }
         return nullptr;
     }
@@ -75,7 +95,88 @@ void* lua_service::lalloc(void* ud, void* ptr, size_t osize, size_t nsize) {
         );
     }
 
-    return realloc(ptr, nsize);
+    void* res = service_realloc(l->heap_, ptr, nsize);
+    if (nullptr != l->alloc_profiler && nullptr != res) {
+        // osize is the object type when ptr is null
+        size_t growth = (nullptr == ptr) ? nsize : (nsize > osize ? nsize - osize : 0);
+        // a signal that sets the trap after this check is handled by alloc_hook
+        if (l->alloc_profiler->on_alloc(ptr, res, growth)
+            && l->trap.load(std::memory_order_acquire) == 0)
+        {
+            lua_sethook(
+                (nullptr != l->activeL) ? l->activeL : l->lua_.get(),
+                alloc_hook,
+                LUA_MASKCOUNT,
+                1
+            );
+        }
+    }
+    return res;
+}
+
+bool lua_alloc_profiler::on_alloc(void* ptr, void* nptr, size_t growth) {
+    if (nullptr != ptr && ptr != nptr) {
+        if (auto it = blocks.find(ptr); it != blocks.end()) {
+            auto b = it->second;
+            blocks.erase(it);
+            blocks.emplace(nptr, b);
+        } else {
+            for (auto& v: pending) {
+                if (v.first == ptr)
+                    v.first = nptr;
+            }
+        }
+    }
+
+    bytes += growth;
+    if (bytes < rate) {
+        return false;
+    }
+    pending.emplace_back(nptr, bytes);
+    bytes = 0;
+    return true;
+}
+
+void lua_alloc_profiler::on_free(void* ptr) {
+    if (auto it = blocks.find(ptr); it != blocks.end()) {
+        it->second.owner->live -= static_cast<int64_t>(it->second.weight);
+        blocks.erase(it);
+        return;
+    }
+    std::erase_if(pending, [ptr](const auto& v) { return v.first == ptr; });
+}
+
+void lua_alloc_profiler::add_site() {
+    auto& s = sites[key];
+    for (auto [ptr, weight]: pending) {
+        s.live += static_cast<int64_t>(weight);
+        s.allocated += static_cast<int64_t>(weight);
+        auto [it, ok] = blocks.try_emplace(ptr, block { &s, weight });
+        if (!ok) {
+            // sampled again after a realloc
+            it->second.owner->live -= static_cast<int64_t>(it->second.weight);
+            it->second = block { &s, weight };
+        }
+    }
+    pending.clear();
+}
+
+std::string lua_alloc_profiler::report(size_t top) const {
+    std::vector<std::pair<const std::string*, site>> v;
+    v.reserve(sites.size());
+    for (const auto& [k, s]: sites) {
+        v.emplace_back(&k, s);
+    }
+    top = std::min(top, v.size());
+    std::partial_sort(v.begin(), v.begin() + top, v.end(), [](const auto& a, const auto& b) {
+        return a.second.live > b.second.live;
+    });
+
+    std::string res = std::format("allocation sites sampled every {} bytes, live allocated stack\n", rate);
+    for (size_t i = 0; i < top; ++i) {
+        res.append(std::format("{} {} {}\n", v[i].second.live, v[i].second.allocated, *v[i].first));
+    }
+    return res;
 }
 
 lua_service* lua_service::get(lua_State* L) {
@@ -85,19 +186,105 @@ lua_service* lua_service::get(lua_State* L) {
     return reinterpret_cast<lua_service*>(v);
 }
 
-lua_service::lua_service(): lua_(lua_newstate(lalloc, this, global_seed())) {
+void lua_service::trace_gc(lua_State* L, int begin) {
+    void* ud = nullptr;
+    if (lua_getallocf(L, &ud) != lalloc) {
+        // not a service state
+        return;
+    }
+
+    auto* S = static_cast<lua_service*>(ud);
+    if (begin) {
+        S->gc_start_ = moon::time::clock();
+        return;
+    }
+
+    double diff = moon::time::clock() - S->gc_start_;
+    S->gc_ += diff;
+    if (nullptr != S->worker_) {
+        S->worker_->add_gc(diff);
+    }
+}
+
+static mi_heap_s* new_heap([[maybe_unused]] bool own_heap) {
+#ifdef MOON_ENABLE_MIMALLOC
+    if (own_heap) {
+        return mi_heap_new();
+    }
+#endif
+    return nullptr;
+}
+
+lua_service::lua_service(bool own_heap):
+    heap_(new_heap(own_heap)),
+    lua_(lua_newstate(lalloc, this, global_seed())) {
     static_assert((LUA_EXTRASPACE == sizeof(this)) && (LUA_EXTRASPACE == sizeof(intptr_t)));
     intptr_t p = (intptr_t)this;
     memcpy(lua_getextraspace(lua_.get()), &p, LUA_EXTRASPACE);
+
+    [[maybe_unused]] static bool traced = (lua_setgctrace(trace_gc), true);
 }
 
 lua_service::~lua_service() {
-    log::instance().logstring(
-        true,
-        moon::LogLevel::Info,
-        std::format("[WORKER {}] destroy service [{}] ", worker_->id(), name()),
-        id()
-    );
+    // worker_ is null when the service was prepared but never used
+    if (nullptr != worker_) {
+        log::instance().logstring(
+            true,
+            moon::LogLevel::Info,
+            std::format("[WORKER {}] destroy service [{}] ", worker_->id(), name()),
+            id()
+        );
+    }
+
+#ifdef MOON_ENABLE_MIMALLOC
+    if (nullptr != heap_) {
+        // Every block of the state is in heap_. lua_close still runs the finalizers, the
+        // blocks it frees are released together with the heap.
+        closing_ = true;
+        lua_.reset();
+        mi_heap_destroy(heap_);
+    }
+#endif
+}
+
+std::pair<size_t, size_t> lua_service::memory() const {
+    auto used = static_cast<size_t>(mem);
+#ifdef MOON_ENABLE_MIMALLOC
+    if (nullptr != heap_) {
+        std::pair<size_t, size_t> res { 0, 0 };
+        mi_heap_visit_blocks(
+            heap_,
+            false,
+            [](const mi_heap_t*, const mi_heap_area_t* area, void*, size_t, void* arg) {
+                auto* r = static_cast<std::pair<size_t, size_t>*>(arg);
+                r->first += area->used * area->block_size;
+                r->second += area->committed;
+                return true;
+            },
+            &res
+        );
+        return res;
+    }
+#endif
+    return { used, used };
+}
+
+void lua_service::report_alloc() {
+    alloc_report.store(false, std::memory_order_relaxed);
+    // signal 2 reaches every service of the worker, the ones not tracking stay quiet
+    if (nullptr == alloc_profiler) {
+        return;
+    }
+    log::instance().logstring(true, moon::LogLevel::Info, alloc_profiler->report(20), id());
+    alloc_reported_ = true;
+}
+
+void lua_service::collect([[maybe_unused]] bool force) {
+#ifdef MOON_ENABLE_MIMALLOC
+    if (nullptr != heap_) {
+        mi_heap_collect(heap_, force);
+    }
+#endif
 }
 
 static int protect_init(lua_State* L) {
@@ -108,8 +295,20 @@ static int protect_init(lua_State* L) {
         return 0;
     }
 
-    luaL_openlibs(L);
-    open_custom_libs(L);
+    if (lua_toboolean(L, 2)) {
+        // moon.core was opened by prepare() before the service had an id
+        const lua_service* S = lua_service::get(L);
+        luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+        lua_getfield(L, -1, "moon.core");
+        lua_pushinteger(L, S->id());
+        lua_setfield(L, -2, "id");
+        lua_pushlstring(L, S->name().data(), S->name().size());
+        lua_setfield(L, -2, "name");
+        lua_pop(L, 2);
+    } else {
+        luaL_openlibs(L);
+        open_custom_libs(L);
+    }
 
     if ((luaL_loadfile(L, conf->source.data())) != LUA_OK)
         return 1;
@@ -142,8 +341,9 @@ bool lua_service::init(const moon::service_conf& conf) {
 
     lua_pushcfunction(L, protect_init);
     lua_pushlightuserdata(L, (void*)&conf);
+    lua_pushboolean(L, prepared_);
 
-    if (lua_pcall(L, 1, LUA_MULTRET, trace_fn) != LUA_OK || lua_gettop(L) > 1) {
+    if (lua_pcall(L, 2, LUA_MULTRET, trace_fn) != LUA_OK || lua_gettop(L) > 1) {
         CONSOLE_ERROR("new_service lua_error:\n{}.", lua_tostring(L, -1));
         return false;
     }
@@ -157,6 +357,15 @@ bool lua_service::init(const moon::service_conf& conf) {
 
     lua_gc(L, LUA_GCRESTART, 0);
 
+    if (auto env = server_->get_env("DISPATCH_BUDGET"); env) {
+        std::errc ec {};
+        auto v = moon::string_convert<uint32_t>(*env, ec);
+        // a budget the script set takes precedence
+        if (ec == std::errc() && v > 0 && budget <= 0) {
+            set_budget(v);
+        }
+    }
+
     assert(lua_gettop(L) == 0);
 
     ok_ = true;
@@ -164,6 +373,120 @@ bool lua_service::init(const moon::service_conf& conf) {
     return ok_;
 }
 
+static int protect_prepare(lua_State* L) {
+    size_t len = 0;
+    const char* params = lua_tolstring(L, 1, &len);
+
+    luaL_openlibs(L);
+    open_custom_libs(L);
+
+    if (luaL_loadbuffer(L, params, len, "=prepare") != LUA_OK)
+        return 1;
+    lua_call(L, 0, 0);
+
+    // the modules moon.lua requires first, moon itself depends on the service id
+    constexpr std::string_view modules[] = { "base.io",   "base.os",   "base.string", "base.table",
+                                             "base.math", "base.util", "base.class" };
+    for (auto name: modules) {
+        lua_getglobal(L, "require");
+        lua_pushlstring(L, name.data(), name.size());
+        lua_call(L, 1, 0);
+    }
+    return 0;
+}
+
+bool lua_service::prepare(const std::string& params) {
+    lua_State* L = lua_.get();
+
+    lua_gc(L, LUA_GCSTOP, 0);
+    lua_gc(L, LUA_GCGEN, 0, 0);
+
+    lua_pushcfunction(L, traceback);
+    int trace_fn = lua_gettop(L);
+
+    lua_pushcfunction(L, protect_prepare);
+    lua_pushlstring(L, params.data(), params.size());
+
+    if (lua_pcall(L, 1, LUA_MULTRET, trace_fn) != LUA_OK || lua_gettop(L) > 1) {
+        CONSOLE_ERROR("prepare lua service error:\n{}.", lua_tostring(L, -1));
+        return false;
+    }
+
+    lua_pop(L, 1);
+    lua_gc(L, LUA_GCRESTART, 0);
+    assert(lua_gettop(L) == 0);
+    prepared_ = true;
+    return true;
+}
+
+lua_service_pool& lua_service_pool::instance() {
+    static lua_service_pool pool;
+    return pool;
+}
+
+void lua_service_pool::start(moon::server* s, size_t size) {
+    if (size == 0 || thread_.joinable()) {
+        return;
+    }
+    server_ = s;
+    size_ = size;
+    ready_.reserve(size);
+    thread_ = std::thread([this] { run(); });
+}
+
+void lua_service_pool::stop() {
+    {
+        std::unique_lock lock { mutex_ };
+        stop_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    ready_.clear();
+}
+
+std::unique_ptr<lua_service> lua_service_pool::take() {
+    std::unique_ptr<lua_service> s;
+    {
+        std::unique_lock lock { mutex_ };
+        if (ready_.empty()) {
+            return nullptr;
+        }
+        s = std::move(ready_.back());
+        ready_.pop_back();
+    }
+    cv_.notify_one();
+    return s;
+}
+
+void lua_service_pool::run() {
+    std::string params;
+    if (auto path = server_->get_env("PATH"); path)
+        params.append(*path);
+    if (auto cpath = server_->get_env("CPATH"); cpath)
+        params.append(*cpath);
+
+    std::unique_lock lock { mutex_ };
+    while (!stop_) {
+        if (ready_.size() >= size_) {
+            cv_.wait(lock);
+            continue;
+        }
+
+        lock.unlock();
+        // a heap can only allocate on the thread that created it
+        auto s = std::make_unique<lua_service>(false);
+        bool ok = s->prepare(params);
+        lock.lock();
+        if (!ok) {
+            // new services are created without the pool
+            break;
+        }
+        ready_.emplace_back(std::move(s));
+    }
+}
+
 //https://blog.codingnow.com/2022/04/lua_binding_callback.html#more
 int lua_service::set_callback(lua_State* L) {
     lua_service* S = lua_service::get(L);
@@ -196,14 +519,72 @@ int64_t lua_service::next_sequence() {
     return v;
 }
 
+void lua_service::set_gc_mode(bool incremental) {
+    lua_gc(lua_.get(), incremental ? LUA_GCINC : LUA_GCGEN);
+    gc_incremental_ = incremental;
+}
+
+void lua_service::set_idle_gc(uint32_t millseconds) {
+    gc_idle_ = millseconds / 1000.0;
+    if (millseconds > 0) {
+        worker_->add_idle_gc(id_);
+    }
+}
+
+void lua_service::set_budget(uint32_t millseconds) {
+    budget = millseconds / 1000.0;
+    // the running message counts from now
+    budget_deadline = moon::time::clock() + budget;
+}
+
+bool lua_service::idle_gc() {
+    if (gc_idle_ <= 0) {
+        return false;
+    }
+
+    lua_State* L = lua_.get();
+    if (!std::exchange(gc_pending_, false) || lua_gc(L, LUA_GCISRUNNING) != 1) {
+        return true;
+    }
+
+    if (!gc_incremental_) {
+        // one minor collection
+        lua_gc(L, LUA_GCSTEP, 0);
+        return true;
+    }
+
+    // incremental steps until the cycle ends or the time is used
+    double deadline = moon::time::clock() + gc_idle_;
+    while (lua_gc(L, LUA_GCSTEP, 0) == 0 && moon::time::clock() < deadline) {
+    }
+    return true;
+}
+
 void lua_service::dispatch(message* m) {
     if (!ok())
         return;
 
+    dispatching_ = true;
+    handle(m);
+    dispatching_ = false;
+}
+
+void lua_service::handle(message* m) {
+    gc_pending_ = true;
+
+    if (alloc_report.load(std::memory_order_relaxed)) {
+        report_alloc();
+    }
+
     //require 'moon' first
     assert(cb_ctx != nullptr);
 
     lua_State* L = cb_ctx->L;
+    if (budget > 0) {
+        budget_deadline = moon::time::clock() + budget;
+        reset_hook(L, this);
+    }
+
     try {
         int trace = 1;
         lua_pushvalue(L, 2);
@@ -256,6 +637,20 @@ void lua_service::dispatch(message* m) {
 
 void signal_hook(lua_State * L, lua_Debug*);
 
+void lua_service::signal_idle(int val) {
+    if (val != 2) {
+        return;
+    }
+
+    // a service the signal found running may already have reported where it was
+    if (std::exchange(alloc_reported_, false)) {
+        return;
+    }
+
+    report_alloc();
+    alloc_reported_ = false;
+}
+
 void lua_service::signal(int val) {
 
     log::instance()
@@ -280,5 +675,8 @@ void lua_service::signal(int val) {
             std::format("Current Memory {:.3f}K", (float)mem / 1024),
             id()
         );
+    } else if (val == 2) {
+        // logged by the service thread, at the next sampled allocation or message
+        alloc_report.store(true, std::memory_order_relaxed);
     }
 }
@@ -1,6 +1,52 @@
 #pragma once
 #include "common/lua_utility.hpp"
 #include "service.hpp"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+struct mi_heap_s;
+
+// Samples of coroutine.profile.sample_start, collapsed stack -> count
+struct lua_profiler {
+    int period = 0; // VM instructions between two samples
+    std::unordered_map<std::string, int64_t> stacks;
+    std::vector<lua_Debug> frames;
+    std::string key;
+};
+
+// Allocation sites of coroutine.profile.alloc_start. An allocation is sampled every rate
+// bytes, the stack is captured by a hook at the next instruction.
+struct lua_alloc_profiler {
+    struct site {
+        int64_t live = 0; // bytes of the sampled blocks not freed yet
+        int64_t allocated = 0;
+    };
+
+    struct block {
+        site* owner = nullptr;
+        size_t weight = 0;
+    };
+
+    size_t rate = 0;
+    size_t bytes = 0; // allocated since the last sample
+    std::unordered_map<std::string, site> sites;
+    std::unordered_map<void*, block> blocks;
+    std::vector<std::pair<void*, size_t>> pending; // sampled, the stack is not captured yet
+    std::vector<lua_Debug> frames;
+    std::string key;
+
+    // Returns true when nptr was sampled
+    bool on_alloc(void* ptr, void* nptr, size_t growth);
+
+    void on_free(void* ptr);
+
+    // Add the pending samples to the site key
+    void add_site();
+
+    // The top sites by live bytes
+    std::string report(size_t top) const;
+};
 
 struct callback_context {
     lua_State* L = nullptr;
@@ -8,22 +54,49 @@ struct callback_context {
 
 class lua_service final: public moon::service {
 public:
-    lua_service();
+    // own_heap: allocate the state from a mimalloc heap of the calling thread, which must be the
+    // worker thread that runs the service
+    explicit lua_service(bool own_heap = true);
 
     ~lua_service();
 
+    // Open the libraries and require the modules every service loads, before the service
+    // has an id. Used by lua_service_pool.
+    bool prepare(const std::string& params);
+
+    void set_gc_mode(bool incremental);
+
+    // Run GC steps for at most millseconds when the worker is idle, 0 disables
+    void set_idle_gc(uint32_t millseconds);
+
+    // Interrupt a message handler that runs longer than millseconds, 0 disables
+    void set_budget(uint32_t millseconds);
+
 private:
     bool init(const moon::service_conf& conf) override;
 
     void dispatch(moon::message* msg) override;
 
+    void handle(moon::message* msg);
+
     void signal(int val) override;
 
+    void signal_idle(int val) override;
+
+    bool idle_gc() override;
+
     static void* lalloc(void* ud, void* ptr, size_t osize, size_t nsize);
 
+    static void trace_gc(lua_State* L, int begin);
+
 public:
     std::atomic_int trap = 0;
     lua_State* activeL = nullptr;
+    std::unique_ptr<lua_profiler> profiler; // null when not sampling
+    std::unique_ptr<lua_alloc_profiler> alloc_profiler; // null when not tracking allocations
+    std::atomic_bool alloc_report = false; // set by signal 2
+    double budget = 0.0; // seconds, see set_budget
+    double budget_deadline = 0.0; // of the message being dispatched
 
     static lua_service* get(lua_State* L);
 
@@ -31,11 +104,65 @@ public:
 
     int64_t next_sequence();
 
+    // Bytes in use and bytes committed by the allocator for this service. Without a heap of
+    // its own both are the bytes the lua state allocated.
+    std::pair<size_t, size_t> memory() const;
+
+    // Return the free memory of the service heap to the OS
+    void collect(bool force);
+
+    // Log the top allocation sites, nothing when allocations are not tracked
+    void report_alloc();
+
+    // True while a message handler of this service runs
+    bool dispatching() const {
+        return dispatching_;
+    }
+
+    // The last response moon.call_direct got without waiting, alive until the next call
+    std::unique_ptr<moon::message> direct_response;
+
 private:
     ssize_t mem = 0;
     ssize_t mem_limit = std::numeric_limits<ssize_t>::max();
     ssize_t mem_report = 8 * 1024 * 1024;
     int64_t current_sequence_ = 0;
     callback_context* cb_ctx = nullptr;
+    bool prepared_ = false;
+    bool dispatching_ = false;
+    bool alloc_reported_ = false; // report_alloc ran since the last signal_idle
+    bool gc_incremental_ = false;
+    bool gc_pending_ = false; // handled messages since the last idle GC steps
+    double gc_idle_ = 0.0; // seconds
+    double gc_start_ = 0.0;
+    bool closing_ = false;
+    mi_heap_s* heap_ = nullptr; // initialized before lua_
     std::unique_ptr<lua_State, moon::state_deleter> lua_;
 };
+
+/**
+ * Prepared lua services, refilled on a helper thread, so that creating a service only
+ * runs its script. See the lua_state_pool option of the init conf.
+ */
+class lua_service_pool {
+public:
+    static lua_service_pool& instance();
+
+    void start(moon::server* s, size_t size);
+
+    void stop();
+
+    // nullptr when the pool is empty
+    std::unique_ptr<lua_service> take();
+
+private:
+    void run();
+
+    moon::server* server_ = nullptr;
+    size_t size_ = 0;
+    bool stop_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::unique_ptr<lua_service>> ready_;
+    std::thread thread_;
+};
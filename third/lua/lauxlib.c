@@ -1202,87 +1202,429 @@ LUALIB_API void luaL_checkversion_ (lua_State *L, lua_Number ver, size_t sz) {
 
 // use clonefunction
 
+#include <sys/stat.h>
 #include "spinlock.h"
 #include "lstate.h"
 
-struct codecache {
-	struct spinlock lock;
-	lua_State *L;
+#if defined(LUA_USE_POSIX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*
+** Version of a source file, a cached proto is dropped when it changes.
+** All zero when the file does not exist. mtime is in nanoseconds where
+** the platform has them, so an edit within the same second is seen.
+*/
+struct codestamp {
+  long long mtime;
+  long long size;
 };
 
-static struct codecache CC;
+static void
+codestamp_get(const char *filename, struct codestamp *st) {
+  struct stat buf;
+  st->mtime = 0;
+  st->size = 0;
+  if (stat(filename, &buf) != 0)
+    return;
+#if defined(__APPLE__)
+  st->mtime = (long long)buf.st_mtimespec.tv_sec * 1000000000LL + buf.st_mtimespec.tv_nsec;
+#elif defined(st_mtime)  /* POSIX.1-2008: st_mtime is st_mtim.tv_sec */
+  st->mtime = (long long)buf.st_mtim.tv_sec * 1000000000LL + buf.st_mtim.tv_nsec;
+#elif defined(__GLIBC__)  /* lprefix.h asks for an older POSIX */
+  st->mtime = (long long)buf.st_mtime * 1000000000LL + buf.st_mtimensec;
+#else
+  st->mtime = (long long)buf.st_mtime;
+#endif
+  st->size = (long long)buf.st_size;
+}
+
+static int
+codestamp_match(const struct codestamp *cached, const struct codestamp *st) {
+  /* a cached proto stays valid when its file is removed */
+  if (st->mtime == 0 && st->size == 0)
+    return 1;
+  return cached->mtime == st->mtime && cached->size == st->size;
+}
 
-static lua_State *
-newState(lua_State *fromL) {
-  lua_State *L = lua_newstate(luaL_alloc, NULL, G(fromL)->seed);
-  return L;
+static unsigned int
+codecache_hash(const char *key, size_t len) {
+  unsigned int h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+** Protos by file name. The table is split into shards with a lock each, so
+** services loading different files do not wait for each other.
+** Replaced and removed protos are never freed, functions cloned from them
+** may still be alive.
+*/
+#define CODECACHE_SHARDS 64
+
+struct codecache_entry {
+  struct codecache_entry *next;
+  const void *proto;
+  struct codestamp stamp;
+  unsigned int hash;
+  char key[1];
+};
+
+struct codecache_shard {
+  struct spinlock lock;
+  struct codecache_entry **slots;
+  unsigned int size;  /* number of slots, power of 2 */
+  unsigned int count;
+};
+
+static struct codecache_shard CC[CODECACHE_SHARDS];
+
+static struct codecache_shard *
+codecache_shard(unsigned int hash) {
+  return &CC[hash % CODECACHE_SHARDS];
+}
+
+static struct codecache_entry **
+codecache_find(struct codecache_shard *s, const char *key, unsigned int hash) {
+  struct codecache_entry **pe;
+  if (s->slots == NULL)
+    return NULL;
+  pe = &s->slots[(hash / CODECACHE_SHARDS) & (s->size - 1)];
+  for (; *pe != NULL; pe = &(*pe)->next) {
+    if ((*pe)->hash == hash && strcmp((*pe)->key, key) == 0)
+      return pe;
+  }
+  return pe;
+}
+
+static int
+codecache_grow(struct codecache_shard *s) {
+  unsigned int size = s->size ? s->size * 2 : 16;
+  unsigned int i;
+  struct codecache_entry **slots = (struct codecache_entry **)calloc(size, sizeof(*slots));
+  if (slots == NULL)
+    return 0;
+  for (i = 0; i < s->size; i++) {
+    struct codecache_entry *e = s->slots[i];
+    while (e) {
+      struct codecache_entry *next = e->next;
+      unsigned int idx = (e->hash / CODECACHE_SHARDS) & (size - 1);
+      e->next = slots[idx];
+      slots[idx] = e;
+      e = next;
+    }
+  }
+  free(s->slots);
+  s->slots = slots;
+  s->size = size;
+  return 1;
 }
 
 static void
-clearcache(void) {
-	if (CC.L == NULL)
-		return;
-	SPIN_LOCK(&CC)
-		lua_State *fromL = CC.L;
-		CC.L = newState(fromL);
-		lua_close(fromL);
-	SPIN_UNLOCK(&CC)
+codecache_remove(const char *key) {
+  unsigned int hash = codecache_hash(key, strlen(key));
+  struct codecache_shard *s = codecache_shard(hash);
+  struct codecache_entry **pe;
+  SPIN_LOCK(s)
+    pe = codecache_find(s, key, hash);
+    if (pe != NULL && *pe != NULL) {
+      struct codecache_entry *e = *pe;
+      *pe = e->next;
+      s->count--;
+      free(e);
+    }
+  SPIN_UNLOCK(s)
 }
 
 static void
-init(lua_State *L) {
-	CC.L = newState(L);
+clearcache(void) {
+  int i;
+  for (i = 0; i < CODECACHE_SHARDS; i++) {
+    struct codecache_shard *s = &CC[i];
+    unsigned int j;
+    SPIN_LOCK(s)
+      for (j = 0; j < s->size; j++) {
+        struct codecache_entry *e = s->slots[j];
+        while (e) {
+          struct codecache_entry *next = e->next;
+          free(e);
+          e = next;
+        }
+        s->slots[j] = NULL;
+      }
+      s->count = 0;
+    SPIN_UNLOCK(s)
+  }
 }
 
+static lua_State *
+newState(lua_State *fromL) {
+  lua_State *L = lua_newstate(luaL_alloc, NULL, G(fromL)->seed);
+  return L;
+}
 
 LUALIB_API void
 luaL_initcodecache(void) {
-	SPIN_INIT(&CC);
+  int i;
+  for (i = 0; i < CODECACHE_SHARDS; i++) {
+    SPIN_INIT(&CC[i]);
+  }
 }
 
+/* NULL when not cached or the file changed since it was cached */
 static const void *
-load_proto(const char *key) {
-  lua_State *L;
-  const void * result;
-  if (CC.L == NULL)
-    return NULL;
-  SPIN_LOCK(&CC)
-    L = CC.L;
-    lua_pushstring(L, key);
-    lua_rawget(L, LUA_REGISTRYINDEX);
-    result = lua_touserdata(L, -1);
-    lua_pop(L, 1);
-  SPIN_UNLOCK(&CC)
-
+load_proto(const char *key, const struct codestamp *st) {
+  unsigned int hash = codecache_hash(key, strlen(key));
+  struct codecache_shard *s = codecache_shard(hash);
+  struct codecache_entry **pe;
+  const void * result = NULL;
+  SPIN_LOCK(s)
+    pe = codecache_find(s, key, hash);
+    if (pe != NULL && *pe != NULL && codestamp_match(&(*pe)->stamp, st))
+      result = (*pe)->proto;
+  SPIN_UNLOCK(s)
   return result;
 }
 
+/*
+** Returns the proto another state cached for the same version of the file
+** first, otherwise NULL after proto is cached.
+*/
 static const void *
-save_proto(lua_State *fromL, const char *key, const void * proto) {
-  lua_State *L;
+save_proto(const char *key, const void * proto, const struct codestamp *st) {
+  size_t len = strlen(key);
+  unsigned int hash = codecache_hash(key, len);
+  struct codecache_shard *s = codecache_shard(hash);
+  struct codecache_entry **pe;
   const void * result = NULL;
 
-  SPIN_LOCK(&CC)
-    if (CC.L == NULL) {
-      init(fromL);
+  SPIN_LOCK(s)
+    if (s->count >= s->size && !codecache_grow(s)) {
+      SPIN_UNLOCK(s)
+      return NULL;  /* not cached */
     }
-    L = CC.L;
-    lua_pushstring(L, key);
-    lua_pushvalue(L, -1);
-    lua_rawget(L, LUA_REGISTRYINDEX);
-    result = lua_touserdata(L, -1); /* stack: key oldvalue */
-    if (result == NULL) {
-      lua_pop(L,1);
-      lua_pushlightuserdata(L, (void *)proto);
-      lua_rawset(L, LUA_REGISTRYINDEX);
+    pe = codecache_find(s, key, hash);
+    if (*pe != NULL) {
+      if (codestamp_match(&(*pe)->stamp, st)) {
+        result = (*pe)->proto;
+      } else {
+        (*pe)->proto = proto;
+        (*pe)->stamp = *st;
+      }
     } else {
-      lua_pop(L,2);
+      struct codecache_entry *e = (struct codecache_entry *)malloc(sizeof(*e) + len);
+      if (e != NULL) {
+        e->next = NULL;
+        e->proto = proto;
+        e->stamp = *st;
+        e->hash = hash;
+        memcpy(e->key, key, len + 1);
+        *pe = e;
+        s->count++;
+      }
     }
-
-  SPIN_UNLOCK(&CC)
+  SPIN_UNLOCK(s)
   return result;
 }
 
+/*
+** Precompiled bytecode bundle, mapped once at startup and never unmapped, so
+** protos are loaded in place without parsing or copying.
+**
+** "MOONLCB\1" count(uint32) then for each file, 16 bytes aligned:
+** keylen(uint32) codelen(uint32) mtime(int64) size(int64) key '\0' code
+*/
+#define BUNDLE_MAGIC "MOONLCB\1"
+#define BUNDLE_ALIGN 16
+
+struct bundle_entry {
+  const char *key;
+  const char *code;
+  size_t codelen;
+  struct codestamp stamp;
+  unsigned int hash;
+};
+
+struct codebundle {
+  const char *data;
+  size_t size;
+  unsigned int count;
+  unsigned int mask;  /* index size - 1 */
+  struct bundle_entry *entries;
+  unsigned int *index;  /* open addressing, entry + 1, 0 is empty */
+};
+
+static struct codebundle *BUNDLE = NULL;
+
+static size_t
+bundle_align(size_t n) {
+  return (n + BUNDLE_ALIGN - 1) & ~(size_t)(BUNDLE_ALIGN - 1);
+}
+
+static const char *
+bundle_map(const char *path, size_t *size) {
+#if defined(LUA_USE_POSIX)
+  struct stat st;
+  void *p;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+  *size = (size_t)st.st_size;
+  return (const char *)p;
+#else
+  char *p;
+  long n;
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return NULL;
+  if (fseek(f, 0, SEEK_END) != 0 || (n = ftell(f)) <= 0 || fseek(f, 0, SEEK_SET) != 0) {
+    fclose(f);
+    return NULL;
+  }
+  p = (char *)malloc((size_t)n);
+  if (p != NULL && fread(p, 1, (size_t)n, f) != (size_t)n) {
+    free(p);
+    p = NULL;
+  }
+  fclose(f);
+  *size = (size_t)n;
+  return p;
+#endif
+}
+
+static void
+bundle_unmap(const char *data, size_t size) {
+#if defined(LUA_USE_POSIX)
+  munmap((void *)data, size);
+#else
+  (void)size;
+  free((void *)data);
+#endif
+}
+
+static const char *
+bundle_index(struct codebundle *b) {
+  const char *data = b->data;
+  size_t pos = bundle_align(12);
+  unsigned int i;
+  for (i = 0; i < b->count; i++) {
+    struct bundle_entry *e = &b->entries[i];
+    unsigned int keylen, codelen, slot;
+    if (pos + 24 > b->size)
+      return "truncated code bundle";
+    memcpy(&keylen, data + pos, 4);
+    memcpy(&codelen, data + pos + 4, 4);
+    memcpy(&e->stamp.mtime, data + pos + 8, 8);
+    memcpy(&e->stamp.size, data + pos + 16, 8);
+    pos += 24;
+    if (pos + keylen + 1 > b->size || data[pos + keylen] != '\0')
+      return "truncated code bundle";
+    e->key = data + pos;
+    e->hash = codecache_hash(e->key, keylen);
+    pos = bundle_align(pos + keylen + 1);
+    if (pos + codelen > b->size)
+      return "truncated code bundle";
+    e->code = data + pos;
+    e->codelen = codelen;
+    pos = bundle_align(pos + codelen);
+    for (slot = e->hash & b->mask; b->index[slot] != 0; slot = (slot + 1) & b->mask)
+      ;
+    b->index[slot] = i + 1;
+  }
+  return NULL;
+}
+
+/*
+** Open the bytecode bundle written by codecache.dump, before any service
+** starts. Returns NULL or an error message.
+*/
+LUALIB_API const char *
+luaL_opencodebundle(const char *path) {
+  struct codebundle *b;
+  size_t size = 0;
+  unsigned int n, isize;
+  const char *data, *err = NULL;
+  if (BUNDLE != NULL)
+    return "code bundle already opened";
+  data = bundle_map(path, &size);
+  if (data == NULL)
+    return "can not read code bundle";
+  if (size < 12 || memcmp(data, BUNDLE_MAGIC, 8) != 0) {
+    bundle_unmap(data, size);
+    return "invalid code bundle";
+  }
+  memcpy(&n, data + 8, sizeof(n));
+  isize = 16;
+  while (isize < n * 2)
+    isize *= 2;
+  b = (struct codebundle *)calloc(1, sizeof(*b));
+  if (b != NULL) {
+    b->entries = (struct bundle_entry *)calloc(n ? n : 1, sizeof(struct bundle_entry));
+    b->index = (unsigned int *)calloc(isize, sizeof(unsigned int));
+  }
+  if (b == NULL || b->entries == NULL || b->index == NULL) {
+    err = "not enough memory";
+  } else {
+    b->data = data;
+    b->size = size;
+    b->count = n;
+    b->mask = isize - 1;
+    err = bundle_index(b);
+  }
+  if (err != NULL) {
+    if (b != NULL) {
+      free(b->entries);
+      free(b->index);
+      free(b);
+    }
+    bundle_unmap(data, size);
+    return err;
+  }
+  BUNDLE = b;
+  return NULL;
+}
+
+static const struct bundle_entry *
+bundle_find(const char *key) {
+  const struct codebundle *b = BUNDLE;
+  unsigned int hash, slot;
+  if (b == NULL)
+    return NULL;
+  hash = codecache_hash(key, strlen(key));
+  for (slot = hash & b->mask; b->index[slot] != 0; slot = (slot + 1) & b->mask) {
+    const struct bundle_entry *e = &b->entries[b->index[slot] - 1];
+    if (e->hash == hash && strcmp(e->key, key) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+/* Load from the bundle when it has the same version of the file, else parse it */
+static int
+load_source(lua_State *L, const char *filename, const char *mode, const struct codestamp *st) {
+  const struct bundle_entry *e = bundle_find(filename);
+  if (e != NULL && codestamp_match(&e->stamp, st) && (mode == NULL || strchr(mode, 'b') != NULL)) {
+    if (luaL_loadbufferx(L, e->code, e->codelen, filename, "B") == LUA_OK)
+      return LUA_OK;
+    lua_pop(L, 1);  /* built by another Lua version, use the source */
+  }
+  return luaL_loadfilex_(L, filename, mode);
+}
+
 #define CACHE_OFF 0
 #define CACHE_EXIST 1
 #define CACHE_ON 2
@@ -1333,23 +1675,25 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
   lua_State * eL;
   int err;
   const void * oldv;
+  struct codestamp st;
   if (level == CACHE_OFF || filename == NULL) {
     return luaL_loadfilex_(L, filename, mode);
   }
-  proto = load_proto(filename);
+  codestamp_get(filename, &st);
+  proto = load_proto(filename, &st);
   if (proto) {
     lua_clonefunction(L, proto);
     return LUA_OK;
   }
   if (level == CACHE_EXIST) {
-    return luaL_loadfilex_(L, filename, mode);
+    return load_source(L, filename, mode, &st);
   }
   eL = newState(L);
   if (eL == NULL) {
     lua_pushliteral(L, "New state failed");
     return LUA_ERRMEM;
   }
-  err = luaL_loadfilex_(eL, filename, mode);
+  err = load_source(eL, filename, mode, &st);
   if (err != LUA_OK) {
     size_t sz = 0;
     const char * msg = lua_tolstring(eL, -1, &sz);
@@ -1359,7 +1703,7 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
   }
   lua_sharefunction(eL, -1);
   proto = lua_topointer(eL, -1);
-  oldv = save_proto(L, filename, proto);
+  oldv = save_proto(filename, proto, &st);
   if (oldv) {
     lua_close(eL);
     lua_clonefunction(L, oldv);
@@ -1378,9 +1722,126 @@ cache_clear(lua_State *L) {
 	return 0;
 }
 
+/* Drop the cached proto of one file, the next load parses it again */
+static int
+cache_invalidate(lua_State *L) {
+	codecache_remove(luaL_checkstring(L, 1));
+	return 0;
+}
+
+struct dumpbuf {
+	char *p;
+	size_t n;
+	size_t cap;
+};
+
+static int
+dump_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	struct dumpbuf *b = (struct dumpbuf *)ud;
+	(void)L;
+	if (b->n + sz > b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 4096;
+		char *np;
+		while (cap < b->n + sz)
+			cap *= 2;
+		np = (char *)realloc(b->p, cap);
+		if (np == NULL)
+			return 1;
+		b->p = np;
+		b->cap = cap;
+	}
+	memcpy(b->p + b->n, p, sz);
+	b->n += sz;
+	return 0;
+}
+
+static int
+dump_pad(FILE *f, size_t *pos) {
+	static const char zero[BUNDLE_ALIGN] = { 0 };
+	size_t n = bundle_align(*pos) - *pos;
+	*pos += n;
+	return n == 0 || fwrite(zero, 1, n, f) == n;
+}
+
+/*
+** dump(path, files): write a bytecode bundle of the Lua files, keyed by the
+** names in files. Returns the number of files, or nil and an error message.
+*/
+static int
+cache_dump(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	unsigned int i, n;
+	size_t pos = 0;
+	int ok = 1;
+	struct dumpbuf b = { NULL, 0, 0 };
+	FILE *f;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = (unsigned int)luaL_len(L, 2);
+	/* check before the file is opened, errors below do not unwind */
+	for (i = 1; i <= n; i++) {
+		if (lua_geti(L, 2, i) != LUA_TSTRING)
+			return luaL_argerror(L, 2, lua_pushfstring(L, "file %d is not a string", (int)i));
+		lua_pop(L, 1);
+	}
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		luaL_pushfail(L);
+		lua_pushfstring(L, "can not open %s: %s", path, strerror(errno));
+		return 2;
+	}
+	ok = fwrite(BUNDLE_MAGIC, 1, 8, f) == 8 && fwrite(&n, sizeof(n), 1, f) == 1;
+	pos = 12;
+	for (i = 1; ok && i <= n; i++) {
+		struct codestamp st;
+		const char *key;
+		size_t keylen;
+		unsigned int header[2];
+		lua_geti(L, 2, i);
+		key = lua_tolstring(L, -1, &keylen);
+		if (luaL_loadfilex_(L, key, "t") != LUA_OK) {
+			fclose(f);
+			free(b.p);
+			remove(path);
+			luaL_pushfail(L);
+			lua_insert(L, -2);
+			return 2;
+		}
+		b.n = 0;
+		if (lua_dump(L, dump_writer, &b, 0) != 0) {
+			ok = 0;
+			break;
+		}
+		lua_pop(L, 2);
+		codestamp_get(key, &st);
+		header[0] = (unsigned int)keylen;
+		header[1] = (unsigned int)b.n;
+		ok = dump_pad(f, &pos)
+			&& fwrite(header, sizeof(header), 1, f) == 1
+			&& fwrite(&st.mtime, 8, 1, f) == 1
+			&& fwrite(&st.size, 8, 1, f) == 1
+			&& fwrite(key, 1, keylen + 1, f) == keylen + 1;
+		pos += 24 + keylen + 1;
+		ok = ok && dump_pad(f, &pos) && fwrite(b.p, 1, b.n, f) == b.n;
+		pos += b.n;
+	}
+	free(b.p);
+	if (fclose(f) != 0)
+		ok = 0;
+	if (!ok) {
+		remove(path);
+		luaL_pushfail(L);
+		lua_pushfstring(L, "can not write %s", path);
+		return 2;
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
 LUAMOD_API int luaopen_cache(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "clear", cache_clear },
+		{ "invalidate", cache_invalidate },
+		{ "dump", cache_dump },
 		{ "mode", cache_mode },
 		{ NULL, NULL },
 	};
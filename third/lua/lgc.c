@@ -1734,8 +1734,14 @@ static void incstep (lua_State *L, global_State *g) {
 }
 
 
+static lua_GCTrace gctrace = NULL;
+
+LUA_API void lua_setgctrace (lua_GCTrace f) {
+  gctrace = f;
+}
+
 #if !defined(luai_tracegc)
-#define luai_tracegc(L,f)		((void)0)
+#define luai_tracegc(L,f)		{ if (gctrace) gctrace(L, f); }
 #endif
 
 /*
@@ -1793,6 +1799,7 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   lua_assert(!g->gcemergency);
   g->gcemergency = cast_byte(isemergency);  /* set flag */
+  luai_tracegc(L, 1);
   switch (g->gckind) {
     case KGC_GENMINOR: fullgen(L, g); break;
     case KGC_INC: fullinc(L, g); break;
@@ -1802,6 +1809,7 @@ void luaC_fullgc (lua_State *L, int isemergency) {
       g->gckind = KGC_GENMAJOR;
       break;
   }
+  luai_tracegc(L, 0);
   g->gcemergency = 0;
 }
 
@@ -363,6 +363,10 @@ LUA_API void (lua_warning)  (lua_State *L, const char *msg, int tocont);
 
 LUA_API int (lua_gc) (lua_State *L, int what, ...);
 
+/* called with begin 1 before and 0 after each GC step or full collection */
+typedef void (*lua_GCTrace) (lua_State *L, int begin);
+LUA_API void  (lua_setgctrace) (lua_GCTrace f);
+
 
 /*
 ** miscellaneous functions
@@ -24,6 +24,7 @@ LUAMOD_API int (luaopen_package) (lua_State *L);
 #define LUA_CACHELIB
 LUAMOD_API int (luaopen_cache) (lua_State *L);
 LUALIB_API void (luaL_initcodecache) (void);
+LUALIB_API const char *(luaL_opencodebundle) (const char *path);
 
 #define LUA_COLIBNAME	"coroutine"
 #define LUA_COLIBK	(LUA_LOADLIBK << 1)